@@ -5,55 +5,73 @@
 #include <Windows.h>
 #endif
 
-void VkBufferTools::CreateBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VkBufferUsageFlags usage, VmaMemoryUsage properties, VK::Buffer& buffer)
+VK::UploadToken VkBufferTools::CreateBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VkBufferUsageFlags usage, VmaMemoryUsage properties, VK::Buffer& buffer,
+    VkDeviceSize alignment)
 {
-    auto staging = target->vmaPools_.transfer.alloc(memory, size);
+    VK::StagingSlice staging = target->AllocStaging(memory, size);
 
-    if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT)
+    if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT)
+        buffer = target->vmaPools_.storage.alloc(memory, size);
+    else if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT)
         buffer = target->vmaPools_.uniform.alloc(memory, size);
     else if (usage & VK_BUFFER_USAGE_VERTEX_BUFFER_BIT)
-        buffer = target->vmaPools_.vertex.alloc(memory, size);
+        buffer = target->vmaPools_.vertex.alloc(memory, size, alignment);
     else if (usage & VK_BUFFER_USAGE_INDEX_BUFFER_BIT)
-        buffer = target->vmaPools_.index.alloc(memory, size);
+        buffer = target->vmaPools_.index.alloc(memory, size, alignment);
     
     // Copy buffers
 
-    target->BeginUploadCommands();
+    VkCommandBuffer cmd = target->BeginUploadCommands(true);
 
     VkBufferCopy vbCopyRegion = {};
-    vbCopyRegion.srcOffset = 0;
-    vbCopyRegion.dstOffset = 0;
+    vbCopyRegion.srcOffset = staging.offset;
+    vbCopyRegion.dstOffset = buffer.offset;
     vbCopyRegion.size = size;
-    vkCmdCopyBuffer(target->GetUploadCmd(), staging.buffer, buffer.buffer, 1, &vbCopyRegion);
-
-    VkBufferMemoryBarrier2KHR bufferMemoryBarrier = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2 };
-    bufferMemoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT_KHR;
-    bufferMemoryBarrier.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
-    bufferMemoryBarrier.dstStageMask = VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT_KHR;
-    bufferMemoryBarrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT_KHR;
-    bufferMemoryBarrier.buffer = buffer.buffer;
-    bufferMemoryBarrier.size = VK_WHOLE_SIZE;
-
-    VkDependencyInfoKHR dependencyInfo = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR };
-    dependencyInfo.pBufferMemoryBarriers = &bufferMemoryBarrier;
-    dependencyInfo.bufferMemoryBarrierCount = 1;
+    vkCmdCopyBuffer(cmd, staging.buffer, buffer.buffer, 1, &vbCopyRegion);
 
-    //vkCmdPipelineBarrier2(target->uploadCommandBuffer, &dependencyInfo);
+    //One barrier covers every copy in the batch, it only needs to reach the stages that read this buffer
+    VkPipelineStageFlags2 dstStage = 0;
+    VkAccessFlags2 dstAccess = 0;
+    if (usage & VK_BUFFER_USAGE_VERTEX_BUFFER_BIT)
+    {
+        dstStage |= VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT_KHR;
+        dstAccess |= VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT_KHR;
+    }
+    if (usage & VK_BUFFER_USAGE_INDEX_BUFFER_BIT)
+    {
+        dstStage |= VK_PIPELINE_STAGE_2_INDEX_INPUT_BIT_KHR;
+        dstAccess |= VK_ACCESS_2_INDEX_READ_BIT_KHR;
+    }
+    if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT)
+    {
+        dstStage |= VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT_KHR;
+        dstAccess |= VK_ACCESS_2_UNIFORM_READ_BIT_KHR;
+    }
+    if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT)
+    {
+        dstStage |= VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT_KHR;
+        dstAccess |= VK_ACCESS_2_SHADER_STORAGE_READ_BIT_KHR;
+    }
+    target->AddUploadBarrier(buffer, dstStage, dstAccess, true);
+    return target->GetUploadToken(true);
+}
 
-    target->PushSingleFrameBuffer(staging);
+VK::UploadToken VkBufferTools::CreateVertexBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer, VkDeviceSize stride)
+{
+    return VkBufferTools::CreateBuffer(target, size, memory, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, buffer, stride);
 }
 
-void VkBufferTools::CreateVertexBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer)
+VK::UploadToken VkBufferTools::CreateIndexBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer, VkDeviceSize indexSize)
 {
-    VkBufferTools::CreateBuffer(target, size, memory, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, buffer);
+    return VkBufferTools::CreateBuffer(target, size, memory, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, buffer, indexSize);
 }
 
-void VkBufferTools::CreateIndexBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer)
+VK::UploadToken VkBufferTools::CreateUniformBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer)
 {
-    VkBufferTools::CreateBuffer(target, size, memory, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, buffer);
+    return VkBufferTools::CreateBuffer(target, size, memory, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, buffer);
 }
 
-void VkBufferTools::CreateUniformBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer)
+VK::UploadToken VkBufferTools::CreateStorageBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer)
 {
-    VkBufferTools::CreateBuffer(target, size, memory, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, buffer);
+    return VkBufferTools::CreateBuffer(target, size, memory, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, buffer);
 }
@@ -7,10 +7,14 @@
 class VkBufferTools
 {
 public:
-    static void CreateBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VkBufferUsageFlags usage, VmaMemoryUsage properties, VK::Buffer& buffer);
-    static void CreateVertexBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer);
-    static void CreateIndexBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer);
-    static void CreateUniformBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer);
+    //Copies on the transfer queue when the target's asyncTransfer is on, the buffer is usable once the token completes
+    static VK::UploadToken CreateBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VkBufferUsageFlags usage, VmaMemoryUsage properties, VK::Buffer& buffer,
+        VkDeviceSize alignment = 16);
+    //With the target's sharedBufferSize set, buffer.offset / stride is the vertexOffset and buffer.offset / indexSize the firstIndex to draw with
+    static VK::UploadToken CreateVertexBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer, VkDeviceSize stride = 16);
+    static VK::UploadToken CreateIndexBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer, VkDeviceSize indexSize = 4);
+    static VK::UploadToken CreateUniformBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer);
+    static VK::UploadToken CreateStorageBuffer(VkRenderTarget* target, VkDeviceSize size, void* memory, VK::Buffer& buffer);
 };
 
 #endif
\ No newline at end of file
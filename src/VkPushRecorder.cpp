@@ -0,0 +1,69 @@
+#include "VkPushRecorder.h"
+#include <string.h>
+
+void VkPushRecorder::Push(VkCommandBuffer command, VkPipelineLayout layout, VkShaderStageFlags stages, uint32_t offset, const void* data,
+    const uint32_t* members, uint32_t memberCount)
+{
+    if (command != command_ || layout != layout_)
+    {
+        //Push constants only survive between compatible layouts, start over rather than track compatibility
+        command_ = command;
+        layout_ = layout;
+        known_.assign(known_.size(), 0);
+    }
+    uint32_t end = offset + members[memberCount];
+    if (shadow_.size() < end)
+    {
+        shadow_.resize(end);
+        known_.resize(end, 0);
+    }
+    frameFullBytes += members[memberCount];
+
+    const uint8_t* src = (const uint8_t*)data - offset;
+    uint32_t rangeStart = 0, rangeEnd = 0;
+    bool open = false;
+    for (uint32_t m = 0; m < memberCount; ++m)
+    {
+        uint32_t start = offset + members[m], stop = offset + members[m + 1];
+        bool dirty = memcmp(&shadow_[start], src + start, stop - start) != 0 ||
+            memchr(&known_[start], 0, stop - start) != nullptr;
+        if (!dirty)
+            continue;
+        if (open && start - rangeEnd <= MERGE_GAP)
+        {
+            rangeEnd = stop;
+            continue;
+        }
+        if (open)
+            flush(stages, rangeStart, rangeEnd, src);
+        rangeStart = start;
+        rangeEnd = stop;
+        open = true;
+    }
+    if (open)
+        flush(stages, rangeStart, rangeEnd, src);
+}
+
+void VkPushRecorder::flush(VkShaderStageFlags stages, uint32_t start, uint32_t end, const uint8_t* src)
+{
+    vkCmdPushConstants(command_, layout_, stages, start, end - start, src + start);
+    memcpy(&shadow_[start], src + start, end - start);
+    memset(&known_[start], 1, end - start);
+    frameBytes += end - start;
+    ++frameCalls;
+}
+
+void VkPushRecorder::Invalidate()
+{
+    command_ = VK_NULL_HANDLE;
+    layout_ = VK_NULL_HANDLE;
+}
+
+void VkPushRecorder::NewFrame()
+{
+    lastFrameBytes = frameBytes;
+    lastFrameCalls = frameCalls;
+    lastFrameFullBytes = frameFullBytes;
+    frameBytes = frameCalls = frameFullBytes = 0;
+    Invalidate();
+}
@@ -0,0 +1,37 @@
+#ifndef VK_PUSH_RECORDER_H
+#define VK_PUSH_RECORDER_H
+
+#include "vulkan/vulkan.h"
+#include <stdint.h>
+#include <vector>
+
+//Shadows the push constant bytes last recorded into a command buffer, used by collections generated with
+//"deltaPushConstants". Only members that differ from the shadow are pushed, nearby dirty members share one call.
+class VkPushRecorder
+{
+public:
+    //Dirty members at most this many bytes apart are pushed together
+    static const uint32_t MERGE_GAP = 16;
+
+    //members holds memberCount + 1 boundaries relative to data, the last one is the size of the block
+    void Push(VkCommandBuffer command, VkPipelineLayout layout, VkShaderStageFlags stages, uint32_t offset, const void* data,
+        const uint32_t* members, uint32_t memberCount);
+    //Forget the shadow, needed after anything else pushes constants into the same command buffer
+    void Invalidate();
+    //Called by VkRenderTarget::StartRender, moves the counters into the lastFrame* fields
+    void NewFrame();
+
+    uint64_t frameBytes = 0, frameCalls = 0, frameFullBytes = 0;
+    //Bytes and vkCmdPushConstants calls recorded last frame, and the bytes whole block pushes would have taken
+    uint64_t lastFrameBytes = 0, lastFrameCalls = 0, lastFrameFullBytes = 0;
+
+private:
+    VkCommandBuffer command_ = VK_NULL_HANDLE;
+    VkPipelineLayout layout_ = VK_NULL_HANDLE;
+    std::vector<uint8_t> shadow_;
+    std::vector<uint8_t> known_;
+
+    void flush(VkShaderStageFlags stages, uint32_t start, uint32_t end, const uint8_t* src);
+};
+
+#endif
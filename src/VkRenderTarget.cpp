@@ -37,6 +37,10 @@ bool VK_EXT_memory_budget_enabled = false;
 bool VK_AMD_device_coherent_memory_enabled = false;
 bool VK_EXT_buffer_device_address_enabled = false;
 bool VK_KHR_buffer_device_address_enabled = false;
+bool VK_EXT_graphics_pipeline_library_enabled = false;
+bool VK_EXT_shader_object_enabled = false;
+bool VK_EXT_vertex_input_dynamic_state_enabled = false;
+bool VK_EXT_descriptor_buffer_enabled = false;
 bool g_SparseBindingEnabled = false;
 bool g_BufferDeviceAddressEnabled = false;
 
@@ -53,6 +57,22 @@ const bool enableValidationLayers = true;
 PFN_vkCmdSetColorWriteMaskEXT vkCmdSetColorWriteMaskEXT_ = nullptr;
 #endif
 PFN_vkCmdSetColorBlendEquationEXT vkCmdSetColorBlendEquationEXT_ = nullptr;
+PFN_vkCreateShadersEXT vkCreateShadersEXT_ = nullptr;
+PFN_vkDestroyShaderEXT vkDestroyShaderEXT_ = nullptr;
+PFN_vkCmdBindShadersEXT vkCmdBindShadersEXT_ = nullptr;
+PFN_vkCmdSetVertexInputEXT vkCmdSetVertexInputEXT_ = nullptr;
+PFN_vkCmdSetPolygonModeEXT vkCmdSetPolygonModeEXT_ = nullptr;
+PFN_vkCmdSetRasterizationSamplesEXT vkCmdSetRasterizationSamplesEXT_ = nullptr;
+PFN_vkCmdSetSampleMaskEXT vkCmdSetSampleMaskEXT_ = nullptr;
+PFN_vkCmdSetAlphaToCoverageEnableEXT vkCmdSetAlphaToCoverageEnableEXT_ = nullptr;
+PFN_vkCmdSetDepthClampEnableEXT vkCmdSetDepthClampEnableEXT_ = nullptr;
+PFN_vkCmdSetLogicOpEnableEXT vkCmdSetLogicOpEnableEXT_ = nullptr;
+PFN_vkCmdSetColorBlendEnableEXT vkCmdSetColorBlendEnableEXT_ = nullptr;
+PFN_vkGetDescriptorSetLayoutSizeEXT vkGetDescriptorSetLayoutSizeEXT_ = nullptr;
+PFN_vkGetDescriptorSetLayoutBindingOffsetEXT vkGetDescriptorSetLayoutBindingOffsetEXT_ = nullptr;
+PFN_vkGetDescriptorEXT vkGetDescriptorEXT_ = nullptr;
+PFN_vkCmdBindDescriptorBuffersEXT vkCmdBindDescriptorBuffersEXT_ = nullptr;
+PFN_vkCmdSetDescriptorBufferOffsetsEXT vkCmdSetDescriptorBufferOffsetsEXT_ = nullptr;
 
 void VkRenderTarget::InitVulkan(void* window)
 {
@@ -62,6 +82,10 @@ void VkRenderTarget::InitVulkan(void* window)
 	pickPhysicalDevice();
 	createLogicalDevice();
 	createMemAlloc();
+	createUniformRings();
+	createDescriptorRings();
+	for (auto& ring : stagingRings_)
+		createStagingRing(ring, stagingRingSize);
 	createSwapChain(window);
 	createImageViews();
 	createRenderPass();
@@ -74,15 +98,243 @@ void VkRenderTarget::InitVulkan(void* window)
 	window_ = window;
 }
 
-void VkRenderTarget::BeginUploadCommands()
+//Reuses a batch its timeline has passed, usually one per frame in flight, more when framebuffers split a frame's uploads
+int VkRenderTarget::beginBatch(VkCommandPool pool, VkSemaphore timeline, std::vector<VK::UploadBatch>& batches)
 {
-	if (!uploadStarted_)
+	uint64_t completed = 0;
+	vkGetSemaphoreCounterValue(device, timeline, &completed);
+	int open = -1;
+	for (int i = 0; i < batches.size() && open < 0; ++i)
 	{
-		VkCommandBufferBeginInfo cmdBufBeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
-		cmdBufBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-		vkBeginCommandBuffer(uploadCommandBuffer[currUpload_], &cmdBufBeginInfo);
-		uploadStarted_ = true;
+		if (batches[i].value <= completed)
+			open = i;
 	}
+	if (open < 0)
+	{
+		VK::UploadBatch batch = {};
+		VkCommandBufferAllocateInfo commandBufferInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+		commandBufferInfo.commandPool = pool;
+		commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		commandBufferInfo.commandBufferCount = 1;
+		vkAllocateCommandBuffers(device, &commandBufferInfo, &batch.cmd);
+		open = (int)batches.size();
+		batches.push_back(batch);
+	}
+	//Never free until the submission carrying it is known
+	batches[open].value = UINT64_MAX;
+	VkCommandBufferBeginInfo cmdBufBeginInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+	cmdBufBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(batches[open].cmd, &cmdBufBeginInfo);
+	return open;
+}
+
+VkCommandBuffer VkRenderTarget::BeginUploadCommands(bool transfer)
+{
+	if (transfer && asyncTransfer)
+	{
+		if (openTransfer_ < 0)
+			openTransfer_ = beginBatch(transferPool_, transferTimeline, transferBatches_);
+		return transferBatches_[openTransfer_].cmd;
+	}
+	if (openUpload_ < 0)
+		openUpload_ = beginBatch(commandPool, graphicsTimeline, uploadBatches_);
+	return uploadBatches_[openUpload_].cmd;
+}
+
+void VkRenderTarget::AddUploadBarrier(const VK::Buffer& buffer, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess, bool transfer)
+{
+	if (!transfer || !asyncTransfer)
+	{
+		uploadBarrier_.dstStageMask |= dstStage;
+		uploadBarrier_.dstAccessMask |= dstAccess;
+		return;
+	}
+	//The transfer queue releases the buffer after its copies, the graphics queue acquires it once they are done
+	VkBufferMemoryBarrier2 release = { VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2 };
+	release.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT_KHR;
+	release.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR;
+	release.srcQueueFamilyIndex = transferFamily_;
+	release.dstQueueFamilyIndex = graphicsFamily_;
+	//Only the uploaded range changes owner, the rest of a shared buffer stays with the graphics queue
+	release.buffer = buffer.buffer;
+	release.offset = buffer.offset;
+	release.size = buffer.size;
+	releaseBuffers_.push_back(release);
+
+	VK::UploadAcquire acquire = {};
+	acquire.value = transferValue_ + 1;
+	acquire.bufferBarrier = release;
+	acquire.bufferBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE_KHR;
+	acquire.bufferBarrier.srcAccessMask = VK_ACCESS_2_NONE_KHR;
+	acquire.bufferBarrier.dstStageMask = dstStage;
+	acquire.bufferBarrier.dstAccessMask = dstAccess;
+	acquires_.push_back(acquire);
+}
+
+void VkRenderTarget::AddUploadImageBarrier(const VkImageMemoryBarrier2& barrier, bool transfer)
+{
+	if (!transfer || !asyncTransfer)
+	{
+		uploadImageBarriers_.push_back(barrier);
+		return;
+	}
+	//Both halves carry the same layout transition, it happens once between them
+	VkImageMemoryBarrier2 release = barrier;
+	release.dstStageMask = VK_PIPELINE_STAGE_2_NONE_KHR;
+	release.dstAccessMask = VK_ACCESS_2_NONE_KHR;
+	release.srcQueueFamilyIndex = transferFamily_;
+	release.dstQueueFamilyIndex = graphicsFamily_;
+	releaseImages_.push_back(release);
+
+	VK::UploadAcquire acquire = {};
+	acquire.value = transferValue_ + 1;
+	acquire.image = true;
+	acquire.imageBarrier = barrier;
+	acquire.imageBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE_KHR;
+	acquire.imageBarrier.srcAccessMask = VK_ACCESS_2_NONE_KHR;
+	acquire.imageBarrier.srcQueueFamilyIndex = transferFamily_;
+	acquire.imageBarrier.dstQueueFamilyIndex = graphicsFamily_;
+	acquires_.push_back(acquire);
+}
+
+VK::UploadToken VkRenderTarget::GetUploadToken(bool transfer)
+{
+	if (transfer && asyncTransfer)
+		return { openTransfer_ < 0 ? transferValue_ : transferValue_ + 1, true };
+	return { graphicsValue_ + 1, false };
+}
+
+bool VkRenderTarget::IsUploadComplete(VK::UploadToken token)
+{
+	uint64_t completed = 0;
+	vkGetSemaphoreCounterValue(device, token.transfer ? transferTimeline : graphicsTimeline, &completed);
+	return completed >= token.value;
+}
+
+void VkRenderTarget::WaitUpload(VK::UploadToken token)
+{
+	if (!token.transfer)
+		return;
+	flushTransfer();
+	VkSemaphoreWaitInfo waitInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO };
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &transferTimeline;
+	waitInfo.pValues = &token.value;
+	vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+}
+
+//Submits the open transfer batch with the release halves of its ownership transfers, signaling transferValue_ + 1
+void VkRenderTarget::flushTransfer()
+{
+	if (openTransfer_ < 0)
+		return;
+	VK::UploadBatch& batch = transferBatches_[openTransfer_];
+	if (!releaseBuffers_.empty() || !releaseImages_.empty())
+	{
+		VkDependencyInfoKHR dependencyInfo = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR };
+		dependencyInfo.bufferMemoryBarrierCount = (uint32_t)releaseBuffers_.size();
+		dependencyInfo.pBufferMemoryBarriers = releaseBuffers_.data();
+		dependencyInfo.imageMemoryBarrierCount = (uint32_t)releaseImages_.size();
+		dependencyInfo.pImageMemoryBarriers = releaseImages_.data();
+		vkCmdPipelineBarrier2(batch.cmd, &dependencyInfo);
+	}
+	vkEndCommandBuffer(batch.cmd);
+	releaseBuffers_.clear();
+	releaseImages_.clear();
+	batch.value = ++transferValue_;
+	//Conservative, the rings may also hold graphics batch uploads
+	for (uint32_t i = 0; i < COMMAND_BUFFER_COUNT; ++i)
+	{
+		if (uploadRings_ & (1 << i))
+			stagingRings_[i].transferValue = transferValue_;
+	}
+	openTransfer_ = -1;
+
+	VkCommandBufferSubmitInfo cmdSubmit = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO };
+	cmdSubmit.commandBuffer = batch.cmd;
+	VkSemaphoreSubmitInfo timelineInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+	timelineInfo.semaphore = transferTimeline;
+	timelineInfo.value = transferValue_;
+	timelineInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+
+	VkSubmitInfo2 submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO_2 };
+	submitInfo.commandBufferInfoCount = 1;
+	submitInfo.pCommandBufferInfos = &cmdSubmit;
+	submitInfo.signalSemaphoreInfoCount = 1;
+	submitInfo.pSignalSemaphoreInfos = &timelineInfo;
+	if (vkQueueSubmit2(transferQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+		throw std::runtime_error("failed to submit transfer command buffer!");
+}
+
+//Closes the open batch for the next graphics submission, which signals graphicsValue_ + 1. With asyncTransfer it also
+//flushes the transfer batch and acquires the transfer uploads that are done, transferWait is set when any were
+bool VkRenderTarget::endUploads(VkCommandBufferSubmitInfo& info, VkSemaphoreSubmitInfo& transferWait)
+{
+	transferWait = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+	if (asyncTransfer)
+	{
+		flushTransfer();
+		//Only what already finished is acquired, the submission never stalls on copies still in flight
+		uint64_t completed = 0;
+		vkGetSemaphoreCounterValue(device, transferTimeline, &completed);
+		size_t pending = 0;
+		for (auto& acquire : acquires_)
+		{
+			if (acquire.value > completed)
+			{
+				acquires_[pending++] = acquire;
+				continue;
+			}
+			BeginUploadCommands();
+			if (acquire.image)
+				uploadImageBarriers_.push_back(acquire.imageBarrier);
+			else
+				uploadBufferBarriers_.push_back(acquire.bufferBarrier);
+			transferWait.value = std::max(transferWait.value, acquire.value);
+		}
+		acquires_.resize(pending);
+		if (transferWait.value > 0)
+		{
+			//Already signaled, the wait only orders the copies' writes before the acquires
+			transferWait.semaphore = transferTimeline;
+			transferWait.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+		}
+	}
+	if (openUpload_ < 0)
+		return false;
+	VK::UploadBatch& batch = uploadBatches_[openUpload_];
+
+	//Copies into buffers are made visible with one memory barrier, images keep their own layout transitions
+	uploadBarrier_.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT_KHR;
+	uploadBarrier_.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
+	uploadBarrier_.dstStageMask |= VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT_KHR;
+	uploadBarrier_.dstAccessMask |= VK_ACCESS_2_MEMORY_READ_BIT_KHR;
+
+	VkDependencyInfoKHR dependencyInfo = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR };
+	dependencyInfo.memoryBarrierCount = 1;
+	dependencyInfo.pMemoryBarriers = &uploadBarrier_;
+	dependencyInfo.bufferMemoryBarrierCount = (uint32_t)uploadBufferBarriers_.size();
+	dependencyInfo.pBufferMemoryBarriers = uploadBufferBarriers_.data();
+	dependencyInfo.imageMemoryBarrierCount = (uint32_t)uploadImageBarriers_.size();
+	dependencyInfo.pImageMemoryBarriers = uploadImageBarriers_.data();
+	vkCmdPipelineBarrier2(batch.cmd, &dependencyInfo);
+	vkEndCommandBuffer(batch.cmd);
+
+	uploadBarrier_ = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+	uploadBufferBarriers_.clear();
+	uploadImageBarriers_.clear();
+	batch.value = graphicsValue_ + 1;
+	for (uint32_t i = 0; i < COMMAND_BUFFER_COUNT; ++i)
+	{
+		if (uploadRings_ & (1 << i))
+			stagingRings_[i].value = batch.value;
+	}
+	uploadRings_ = 0;
+	openUpload_ = -1;
+
+	info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO };
+	info.commandBuffer = batch.cmd;
+	return true;
 }
 
 void VkRenderTarget::BeginFramebuffer(VkExtent2D extent, VkFormat imageFormat)
@@ -96,36 +348,32 @@ void VkRenderTarget::BeginFramebuffer(VkExtent2D extent, VkFormat imageFormat)
 
 	VK::CreateTexture(this, fbo.image, extent.width, extent.height, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, {}, imageFormat);
 	fbo.image.imageView = createImageView(fbo.image.image, imageFormat);
-	VK::CreateTexture(this, fbo.depth, extent.width, extent.height, (uint32_t)0, {}, VK_FORMAT_D24_UNORM_S8_UINT);
-	fbo.depth.imageView = createImageView(fbo.depth.image, VK_FORMAT_D24_UNORM_S8_UINT);
+	VK::CreateTexture(this, fbo.depth, extent.width, extent.height, (uint32_t)0, {}, depthFormat);
+	fbo.depth.imageView = createImageView(fbo.depth.image, depthFormat);
 	
-	VkImageView attachments[] = {
-		fbo.image.imageView, fbo.depth.imageView
-	};
+	if (!dynamicRendering)
+	{
+		VkImageView attachments[] = {
+			fbo.image.imageView, fbo.depth.imageView
+		};
 
-	VkFramebufferCreateInfo framebufferInfo = {};
-	framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-	framebufferInfo.renderPass = fboPass;
-	framebufferInfo.attachmentCount = 2;
-	framebufferInfo.pAttachments = attachments;
-	framebufferInfo.width = extent.width;
-	framebufferInfo.height = extent.height;
-	framebufferInfo.layers = 1;
+		VkFramebufferCreateInfo framebufferInfo = {};
+		framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		framebufferInfo.renderPass = fboPass;
+		framebufferInfo.attachmentCount = 2;
+		framebufferInfo.pAttachments = attachments;
+		framebufferInfo.width = extent.width;
+		framebufferInfo.height = extent.height;
+		framebufferInfo.layers = 1;
 
-	if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &fbo.fbo) != VK_SUCCESS) {
+		if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &fbo.fbo) != VK_SUCCESS) {
+		}
 	}
 
 
-	VkCommandBufferBeginInfo beginInfo = {};
-	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
-	vkWaitForFences(device, 1, &fboFence, VK_TRUE, UINT32_MAX);
-	vkResetFences(device, 1, &fboFence);
-
-	if (vkBeginCommandBuffer(fboCmd, &beginInfo) != VK_SUCCESS) {
-		throw std::runtime_error("failed to begin recording command buffer!");
-	}
+	//A command buffer the timeline has passed, so framebuffers never wait for the previous one
+	openFbo_ = beginBatch(commandPool, graphicsTimeline, fboBatches_);
+	fboCmd = fboBatches_[openFbo_].cmd;
 
 	VkRenderPassBeginInfo renderPassInfo = {};
 	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
@@ -157,17 +405,34 @@ void VkRenderTarget::BeginFramebuffer(VkExtent2D extent, VkFormat imageFormat)
 		0,
 		1,
 		&rect);
-
-	vkCmdBeginRenderPass(fboCmd, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+	if (shaderObject)
+	{
+		//Shader objects take the viewport and scissor counts from the command buffer
+		vkCmdSetViewportWithCount(fboCmd, 1, &viewport);
+		vkCmdSetScissorWithCount(fboCmd, 1, &rect);
+		shaderState.command = VK_NULL_HANDLE;
+	}
+	bindState.command = VK_NULL_HANDLE;
+	//A recycled command buffer can come back with the same handle, so the shadow is stale
+	pushRecorder.Invalidate();
+
+	if (descriptorBuffer)
+		BindDescriptorBuffer(fboCmd);
+
+	if (dynamicRendering)
+		beginRendering(fboCmd, fbo, extent, clearColor);
+	else
+		vkCmdBeginRenderPass(fboCmd, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 	currentCmd = fboCmd;
 	currentImage = fbo.image;
 }
 
 void VkRenderTarget::EndFramebuffer()
 {
-	PushUploads();
-
-	vkCmdEndRenderPass(fboCmd);
+	if (dynamicRendering)
+		vkCmdEndRendering(fboCmd);
+	else
+		vkCmdEndRenderPass(fboCmd);
 
 	//VkImageMemoryBarrier imgMemBarrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
 	//imgMemBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
@@ -203,7 +468,7 @@ void VkRenderTarget::EndFramebuffer()
 	imgMemBarrier.subresourceRange.layerCount = 1;
 	imgMemBarrier.image = currentImage.image;
 
-	imgMemBarrier.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	imgMemBarrier.oldLayout = dynamicRendering ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 	imgMemBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 	imgMemBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
 	imgMemBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
@@ -221,12 +486,32 @@ void VkRenderTarget::EndFramebuffer()
 		throw std::runtime_error("failed to record command buffer!");
 	}
 
-	VkSubmitInfo submitInfo = {};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &fboCmd;
+	//Uploads recorded so far run first in the same submission
+	VkCommandBufferSubmitInfo cmdInfos[2] = {};
+	VkSemaphoreSubmitInfo transferWait;
+	uint32_t cmdCount = endUploads(cmdInfos[0], transferWait) ? 1 : 0;
+	cmdInfos[cmdCount] = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO };
+	cmdInfos[cmdCount++].commandBuffer = fboCmd;
 
-	auto submitCode = vkQueueSubmit(graphicsQueue, 1, &submitInfo, fboFence);;
+	VkSemaphoreSubmitInfo timelineInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+	timelineInfo.semaphore = graphicsTimeline;
+	timelineInfo.value = ++graphicsValue_;
+	timelineInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+
+	VkSubmitInfo2 submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO_2 };
+	submitInfo.commandBufferInfoCount = cmdCount;
+	submitInfo.pCommandBufferInfos = cmdInfos;
+	submitInfo.signalSemaphoreInfoCount = 1;
+	submitInfo.pSignalSemaphoreInfos = &timelineInfo;
+	if (transferWait.semaphore)
+	{
+		submitInfo.waitSemaphoreInfoCount = 1;
+		submitInfo.pWaitSemaphoreInfos = &transferWait;
+	}
+	fboBatches_[openFbo_].value = graphicsValue_;
+	singleFrame[currentFrame].value = graphicsValue_;
+
+	auto submitCode = vkQueueSubmit2(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
 	if (submitCode != VK_SUCCESS) {
 		throw std::runtime_error("failed to submit draw command buffer!");
 	}
@@ -238,8 +523,20 @@ void VkRenderTarget::EndFramebuffer()
 void VkRenderTarget::StartRender(VkExtent2D extent)
 {
 	currentFrame = (currentFrame + 1) % COMMAND_BUFFER_COUNT;
-	vkWaitForFences(device, 1, &submissionResources[currentFrame].fence, VK_TRUE, UINT64_MAX);
-	vkResetFences(device, 1, &submissionResources[currentFrame].fence);
+	//The frame's only CPU wait: the last graphics submission that used its command buffer, rings or deferred
+	//destructions, and the last transfer submission that read its staging ring
+	VK::SingleFrameResources& sf = singleFrame[currentFrame];
+	VK::StagingRing& staging = stagingRings_[currentFrame];
+	VkSemaphore timelines[2] = { graphicsTimeline, transferTimeline };
+	uint64_t values[2] = { std::max(sf.value, staging.value), staging.transferValue };
+	if (values[0] > 0 || values[1] > 0)
+	{
+		VkSemaphoreWaitInfo waitInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO };
+		waitInfo.semaphoreCount = asyncTransfer ? 2 : 1;
+		waitInfo.pSemaphores = timelines;
+		waitInfo.pValues = values;
+		vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+	}
 	vkResetCommandBuffer(submissionResources[currentFrame].cmd, /*VkCommandBufferResetFlagBits*/ 0);
 
 	uint32_t lastImage = imageIndex;
@@ -289,6 +586,14 @@ void VkRenderTarget::StartRender(VkExtent2D extent)
 		0,
 		1,
 		&rect);
+	if (shaderObject)
+	{
+		vkCmdSetViewportWithCount(submissionResources[currentFrame].cmd, 1, &viewport);
+		vkCmdSetScissorWithCount(submissionResources[currentFrame].cmd, 1, &rect);
+		shaderState.command = VK_NULL_HANDLE;
+	}
+	bindState.command = VK_NULL_HANDLE;
+	pushRecorder.Invalidate();
 
 	VkClearValue clearColor[2];
 	clearColor[0] = { 0.0f, 1.0f, 0.0f, 1.0f };
@@ -296,17 +601,13 @@ void VkRenderTarget::StartRender(VkExtent2D extent)
 	renderPassInfo.clearValueCount = 2;
 	renderPassInfo.pClearValues = clearColor;
 
-	vkCmdBeginRenderPass(submissionResources[currentFrame].cmd, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+	if (dynamicRendering)
+		beginRendering(submissionResources[currentFrame].cmd, swapChainFBOs[imageIndex].framebuffer, swapChainExtent, clearColor);
+	else
+		vkCmdBeginRenderPass(submissionResources[currentFrame].cmd, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 	currentCmd = submissionResources[currentFrame].cmd;
 	currentImage = swapChainFBOs[currentFrame].framebuffer.image;
 
-	for (uint16_t i = 0; i < submissionResources[(currentFrame+1)%COMMAND_BUFFER_COUNT].countUpload; ++i)
-	{
-		uint16_t j = (submissionResources[(currentFrame + 1) % COMMAND_BUFFER_COUNT].startUpload + i) % UPLOAD_BUFFER_COUNT;
-		vkWaitForFences(device, 1, &uploadFences[j], VK_TRUE, UINT64_MAX);
-		vkResetFences(device, 1, &uploadFences[j]);
-	}
-
 	for (int i = 0; i < VkDS_MaxType; ++i)
 	{
 		for (auto& set : descSets.subs[i])
@@ -314,7 +615,18 @@ void VkRenderTarget::StartRender(VkExtent2D extent)
 			set.start = 0;
 		}
 	}
-	auto& sf = singleFrame[currentFrame];
+	//The timeline wait above means the GPU is done with this frame's uniforms and descriptors
+	uniformRings_[currentFrame].head = 0;
+	descriptorRings_[currentFrame].head = 0;
+	stagingPeak_ = std::max(stagingPeak_, staging.staged);
+	staging.head = 0;
+	staging.staged = 0;
+	for (auto& retired : staging.retired)
+		vmaDestroyBuffer(allocator, retired.buffer, retired.allocation);
+	staging.retired.clear();
+	if (descriptorBuffer)
+		BindDescriptorBuffer(submissionResources[currentFrame].cmd);
+	pushRecorder.NewFrame();
 	for (uint32_t i = 0; i < sf.bufferIndex; ++i)
 	{
 		switch (sf.buffers[i].type)
@@ -331,6 +643,12 @@ void VkRenderTarget::StartRender(VkExtent2D extent)
 		case VK::UNIFORM:
 			vmaPools_.uniform.free(sf.buffers[i]);
 			break;
+		case VK::STREAM:
+			vmaPools_.stream.free(sf.buffers[i]);
+			break;
+		case VK::STORAGE:
+			vmaPools_.storage.free(sf.buffers[i]);
+			break;
 		default: assert(false);
 		}
 		//vmaDestroyBuffer(allocator, sf.buffers[i].buffer, sf.buffers[i].allocation);
@@ -362,16 +680,21 @@ void VkRenderTarget::StartRender(VkExtent2D extent)
 			vmaDestroyImage(allocator, sf.textures[i].image, sf.textures[i].allocation);
 	}
 	singleFrame[currentFrame].textureIndex = 0;
-
-	submissionResources[currentFrame].startUpload = currUpload_;
-	submissionResources[currentFrame].countUpload = 0;
+	for (uint32_t i = 0; i < sf.pipelineIndex; ++i)
+		vkDestroyPipeline(device, sf.pipelines[i], nullptr);
+	singleFrame[currentFrame].pipelineIndex = 0;
 }
 
 void VkRenderTarget::EndRender()
 {
-	PushUploads();
-
-	vkCmdEndRenderPass(submissionResources[currentFrame].cmd);
+	if (dynamicRendering)
+	{
+		vkCmdEndRendering(submissionResources[currentFrame].cmd);
+		transitionAttachment(submissionResources[currentFrame].cmd, swapChainFBOs[imageIndex].framebuffer.image.image, VK_IMAGE_ASPECT_COLOR_BIT,
+			VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+	}
+	else
+		vkCmdEndRenderPass(submissionResources[currentFrame].cmd);
 
 	if (vkEndCommandBuffer(submissionResources[currentFrame].cmd) != VK_SUCCESS) {
 		throw std::runtime_error("failed to record command buffer!");
@@ -379,35 +702,48 @@ void VkRenderTarget::EndRender()
 	VkSubmitInfo2 submitInfo = {};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
 
-	VkCommandBufferSubmitInfo cmdInfo{};
+	//The frame's upload batch goes first, command buffer order keeps its barrier ahead of the draws
+	VkCommandBufferSubmitInfo cmdInfos[2] = {};
+	VkSemaphoreSubmitInfo waitInfos[2] = {};
+	uint32_t cmdCount = endUploads(cmdInfos[0], waitInfos[1]) ? 1 : 0;
+	VkCommandBufferSubmitInfo& cmdInfo = cmdInfos[cmdCount++];
 	cmdInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
 	cmdInfo.pNext = nullptr;
 	cmdInfo.commandBuffer = submissionResources[currentFrame].cmd;
 	cmdInfo.deviceMask = 0;
-	submitInfo.pCommandBufferInfos = &cmdInfo;
-	submitInfo.commandBufferInfoCount = 1;
+	submitInfo.pCommandBufferInfos = cmdInfos;
+	submitInfo.commandBufferInfoCount = cmdCount;
 
-	VkSemaphoreSubmitInfo submitInfo1{};
+	VkSemaphoreSubmitInfo& submitInfo1 = waitInfos[0];
 	submitInfo1.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
 	submitInfo1.pNext = nullptr;
 	submitInfo1.semaphore = submissionResources[currentFrame].image_acquired_semaphore;
 	submitInfo1.stageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR;
 	submitInfo1.deviceIndex = 0;
 	submitInfo1.value = 1;
-	submitInfo.waitSemaphoreInfoCount = 1;
-	submitInfo.pWaitSemaphoreInfos = &submitInfo1;
+	//Plus the transfer timeline when uploads from the transfer queue are acquired
+	submitInfo.waitSemaphoreInfoCount = waitInfos[1].semaphore ? 2 : 1;
+	submitInfo.pWaitSemaphoreInfos = waitInfos;
 
-	VkSemaphoreSubmitInfo submitInfo2{};
+	VkSemaphoreSubmitInfo signalInfos[2] = {};
+	VkSemaphoreSubmitInfo& submitInfo2 = signalInfos[0];
 	submitInfo2.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
 	submitInfo2.pNext = nullptr;
 	submitInfo2.semaphore = swapChainFBOs[imageIndex].draw_complete_semaphore;
 	submitInfo2.stageMask = VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT;
 	submitInfo2.deviceIndex = 0;
 	submitInfo2.value = 1;
-	submitInfo.signalSemaphoreInfoCount = 1;
-	submitInfo.pSignalSemaphoreInfos = &submitInfo2;
-
-	auto submitRes = vkQueueSubmit2(graphicsQueue, 1, &submitInfo, submissionResources[currentFrame].fence);
+	signalInfos[1] = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+	signalInfos[1].semaphore = graphicsTimeline;
+	signalInfos[1].value = ++graphicsValue_;
+	signalInfos[1].stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+	submitInfo.signalSemaphoreInfoCount = 2;
+	submitInfo.pSignalSemaphoreInfos = signalInfos;
+	singleFrame[currentFrame].value = graphicsValue_;
+
+	//Streaming stores into the uniform ring must land before the GPU reads it
+	VkUniformWrite::Fence();
+	auto submitRes = vkQueueSubmit2(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
 	if (submitRes != VK_SUCCESS) {
 		throw std::runtime_error("failed to submit draw command buffer!");
 	}
@@ -480,6 +816,80 @@ void VkRenderTarget::PushSingleFrameBuffer(VK::Buffer staging)
 	singleFrame[currentFrame].bufferIndex++;
 }
 
+VK::UniformSlice VkRenderTarget::AllocUniform(const void* data, VkDeviceSize size)
+{
+	VK::UniformRing& ring = uniformRings_[currentFrame];
+	VkDeviceSize offset = (ring.head + uniformAlignment - 1) & ~(uniformAlignment - 1);
+	if (offset + size > uniformRingSize)
+		throw std::runtime_error("uniform ring is full, raise uniformRingSize!");
+	ring.head = offset + size;
+
+	VK::UniformSlice slice = { ring.buffer, (uint32_t)offset, ring.mapped + offset };
+	if (data)
+	{
+		VkUniformWrite::Copy(slice.mapped, data, size, uniformRingWriteCombined);
+		vmaFlushAllocation(allocator, ring.allocation, offset, size);
+	}
+	return slice;
+}
+
+VK::StagingSlice VkRenderTarget::AllocStaging(const void* data, VkDeviceSize size, VkDeviceSize alignment)
+{
+	VK::StagingRing& ring = stagingRings_[currentFrame];
+	VkDeviceSize offset = (ring.head + alignment - 1) & ~(alignment - 1);
+	if (offset + size > ring.size)
+	{
+		//Copies recorded this frame still read the old ring, it is freed when the frame comes around again
+		VkDeviceSize grown = ring.size * 2;
+		while (grown < size)
+			grown *= 2;
+		ring.retired.push_back({ ring.buffer, ring.allocation, VK::TRANSFER, ring.size });
+		createStagingRing(ring, grown);
+		stagingGrows_++;
+		offset = 0;
+	}
+	ring.head = offset + size;
+	ring.staged += size;
+	uploadRings_ |= 1 << currentFrame;
+
+	VK::StagingSlice slice = { ring.buffer, offset, ring.mapped + offset };
+	if (data)
+		memcpy(slice.mapped, data, size);
+	return slice;
+}
+
+VK::StagingStats VkRenderTarget::GetStagingStats()
+{
+	VK::StagingRing& ring = stagingRings_[currentFrame];
+	return { ring.staged, ring.size, std::max(stagingPeak_, ring.staged), stagingGrows_ };
+}
+
+VK::DescriptorSlice VkRenderTarget::AllocDescriptors(VkDeviceSize size)
+{
+	VK::DescriptorRing& ring = descriptorRings_[currentFrame];
+	VkDeviceSize alignment = descriptorBufferProperties.descriptorBufferOffsetAlignment;
+	VkDeviceSize offset = (ring.head + alignment - 1) & ~(alignment - 1);
+	if (offset + size > descriptorRingSize)
+		throw std::runtime_error("descriptor ring is full, raise descriptorRingSize!");
+	ring.head = offset + size;
+	return { offset, ring.mapped + offset };
+}
+
+void VkRenderTarget::BindDescriptorBuffer(VkCommandBuffer cmd)
+{
+	VkDescriptorBufferBindingInfoEXT bindingInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_BUFFER_BINDING_INFO_EXT };
+	bindingInfo.address = descriptorRings_[currentFrame].address;
+	bindingInfo.usage = VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT | VK_BUFFER_USAGE_SAMPLER_DESCRIPTOR_BUFFER_BIT_EXT;
+	vkCmdBindDescriptorBuffersEXT(cmd, 1, &bindingInfo);
+}
+
+VkDeviceAddress VkRenderTarget::GetBufferAddress(VkBuffer buffer)
+{
+	VkBufferDeviceAddressInfo addressInfo = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
+	addressInfo.buffer = buffer;
+	return vkGetBufferDeviceAddress(device, &addressInfo);
+}
+
 void VkRenderTarget::PushSingleTexture(VK::Texture& staging)
 {
 	if (staging.image == 0 && staging.sampler == 0)
@@ -499,6 +909,28 @@ void VkRenderTarget::PushSingleTexture(VK::Texture& staging)
 	staging = {};
 }
 
+void VkRenderTarget::PushSingleFramePipeline(VkPipeline pipeline)
+{
+	if (pipeline == VK_NULL_HANDLE)
+		return;
+	if (singleFrame.empty())
+	{
+		vkDestroyPipeline(device, pipeline, nullptr);
+		return;
+	}
+	if (singleFrame[currentFrame].pipelines.size() <= singleFrame[currentFrame].pipelineIndex)
+		singleFrame[currentFrame].pipelines.resize(singleFrame[currentFrame].pipelineIndex + 1);
+	singleFrame[currentFrame].pipelines[singleFrame[currentFrame].pipelineIndex] = pipeline;
+	singleFrame[currentFrame].pipelineIndex++;
+}
+
+void VkRenderTarget::BindGraphicsPipeline(VkCommandBuffer command, VkPipeline pipeline)
+{
+	vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+	//The pipeline replaced the bound shader objects and their dynamic state
+	shaderState.command = VK_NULL_HANDLE;
+}
+
 uint32_t VkRenderTarget::getDescSetSubIndex(VkDescFormat fmt, VkDescriptorSetLayoutBinding* bindings, int bCount)
 {
 	if (fmt < 0 || fmt >= VkDS_MaxType)
@@ -570,47 +1002,29 @@ void VkRenderTarget::RecreateSwapChain() {
 
 void VkRenderTarget::PushUploads()
 {
-	if (uploadStarted_)
-	{
-		VkMemoryBarrier2KHR memoryBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
-		memoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT_KHR;
-		memoryBarrier.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
-		memoryBarrier.dstStageMask = VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT_KHR;
-		memoryBarrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT_KHR;
-
-		//Debug wait all
-		//memoryBarrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT_KHR;
-		//memoryBarrier.srcAccessMask = VK_ACCESS_2_MEMORY_READ_BIT_KHR |
-		//	VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
-		//memoryBarrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT_KHR;
-		//memoryBarrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT_KHR |
-		//	VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
-
-		VkDependencyInfoKHR dependencyInfo = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR };
-		dependencyInfo.memoryBarrierCount = 1;
-		dependencyInfo.pMemoryBarriers = &memoryBarrier;
-
-		vkCmdPipelineBarrier2(uploadCommandBuffer[currUpload_], &dependencyInfo);
-
-		vkEndCommandBuffer(uploadCommandBuffer[currUpload_]);
-
-		VkCommandBufferSubmitInfo cmdSubmit = {};
-
-		cmdSubmit.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
-		cmdSubmit.pNext = nullptr;
-		cmdSubmit.commandBuffer = GetUploadCmd();
-		cmdSubmit.deviceMask = 0;
+	VkCommandBufferSubmitInfo cmdSubmit = {};
+	VkSemaphoreSubmitInfo transferWait;
+	if (!endUploads(cmdSubmit, transferWait))
+		return;
 
-		VkSubmitInfo2 submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO_2 };
-		submitInfo.commandBufferInfoCount = 1;
-		submitInfo.pCommandBufferInfos = &cmdSubmit;
+	VkSemaphoreSubmitInfo timelineInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO };
+	timelineInfo.semaphore = graphicsTimeline;
+	timelineInfo.value = ++graphicsValue_;
+	timelineInfo.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+	singleFrame[currentFrame].value = graphicsValue_;
 
-		vkQueueSubmit2(graphicsQueue, 1, &submitInfo, uploadFences[currUpload_]);
-		//vkQueueWaitIdle(graphicsQueue);
-		uploadStarted_ = false;
-		currUpload_ = (currUpload_ + 1) % UPLOAD_BUFFER_COUNT;
-		submissionResources[currentFrame].countUpload++;
+	VkSubmitInfo2 submitInfo = { VK_STRUCTURE_TYPE_SUBMIT_INFO_2 };
+	submitInfo.commandBufferInfoCount = 1;
+	submitInfo.pCommandBufferInfos = &cmdSubmit;
+	submitInfo.signalSemaphoreInfoCount = 1;
+	submitInfo.pSignalSemaphoreInfos = &timelineInfo;
+	if (transferWait.semaphore)
+	{
+		submitInfo.waitSemaphoreInfoCount = 1;
+		submitInfo.pWaitSemaphoreInfos = &transferWait;
 	}
+
+	vkQueueSubmit2(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
 }
 
 bool VkRenderTarget::checkValidationLayerSupport() {
@@ -653,25 +1067,19 @@ void VkRenderTarget::createSyncObjects() {
 	VkSemaphoreCreateInfo semaphoreInfo = {};
 	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-	VkFenceCreateInfo fenceInfo = {};
-	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
 	for (size_t i = 0; i < COMMAND_BUFFER_COUNT; i++) {
-		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &submissionResources[i].image_acquired_semaphore) != VK_SUCCESS ||
-			vkCreateFence(device, &fenceInfo, nullptr, &submissionResources[i].fence) != VK_SUCCESS) {
-			throw std::runtime_error("failed to create synchronization objects for a frame!");
-		}
-	}
-	for (size_t i = 0; i < UPLOAD_BUFFER_COUNT; i++) {
-		if (//vkCreateSemaphore(device, &semaphoreInfo, nullptr, &uploadFences[i]) != VK_SUCCESS ||
-			vkCreateFence(device, &fenceInfo, nullptr, &uploadFences[i]) != VK_SUCCESS) {
+		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &submissionResources[i].image_acquired_semaphore) != VK_SUCCESS) {
 			throw std::runtime_error("failed to create synchronization objects for a frame!");
 		}
 	}
-	vkResetFences(device, UPLOAD_BUFFER_COUNT, uploadFences);
-	vkCreateFence(device, &fenceInfo, nullptr, &fboFence);
-	//vkResetFences(device, 1, &fboFence);
+	VkSemaphoreTypeCreateInfo timelineInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO };
+	timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	timelineInfo.initialValue = graphicsValue_;
+	semaphoreInfo.pNext = &timelineInfo;
+	if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &graphicsTimeline) != VK_SUCCESS)
+		throw std::runtime_error("failed to create the graphics timeline!");
+	if (asyncTransfer && vkCreateSemaphore(device, &semaphoreInfo, nullptr, &transferTimeline) != VK_SUCCESS)
+		throw std::runtime_error("failed to create the transfer timeline!");
 }
 
 void VkRenderTarget::populateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT& createInfo) {
@@ -736,6 +1144,22 @@ void VkRenderTarget::createInstance(void* window) {
 	vkCmdSetColorWriteMaskEXT_ = (PFN_vkCmdSetColorWriteMaskEXT)vkGetInstanceProcAddr(instance, "vkCmdSetColorWriteMaskEXT"); // It depends on the function whether you want to use vkGetInstanceProcAddr or vkGetDeviceProcAddr
 #endif
 	vkCmdSetColorBlendEquationEXT_ = (PFN_vkCmdSetColorBlendEquationEXT)vkGetInstanceProcAddr(instance, "vkCmdSetColorBlendEquationEXT");
+	vkCreateShadersEXT_ = (PFN_vkCreateShadersEXT)vkGetInstanceProcAddr(instance, "vkCreateShadersEXT");
+	vkDestroyShaderEXT_ = (PFN_vkDestroyShaderEXT)vkGetInstanceProcAddr(instance, "vkDestroyShaderEXT");
+	vkCmdBindShadersEXT_ = (PFN_vkCmdBindShadersEXT)vkGetInstanceProcAddr(instance, "vkCmdBindShadersEXT");
+	vkCmdSetVertexInputEXT_ = (PFN_vkCmdSetVertexInputEXT)vkGetInstanceProcAddr(instance, "vkCmdSetVertexInputEXT");
+	vkCmdSetPolygonModeEXT_ = (PFN_vkCmdSetPolygonModeEXT)vkGetInstanceProcAddr(instance, "vkCmdSetPolygonModeEXT");
+	vkCmdSetRasterizationSamplesEXT_ = (PFN_vkCmdSetRasterizationSamplesEXT)vkGetInstanceProcAddr(instance, "vkCmdSetRasterizationSamplesEXT");
+	vkCmdSetSampleMaskEXT_ = (PFN_vkCmdSetSampleMaskEXT)vkGetInstanceProcAddr(instance, "vkCmdSetSampleMaskEXT");
+	vkCmdSetAlphaToCoverageEnableEXT_ = (PFN_vkCmdSetAlphaToCoverageEnableEXT)vkGetInstanceProcAddr(instance, "vkCmdSetAlphaToCoverageEnableEXT");
+	vkCmdSetDepthClampEnableEXT_ = (PFN_vkCmdSetDepthClampEnableEXT)vkGetInstanceProcAddr(instance, "vkCmdSetDepthClampEnableEXT");
+	vkCmdSetLogicOpEnableEXT_ = (PFN_vkCmdSetLogicOpEnableEXT)vkGetInstanceProcAddr(instance, "vkCmdSetLogicOpEnableEXT");
+	vkCmdSetColorBlendEnableEXT_ = (PFN_vkCmdSetColorBlendEnableEXT)vkGetInstanceProcAddr(instance, "vkCmdSetColorBlendEnableEXT");
+	vkGetDescriptorSetLayoutSizeEXT_ = (PFN_vkGetDescriptorSetLayoutSizeEXT)vkGetInstanceProcAddr(instance, "vkGetDescriptorSetLayoutSizeEXT");
+	vkGetDescriptorSetLayoutBindingOffsetEXT_ = (PFN_vkGetDescriptorSetLayoutBindingOffsetEXT)vkGetInstanceProcAddr(instance, "vkGetDescriptorSetLayoutBindingOffsetEXT");
+	vkGetDescriptorEXT_ = (PFN_vkGetDescriptorEXT)vkGetInstanceProcAddr(instance, "vkGetDescriptorEXT");
+	vkCmdBindDescriptorBuffersEXT_ = (PFN_vkCmdBindDescriptorBuffersEXT)vkGetInstanceProcAddr(instance, "vkCmdBindDescriptorBuffersEXT");
+	vkCmdSetDescriptorBufferOffsetsEXT_ = (PFN_vkCmdSetDescriptorBufferOffsetsEXT)vkGetInstanceProcAddr(instance, "vkCmdSetDescriptorBufferOffsetsEXT");
 }
 
 void VkRenderTarget::createSurface(void* window)
@@ -806,7 +1230,100 @@ void VkRenderTarget::createMemAlloc()
 	vmaPools_.index.init(this, VK::INDEX);
 	vmaPools_.vertex.init(this, VK::VERTEX);
 	vmaPools_.uniform.init(this, VK::UNIFORM);
-	vmaPools_.transfer.init(this, VK::TRANSFER);	
+	vmaPools_.transfer.init(this, VK::TRANSFER);
+	vmaPools_.stream.init(this, VK::STREAM);
+	vmaPools_.storage.init(this, VK::STORAGE);
+}
+
+void VkRenderTarget::createUniformRings()
+{
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	uniformAlignment = properties.limits.minUniformBufferOffsetAlignment;
+
+	VkBufferCreateInfo bufferInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+	bufferInfo.size = uniformRingSize;
+	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	VmaAllocationCreateInfo allocInfo = {};
+	allocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+	allocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+	for (auto& ring : uniformRings_)
+	{
+		VmaAllocationInfo mappedInfo = {};
+		if (vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &ring.buffer, &ring.allocation, &mappedInfo) != VK_SUCCESS)
+			throw std::runtime_error("failed to create uniform ring!");
+		ring.mapped = (uint8_t*)mappedInfo.pMappedData;
+		ring.head = 0;
+
+		VkMemoryPropertyFlags flags = 0;
+		vmaGetMemoryTypeProperties(allocator, mappedInfo.memoryType, &flags);
+		//Device local memory the CPU can map without caching it (resizable BAR, integrated GPUs) is write-combined
+		uniformRingWriteCombined = (flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) && !(flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+	}
+}
+
+void VkRenderTarget::createStagingRing(VK::StagingRing& ring, VkDeviceSize size)
+{
+	VkBufferCreateInfo bufferInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+	bufferInfo.size = size;
+	bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	//Read by both queues, concurrent sharing saves ownership transfers of the ring itself
+	uint32_t families[2] = { graphicsFamily_, transferFamily_ };
+	if (asyncTransfer)
+	{
+		bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		bufferInfo.queueFamilyIndexCount = 2;
+		bufferInfo.pQueueFamilyIndices = families;
+	}
+
+	//Mapped for the ring's lifetime, coherent so uploads are plain writes
+	VmaAllocationCreateInfo allocInfo = {};
+	allocInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
+	allocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+	allocInfo.requiredFlags = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+	VmaAllocationInfo mappedInfo = {};
+	if (vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &ring.buffer, &ring.allocation, &mappedInfo) != VK_SUCCESS)
+		throw std::runtime_error("failed to create staging ring!");
+	ring.mapped = (uint8_t*)mappedInfo.pMappedData;
+	ring.size = size;
+	ring.head = 0;
+}
+
+void VkRenderTarget::createDescriptorRings()
+{
+	if (!descriptorBuffer)
+		return;
+	VkPhysicalDeviceProperties2 properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+	properties.pNext = &descriptorBufferProperties;
+	vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+
+	//Generated layouts mix samplers and buffers in one set, so the ring holds both kinds of descriptors
+	VkBufferCreateInfo bufferInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+	bufferInfo.size = descriptorRingSize;
+	bufferInfo.usage = VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT | VK_BUFFER_USAGE_SAMPLER_DESCRIPTOR_BUFFER_BIT_EXT |
+		VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	//vkGetDescriptorEXT writes straight into the mapping, coherent memory saves a flush per update
+	VmaAllocationCreateInfo allocInfo = {};
+	allocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+	allocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+	allocInfo.requiredFlags = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+	for (auto& ring : descriptorRings_)
+	{
+		VmaAllocationInfo mappedInfo = {};
+		if (vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &ring.buffer, &ring.allocation, &mappedInfo) != VK_SUCCESS)
+			throw std::runtime_error("failed to create descriptor ring!");
+		ring.mapped = (uint8_t*)mappedInfo.pMappedData;
+		ring.address = GetBufferAddress(ring.buffer);
+		ring.head = 0;
+	}
 }
 
 void VkRenderTarget::createCommandPool()
@@ -827,19 +1344,10 @@ void VkRenderTarget::createCommandPool()
 		for (auto& sub : submissionResources)
 			vkAllocateCommandBuffers(device, &commandBufferInfo, &sub.cmd);
 	}
+	if (asyncTransfer)
 	{
-		VkCommandBufferAllocateInfo commandBufferInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
-		commandBufferInfo.commandPool = commandPool;
-		commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-		commandBufferInfo.commandBufferCount = 16;
-		vkAllocateCommandBuffers(device, &commandBufferInfo, uploadCommandBuffer);
-	}
-	{
-		VkCommandBufferAllocateInfo commandBufferInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
-		commandBufferInfo.commandPool = commandPool;
-		commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-		commandBufferInfo.commandBufferCount = 1;
-		vkAllocateCommandBuffers(device, &commandBufferInfo, &fboCmd);
+		commandPoolInfo.queueFamilyIndex = transferFamily_;
+		vkCreateCommandPool(device, &commandPoolInfo, 0, &transferPool_);
 	}
 }
 
@@ -848,6 +1356,12 @@ void VkRenderTarget::createLogicalDevice() {
 
 	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 	std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily, indices.presentFamily };
+	if (indices.transferFamily == 0xFFFFFFFF)
+		asyncTransfer = false;
+	graphicsFamily_ = indices.graphicsFamily;
+	transferFamily_ = indices.transferFamily;
+	if (asyncTransfer)
+		uniqueQueueFamilies.insert(indices.transferFamily);
 
 	float queuePriority = 1.0f;
 	for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -868,20 +1382,135 @@ void VkRenderTarget::createLogicalDevice() {
 	VkPhysicalDeviceExtendedDynamicState3FeaturesEXT dynaFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT };
 	dynaFeatures.extendedDynamicState3ColorWriteMask = 1;
 	dynaFeatures.extendedDynamicState3ColorBlendEquation = 1;
+	dynaFeatures.extendedDynamicState3ColorBlendEnable = 1;
 	syncFeatures.pNext = &dynaFeatures;
 #endif
 
+	//Uploads and frames are tracked by timeline values
+	VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES };
+	timelineFeatures.timelineSemaphore = 1;
+	timelineFeatures.pNext = &syncFeatures;
+
 	VkDeviceCreateInfo createInfo = {};
 	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-	createInfo.pNext = &syncFeatures;
+	createInfo.pNext = &timelineFeatures;
+
+	std::vector<const char*> enabledExtensions(deviceExtensions.begin(), deviceExtensions.end());
+
+	VkPhysicalDeviceDynamicRenderingFeatures renderingFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES };
+	if (dynamicRendering)
+	{
+		VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+		features2.pNext = &renderingFeatures;
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+		dynamicRendering = renderingFeatures.dynamicRendering == VK_TRUE;
+		if (dynamicRendering)
+		{
+			renderingFeatures.pNext = (void*)createInfo.pNext;
+			createInfo.pNext = &renderingFeatures;
+		}
+	}
+
+	VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT gplFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT };
+	if (VK_EXT_graphics_pipeline_library_enabled)
+	{
+		VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+		features2.pNext = &gplFeatures;
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+		if (gplFeatures.graphicsPipelineLibrary)
+		{
+			enabledExtensions.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+			enabledExtensions.push_back(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+			gplFeatures.pNext = (void*)createInfo.pNext;
+			createInfo.pNext = &gplFeatures;
+			graphicsPipelineLibrary = true;
+		}
+	}
+
+	VkPhysicalDeviceShaderObjectFeaturesEXT shaderObjectFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_OBJECT_FEATURES_EXT };
+	if (VK_EXT_shader_object_enabled)
+	{
+		VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+		features2.pNext = &shaderObjectFeatures;
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+		//Shader objects can only be drawn inside vkCmdBeginRendering
+		if (shaderObjectFeatures.shaderObject && dynamicRendering)
+		{
+			enabledExtensions.push_back(VK_EXT_SHADER_OBJECT_EXTENSION_NAME);
+			shaderObjectFeatures.pNext = (void*)createInfo.pNext;
+			createInfo.pNext = &shaderObjectFeatures;
+			shaderObject = true;
+		}
+	}
+
+	VkPhysicalDeviceVertexInputDynamicStateFeaturesEXT vertexInputFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VERTEX_INPUT_DYNAMIC_STATE_FEATURES_EXT };
+	if (VK_EXT_vertex_input_dynamic_state_enabled)
+	{
+		VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+		features2.pNext = &vertexInputFeatures;
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+		if (vertexInputFeatures.vertexInputDynamicState)
+		{
+			enabledExtensions.push_back(VK_EXT_VERTEX_INPUT_DYNAMIC_STATE_EXTENSION_NAME);
+			vertexInputFeatures.pNext = (void*)createInfo.pNext;
+			createInfo.pNext = &vertexInputFeatures;
+			vertexInputDynamicState = true;
+		}
+	}
+
+	VkPhysicalDeviceDescriptorBufferFeaturesEXT descriptorBufferFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_FEATURES_EXT };
+	VkPhysicalDeviceBufferDeviceAddressFeatures addressFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES };
+	if (descriptorBuffer)
+	{
+		descriptorBuffer = false;
+		if (VK_EXT_descriptor_buffer_enabled)
+		{
+			VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+			features2.pNext = &descriptorBufferFeatures;
+			descriptorBufferFeatures.pNext = &addressFeatures;
+			vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+			//Descriptors of buffers are written from their device addresses
+			if (descriptorBufferFeatures.descriptorBuffer && addressFeatures.bufferDeviceAddress)
+			{
+				enabledExtensions.push_back(VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME);
+				descriptorBufferFeatures.pNext = (void*)createInfo.pNext;
+				createInfo.pNext = &descriptorBufferFeatures;
+				descriptorBuffer = true;
+			}
+		}
+	}
+	if (bufferDeviceAddress)
+	{
+		bufferDeviceAddress = false;
+		if (GetVulkanApiVersion() >= VK_API_VERSION_1_2 || VK_KHR_buffer_device_address_enabled)
+		{
+			VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+			features2.pNext = &addressFeatures;
+			addressFeatures.pNext = nullptr;
+			vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+			if (addressFeatures.bufferDeviceAddress)
+				bufferDeviceAddress = true;
+		}
+	}
+	//Chained once for both users, only the address itself is enabled. Before 1.2 it needs the extension
+	if (bufferDeviceAddress || descriptorBuffer)
+	{
+		if (VK_KHR_buffer_device_address_enabled)
+			enabledExtensions.push_back(VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME);
+		addressFeatures = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES };
+		addressFeatures.bufferDeviceAddress = VK_TRUE;
+		addressFeatures.pNext = (void*)createInfo.pNext;
+		createInfo.pNext = &addressFeatures;
+		g_BufferDeviceAddressEnabled = true;
+	}
 
 	createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
 	createInfo.pQueueCreateInfos = queueCreateInfos.data();
 
 	createInfo.pEnabledFeatures = &deviceFeatures;
 
-	createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-	createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+	createInfo.enabledExtensionCount = static_cast<uint32_t>(enabledExtensions.size());
+	createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
 	if (enableValidationLayers) {
 		createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
@@ -897,6 +1526,8 @@ void VkRenderTarget::createLogicalDevice() {
 
 	vkGetDeviceQueue(device, indices.graphicsFamily, 0, &graphicsQueue);
 	vkGetDeviceQueue(device, indices.presentFamily, 0, &presentQueue);
+	if (asyncTransfer)
+		vkGetDeviceQueue(device, indices.transferFamily, 0, &transferQueue);
 }
 
 
@@ -994,7 +1625,7 @@ void VkRenderTarget::createSwapChain(SwapChainSupportDetails swapChainSupport, V
 	for (uint32_t i = 0; i < imageCount; ++i)
 	{
 		swapChainFBOs[i].framebuffer.image.image = images[i];
-		VK::CreateTexture(this, swapChainFBOs[i].framebuffer.depth, extent.width, extent.height, (uint32_t)0, {}, VK_FORMAT_D24_UNORM_S8_UINT);
+		VK::CreateTexture(this, swapChainFBOs[i].framebuffer.depth, extent.width, extent.height, (uint32_t)0, {}, depthFormat);
 
 		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &swapChainFBOs[i].draw_complete_semaphore) != VK_SUCCESS) {
 			throw std::runtime_error("failed to create synchronization objects for a frame!");
@@ -1018,6 +1649,8 @@ void VkRenderTarget::createSwapChain(void* window) {
 
 
 void VkRenderTarget::createFramebuffers() {
+	if (dynamicRendering)
+		return;
 	for (size_t i = 0; i < swapChainFBOs.size(); i++) {
 		VkImageView attachments[] = {
 			swapChainFBOs[i].framebuffer.image.imageView,
@@ -1067,6 +1700,14 @@ QueueFamilyIndices VkRenderTarget::findQueueFamilies(VkPhysicalDevice device) {
 		i++;
 	}
 
+	//The copy engine: a family that transfers but neither renders nor computes
+	for (i = 0; i < (int)queueFamilies.size(); ++i) {
+		if ((queueFamilies[i].queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamilies[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+			indices.transferFamily = i;
+			break;
+		}
+	}
+
 	return indices;
 }
 
@@ -1120,6 +1761,14 @@ bool VkRenderTarget::checkDeviceExtensionSupport(VkPhysicalDevice device) {
 				VK_EXT_buffer_device_address_enabled = true;
 			}
 		}
+		else if (strcmp(availableExtensions[i].extensionName, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME) == 0)
+			VK_EXT_graphics_pipeline_library_enabled = true;
+		else if (strcmp(availableExtensions[i].extensionName, VK_EXT_SHADER_OBJECT_EXTENSION_NAME) == 0)
+			VK_EXT_shader_object_enabled = true;
+		else if (strcmp(availableExtensions[i].extensionName, VK_EXT_VERTEX_INPUT_DYNAMIC_STATE_EXTENSION_NAME) == 0)
+			VK_EXT_vertex_input_dynamic_state_enabled = true;
+		else if (strcmp(availableExtensions[i].extensionName, VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME) == 0)
+			VK_EXT_descriptor_buffer_enabled = true;
 	}
 
 	for (const auto& extension : availableExtensions) {
@@ -1216,7 +1865,7 @@ VkImageView VkRenderTarget::createImageView(VkImage image, VkFormat format) {
 	viewInfo.image = image;
 	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
 	viewInfo.format = format;
-	viewInfo.subresourceRange.aspectMask = format == VK_FORMAT_D24_UNORM_S8_UINT ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+	viewInfo.subresourceRange.aspectMask = VK::IsDepthFormat(format) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
 	viewInfo.subresourceRange.baseMipLevel = 0;
 	viewInfo.subresourceRange.levelCount = 1;
 	viewInfo.subresourceRange.baseArrayLayer = 0;
@@ -1230,6 +1879,80 @@ VkImageView VkRenderTarget::createImageView(VkImage image, VkFormat format) {
 	return imageView;
 }
 
+void VkRenderTarget::transitionAttachment(VkCommandBuffer cmd, VkImage image, VkImageAspectFlags aspect, VkImageLayout oldLayout, VkImageLayout newLayout)
+{
+	bool color = aspect == VK_IMAGE_ASPECT_COLOR_BIT;
+	VkPipelineStageFlags attachmentStages = color ? VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT :
+		VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	VkAccessFlags attachmentAccess = color ? VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT :
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+	VkImageMemoryBarrier imgMemBarrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+	imgMemBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	imgMemBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	imgMemBarrier.subresourceRange.aspectMask = aspect;
+	imgMemBarrier.subresourceRange.baseMipLevel = 0;
+	imgMemBarrier.subresourceRange.levelCount = 1;
+	imgMemBarrier.subresourceRange.baseArrayLayer = 0;
+	imgMemBarrier.subresourceRange.layerCount = 1;
+	imgMemBarrier.image = image;
+	imgMemBarrier.oldLayout = oldLayout;
+	imgMemBarrier.newLayout = newLayout;
+
+	VkPipelineStageFlags srcStage, dstStage;
+	if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED)
+	{
+		//Contents are cleared, only order against the previous attachment use
+		imgMemBarrier.srcAccessMask = 0;
+		imgMemBarrier.dstAccessMask = attachmentAccess;
+		srcStage = attachmentStages;
+		dstStage = attachmentStages;
+	}
+	else
+	{
+		imgMemBarrier.srcAccessMask = attachmentAccess;
+		imgMemBarrier.dstAccessMask = 0;
+		srcStage = attachmentStages;
+		dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	}
+	vkCmdPipelineBarrier(cmd, srcStage, dstStage, 0, 0, nullptr, 0, nullptr, 1, &imgMemBarrier);
+}
+
+void VkRenderTarget::beginRendering(VkCommandBuffer cmd, VK::FrameBuffer& fbo, VkExtent2D extent, VkClearValue* clearValues)
+{
+	//Without a render pass the attachment layouts are transitioned here
+	transitionAttachment(cmd, fbo.image.image, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+	bool stencil = VK::HasStencil(depthFormat);
+	transitionAttachment(cmd, fbo.depth.image, VK_IMAGE_ASPECT_DEPTH_BIT | (stencil ? VK_IMAGE_ASPECT_STENCIL_BIT : 0), VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+
+	VkRenderingAttachmentInfo colorAttachment = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO };
+	colorAttachment.imageView = fbo.image.imageView;
+	colorAttachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	colorAttachment.clearValue = clearValues[0];
+
+	VkRenderingAttachmentInfo depthAttachment = { VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO };
+	depthAttachment.imageView = fbo.depth.imageView;
+	depthAttachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachment.clearValue = clearValues[1];
+
+	VkRenderingAttachmentInfo stencilAttachment = depthAttachment;
+	stencilAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+
+	VkRenderingInfo renderingInfo = { VK_STRUCTURE_TYPE_RENDERING_INFO };
+	renderingInfo.renderArea.offset = { 0, 0 };
+	renderingInfo.renderArea.extent = extent;
+	renderingInfo.layerCount = 1;
+	renderingInfo.colorAttachmentCount = 1;
+	renderingInfo.pColorAttachments = &colorAttachment;
+	renderingInfo.pDepthAttachment = &depthAttachment;
+	renderingInfo.pStencilAttachment = stencil ? &stencilAttachment : nullptr;
+	vkCmdBeginRendering(cmd, &renderingInfo);
+}
+
 void VkRenderTarget::createDescPools()
 {
 	for (int fmt = 0; fmt < VkDS_MaxType; ++fmt)
@@ -1262,7 +1985,7 @@ void VkRenderTarget::createDescPools()
 		case VkDS_TTUUUUU: texs = 2; ubos = 5; break;
 		case VkDS_TUUUUU: texs = 1; ubos = 5; break;
 		}
-		VkDescriptorPoolSize poolSizes[8] = {};
+		VkDescriptorPoolSize poolSizes[24] = {};
 		for (int i = 0; i < texs; ++i)
 		{
 			poolSizes[i].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
@@ -1273,10 +1996,22 @@ void VkRenderTarget::createDescPools()
 			poolSizes[i].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 			poolSizes[i].descriptorCount = 1;
 		}
+		//Layouts generated with "dynamicUniforms" share the format with dynamic uniform buffers
+		for (int i = texs + ubos; i < texs + ubos * 2; ++i)
+		{
+			poolSizes[i].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+			poolSizes[i].descriptorCount = 1;
+		}
+		//and storage buffers count as a U, any buffer slot can be either
+		for (int i = texs + ubos * 2; i < texs + ubos * 3; ++i)
+		{
+			poolSizes[i].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			poolSizes[i].descriptorCount = 1;
+		}
 
 		VkDescriptorPoolCreateInfo poolInfo = {};
 		poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-		poolInfo.poolSizeCount = texs+ubos;
+		poolInfo.poolSizeCount = texs + ubos * 3;
 		poolInfo.pPoolSizes = poolSizes;
 		poolInfo.maxSets = 10240;
 
@@ -1293,6 +2028,8 @@ void VkRenderTarget::createImageViews() {
 	}
 }
 void VkRenderTarget::createRenderPass() {
+	if (dynamicRendering)
+		return;
 	VkAttachmentDescription colorAttachment = {};
 	colorAttachment.format = swapChainImageFormat;
 	colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
@@ -1304,7 +2041,7 @@ void VkRenderTarget::createRenderPass() {
 	colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
 	VkAttachmentDescription depthAttachment{};
-	depthAttachment.format = VK_FORMAT_D24_UNORM_S8_UINT;
+	depthAttachment.format = depthFormat;
 	depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
 	depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
 	depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
@@ -1423,7 +2160,22 @@ void VK::MemoryPool::init(VkRenderTarget* target, VK::BufferType type)
 		memFlags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
 		memUsage = VMA_MEMORY_USAGE_CPU_ONLY;
 		break;
+	case VK::STREAM:
+		usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+		memFlags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+		memUsage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+		break;
+	case VK::STORAGE:
+		usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+		memFlags = 0;
+		memUsage = VMA_MEMORY_USAGE_GPU_ONLY;
+		break;
 	}
+	//Descriptor buffers reference uniform and storage buffers by address, buffer_reference pointers anything the GPU reads
+	if (target->descriptorBuffer && (type == VK::UNIFORM || type == VK::STORAGE))
+		usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+	if (target->bufferDeviceAddress && type != VK::TRANSFER)
+		usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
 	// Create a pool that can have at most 2 blocks, 128 MiB each.
 	VmaPoolCreateInfo poolCreateInfo = {};
 	//poolCreateInfo.blockSize = 16ULL * 1024 * 1024;
@@ -1446,52 +2198,108 @@ void VK::MemoryPool::init(VkRenderTarget* target, VK::BufferType type)
 	//VmaPool pool;
 	res = vmaCreatePool(target->allocator, &poolCreateInfo, &pool);
 
-	stashed.resize(MemPoolSizeCount + 1);
+	classes.assign(MemPoolSizes, MemPoolSizes + MemPoolSizeCount);
+	stashed.resize(classes.size());
+	//Meshes are what share buffers, descriptors keep binding whole uniform and storage buffers
+	if (type == VK::VERTEX || type == VK::INDEX)
+		sharedSize = target->sharedBufferSize;
 }
 
-
-VK::Buffer VK::MemoryPool::alloc(void* memory, size_t size)
+VK::Buffer VK::MemoryPool::allocShared(size_t size, VkDeviceSize alignment)
 {
-	size_t index = PoolIndex(size);
-	if (!stashed[index].empty())
+	//Other alignments are met by asking for the worst case padding and rounding up
+	bool pow2 = (alignment & (alignment - 1)) == 0;
+	VmaVirtualAllocationCreateInfo allocInfo = {};
+	allocInfo.size = pow2 ? size : size + alignment - 1;
+	allocInfo.alignment = pow2 ? alignment : 1;
+
+	VK::Buffer ret = {};
+	ret.type = type;
+	ret.size = size;
+	VkDeviceSize offset = 0;
+	for (auto& sb : shared)
 	{
-		VK::Buffer ret = {};
-		if (index == MemPoolSizeCount)
+		if (vmaVirtualAllocate(sb.block, &allocInfo, &ret.subAllocation, &offset) == VK_SUCCESS)
 		{
-			for (int m = 0; m < stashed[index].size(); ++m)
-			{
-				auto mem = stashed[index][m];
-				if (mem.allocation->GetSize() >= size && mem.allocation->GetSize() < size * 3 / 2)
-				{
-					ret = mem;
-					stashed[index].erase(stashed[index].begin() + m);
-					break;
-				}
-			}
+			ret.buffer = sb.buffer;
+			ret.allocation = sb.allocation;
+			ret.address = sb.address;
+			break;
 		}
-		else
+	}
+	if (ret.buffer == VK_NULL_HANDLE)
+	{
+		VK::SharedBuffer sb = {};
+		VkBufferCreateInfo bufferInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+		bufferInfo.size = sharedSize;
+		bufferInfo.usage = usage;
+		bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		VmaAllocationCreateInfo bufferAllocInfo = {};
+		bufferAllocInfo.pool = pool;
+		if (vmaCreateBuffer(target->allocator, &bufferInfo, &bufferAllocInfo, &sb.buffer, &sb.allocation, nullptr) != VK_SUCCESS)
+			throw std::runtime_error("failed to create shared buffer!");
+		VmaVirtualBlockCreateInfo blockInfo = {};
+		blockInfo.size = sharedSize;
+		vmaCreateVirtualBlock(&blockInfo, &sb.block);
+		if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT)
+			sb.address = target->GetBufferAddress(sb.buffer);
+		shared.push_back(sb);
+		vmaVirtualAllocate(sb.block, &allocInfo, &ret.subAllocation, &offset);
+		ret.buffer = sb.buffer;
+		ret.allocation = sb.allocation;
+		ret.address = sb.address;
+	}
+	ret.offset = (offset + alignment - 1) / alignment * alignment;
+	if (ret.address)
+		ret.address += ret.offset;
+	return ret;
+}
+
+VK::Buffer VK::MemoryPool::alloc(void* memory, size_t size, VkDeviceSize alignment)
+{
+	//Filled by a copy from the staging ring, so memory is never written here
+	if (sharedSize > 0 && size + alignment <= sharedSize)
+		return allocShared(size, alignment);
+	histogram[(size + 15) & ~(VkDeviceSize)15]++;
+	allocations++;
+	requested += size;
+	size_t index = PoolIndex(size);
+	VK::Buffer ret = {};
+	if (index == classes.size())
+	{
+		//Smallest stashed buffer that holds size, unless it would waste a third or more of it
+		auto it = oversize.lower_bound(size);
+		if (it != oversize.end() && it->first < size * 3 / 2)
 		{
-			ret = stashed[index].back();
-			stashed[index].pop_back();
+			ret = it->second;
+			oversize.erase(it);
 		}
-		if (ret.buffer != nullptr)
+	}
+	else if (!stashed[index].empty())
+	{
+		ret = stashed[index].back();
+		stashed[index].pop_back();
+	}
+	if (ret.buffer != nullptr)
+	{
+		reused++;
+		allocated += ret.size;
+		if ((type == VK::TRANSFER || type == VK::STREAM) && memory)
 		{
-			if (usage & VK_BUFFER_USAGE_TRANSFER_SRC_BIT && memory)
-			{
-				void* mapped = 0;
-				VkResult mr = vmaMapMemory(target->allocator, ret.allocation, &mapped);
-				memcpy(mapped, memory, size);
-				vmaUnmapMemory(target->allocator, ret.allocation);
-			}
-			return ret;
+			void* mapped = 0;
+			VkResult mr = vmaMapMemory(target->allocator, ret.allocation, &mapped);
+			memcpy(mapped, memory, size);
+			vmaUnmapMemory(target->allocator, ret.allocation);
 		}
+		return ret;
 	}
 
 	size_t memoryPoolSize = size;
-	if (index < MemPoolSizeCount)
+	if (index < classes.size())
 	{
-		memoryPoolSize = MemPoolSizes[index];
+		memoryPoolSize = classes[index];
 	}
+	allocated += memoryPoolSize;
 
 	VkBufferCreateInfo vbInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
 	vbInfo.size = memoryPoolSize;
@@ -1501,11 +2309,14 @@ VK::Buffer VK::MemoryPool::alloc(void* memory, size_t size)
 	VmaAllocationCreateInfo vbAllocCreateInfo = {};
 	vbAllocCreateInfo.pool = pool;
 
-	VK::Buffer ret = {};
 	ret.type = type;
+	ret.size = memoryPoolSize;
 	VmaAllocationInfo stagingBufferAllocInfo = {};
 	VkResult cr = vmaCreateBuffer(target->allocator, &vbInfo, &vbAllocCreateInfo, &ret.buffer, &ret.allocation, &stagingBufferAllocInfo);
-	if (usage & VK_BUFFER_USAGE_TRANSFER_SRC_BIT && memory)
+	//Stashed buffers keep their address
+	if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT)
+		ret.address = target->GetBufferAddress(ret.buffer);
+	if ((type == VK::TRANSFER || type == VK::STREAM) && memory)
 	{
 		if (stagingBufferAllocInfo.pMappedData)
 			memcpy(stagingBufferAllocInfo.pMappedData, memory, size);
@@ -1527,24 +2338,96 @@ void VK::MemoryPool::free(VK::Buffer buffer)
 		assert(!buffer.buffer);
 		return;
 	}
-	size_t index = PoolIndex(buffer.allocation->GetSize());
-	stashed[index].push_back(buffer);
+	if (buffer.subAllocation != VK_NULL_HANDLE)
+	{
+		for (auto& sb : shared)
+		{
+			if (sb.buffer == buffer.buffer)
+				vmaVirtualFree(sb.block, buffer.subAllocation);
+		}
+		return;
+	}
+	if (buffer.size > classes.back())
+	{
+		oversize.emplace(buffer.size, buffer);
+		return;
+	}
+	//The largest class the buffer still holds, buffers made before adaptClasses can fall between the new classes
+	size_t index = std::upper_bound(classes.begin(), classes.end(), buffer.size) - classes.begin();
+	if (index == 0)
+	{
+		vmaDestroyBuffer(target->allocator, buffer.buffer, buffer.allocation);
+		return;
+	}
+	stashed[index - 1].push_back(buffer);
 }
 
 size_t VK::MemoryPool::PoolIndex(size_t sz)
 {
-	if (sz > MemPoolSizes[MemPoolSizeCount - 1])
-		return MemPoolSizeCount;
-	int smallest = 0, biggest = MemPoolSizeCount - 1;
-	while (smallest < biggest)
-	{
-		int mid = (smallest + biggest) / 2;
-		if (MemPoolSizes[mid] == sz)
-			return mid;
-		if (MemPoolSizes[mid] > sz)
-			biggest = mid;
-		else
-			smallest = mid + 1;
+	return std::lower_bound(classes.begin(), classes.end(), sz) - classes.begin();
+}
+
+VK::MemoryPoolStats VK::MemoryPool::stats()
+{
+	VK::MemoryPoolStats ret = {};
+	ret.allocations = allocations;
+	ret.reused = reused;
+	ret.requested = requested;
+	ret.allocated = allocated;
+	for (auto& list : stashed)
+	{
+		for (auto& buffer : list)
+		{
+			ret.stashedCount++;
+			ret.stashedBytes += buffer.size;
+		}
+	}
+	for (auto& entry : oversize)
+	{
+		ret.stashedCount++;
+		ret.stashedBytes += entry.first;
+	}
+	ret.classes = classes;
+	ret.histogram.assign(histogram.begin(), histogram.end());
+	return ret;
+}
+
+void VK::MemoryPool::adaptClasses(uint32_t count)
+{
+	VkDeviceSize largest = classes.back();
+	uint64_t total = 0;
+	for (auto& entry : histogram)
+	{
+		if (entry.first <= largest)
+			total += entry.second;
+	}
+	if (total == 0 || count == 0)
+		return;
+
+	//A class where the running count passes each count'th of the total, so every class serves about as many allocations
+	std::vector<VkDeviceSize> adapted;
+	uint64_t seen = 0, next = 1;
+	for (auto& entry : histogram)
+	{
+		if (entry.first > largest)
+			break;
+		seen += entry.second;
+		if (seen * count >= total * next)
+		{
+			adapted.push_back(entry.first);
+			while (seen * count >= total * next)
+				next++;
+		}
+	}
+	//Keeps what goes to the best fit path unchanged
+	if (adapted.back() != largest)
+		adapted.push_back(largest);
+
+	for (auto& list : stashed)
+	{
+		for (auto& buffer : list)
+			vmaDestroyBuffer(target->allocator, buffer.buffer, buffer.allocation);
 	}
-	return smallest;
+	classes = adapted;
+	stashed.assign(classes.size(), {});
 }
@@ -3,12 +3,18 @@
 
 #include "vulkan/vulkan.h"
 #include "vk_mem_alloc.h"
+#include "VkStructs.h"
+#include "VkPushRecorder.h"
+#include "VkUniformWrite.h"
 #include <vector>
+#include <map>
 
 static const uint32_t COMMAND_BUFFER_COUNT = 3;
 struct QueueFamilyIndices {
     uint32_t graphicsFamily = 0xFFFFFFFF;
     uint32_t presentFamily = 0xFFFFFFFF;
+    //Transfer only family (the copy engine), optional
+    uint32_t transferFamily = 0xFFFFFFFF;
 
     bool isComplete() {
         return graphicsFamily != 0xFFFFFFFF && presentFamily != 0xFFFFFFFF;
@@ -30,6 +36,44 @@ extern PFN_vkCmdSetColorBlendEquationEXT vkCmdSetColorBlendEquationEXT_;
 // This #define lets you call the function the same way as if it was coming from the vulkan.h header
 #define vkCmdSetColorBlendEquationEXT vkCmdSetColorBlendEquationEXT_
 #endif
+#ifndef vkCmdBindShadersEXT
+/* VK_EXT_shader_object entry points, loaded alongside the dynamic color functions */
+extern PFN_vkCreateShadersEXT vkCreateShadersEXT_;
+extern PFN_vkDestroyShaderEXT vkDestroyShaderEXT_;
+extern PFN_vkCmdBindShadersEXT vkCmdBindShadersEXT_;
+extern PFN_vkCmdSetVertexInputEXT vkCmdSetVertexInputEXT_;
+extern PFN_vkCmdSetPolygonModeEXT vkCmdSetPolygonModeEXT_;
+extern PFN_vkCmdSetRasterizationSamplesEXT vkCmdSetRasterizationSamplesEXT_;
+extern PFN_vkCmdSetSampleMaskEXT vkCmdSetSampleMaskEXT_;
+extern PFN_vkCmdSetAlphaToCoverageEnableEXT vkCmdSetAlphaToCoverageEnableEXT_;
+extern PFN_vkCmdSetDepthClampEnableEXT vkCmdSetDepthClampEnableEXT_;
+extern PFN_vkCmdSetLogicOpEnableEXT vkCmdSetLogicOpEnableEXT_;
+extern PFN_vkCmdSetColorBlendEnableEXT vkCmdSetColorBlendEnableEXT_;
+#define vkCreateShadersEXT vkCreateShadersEXT_
+#define vkDestroyShaderEXT vkDestroyShaderEXT_
+#define vkCmdBindShadersEXT vkCmdBindShadersEXT_
+#define vkCmdSetVertexInputEXT vkCmdSetVertexInputEXT_
+#define vkCmdSetPolygonModeEXT vkCmdSetPolygonModeEXT_
+#define vkCmdSetRasterizationSamplesEXT vkCmdSetRasterizationSamplesEXT_
+#define vkCmdSetSampleMaskEXT vkCmdSetSampleMaskEXT_
+#define vkCmdSetAlphaToCoverageEnableEXT vkCmdSetAlphaToCoverageEnableEXT_
+#define vkCmdSetDepthClampEnableEXT vkCmdSetDepthClampEnableEXT_
+#define vkCmdSetLogicOpEnableEXT vkCmdSetLogicOpEnableEXT_
+#define vkCmdSetColorBlendEnableEXT vkCmdSetColorBlendEnableEXT_
+#endif
+#ifndef vkCmdBindDescriptorBuffersEXT
+/* VK_EXT_descriptor_buffer entry points */
+extern PFN_vkGetDescriptorSetLayoutSizeEXT vkGetDescriptorSetLayoutSizeEXT_;
+extern PFN_vkGetDescriptorSetLayoutBindingOffsetEXT vkGetDescriptorSetLayoutBindingOffsetEXT_;
+extern PFN_vkGetDescriptorEXT vkGetDescriptorEXT_;
+extern PFN_vkCmdBindDescriptorBuffersEXT vkCmdBindDescriptorBuffersEXT_;
+extern PFN_vkCmdSetDescriptorBufferOffsetsEXT vkCmdSetDescriptorBufferOffsetsEXT_;
+#define vkGetDescriptorSetLayoutSizeEXT vkGetDescriptorSetLayoutSizeEXT_
+#define vkGetDescriptorSetLayoutBindingOffsetEXT vkGetDescriptorSetLayoutBindingOffsetEXT_
+#define vkGetDescriptorEXT vkGetDescriptorEXT_
+#define vkCmdBindDescriptorBuffersEXT vkCmdBindDescriptorBuffersEXT_
+#define vkCmdSetDescriptorBufferOffsetsEXT vkCmdSetDescriptorBufferOffsetsEXT_
+#endif
 
 struct SwapChainSupportDetails {
     VkSurfaceCapabilitiesKHR capabilities;
@@ -86,7 +130,9 @@ namespace VK
         TRANSFER,
         UNIFORM,
         VERTEX,
-        INDEX
+        INDEX,
+        STREAM, //Host visible vertex data rewritten every frame, e.g. instance records
+        STORAGE //Device local storage buffers read (and written) by shaders
     };
     struct Buffer
     {
@@ -94,6 +140,13 @@ namespace VK
         VmaAllocation allocation;
 
         BufferType type;
+        //Size the VkBuffer was created with, at least what was asked for. The size of the range when sub-allocated
+        VkDeviceSize size;
+        //Shader visible address, set when the render target's bufferDeviceAddress is on (uniform and storage buffers with descriptorBuffer)
+        VkDeviceAddress address;
+        //Where the range starts in buffer, 0 unless it is carved out of one of a pool's shared buffers (allocation is then the shared one's)
+        VkDeviceSize offset;
+        VmaVirtualAllocation subAllocation;
     };
     struct SamplerSettings
     {
@@ -147,25 +200,163 @@ namespace VK
         std::vector<VK::Buffer> buffers;
         std::vector<VK::Texture> textures;
         std::vector<VK::FrameBuffer> fbos;
-        uint32_t bufferIndex = 0, textureIndex = 0, fboIndex = 0;
+        std::vector<VkPipeline> pipelines;
+        uint32_t bufferIndex = 0, textureIndex = 0, fboIndex = 0, pipelineIndex = 0;
+        //Graphics timeline value of the last submission that may use them, they are freed once it is reached
+        uint64_t value = 0;
+    };
+    //Large VkBuffer a pool sub-allocates ranges from, through a VMA virtual block
+    struct SharedBuffer
+    {
+        VkBuffer buffer;
+        VmaAllocation allocation;
+        VmaVirtualBlock block;
+        VkDeviceAddress address;
+    };
+    struct MemoryPoolStats
+    {
+        //Allocations made, and how many of them reused a stashed buffer
+        uint64_t allocations, reused;
+        //Bytes asked for and bytes of the buffers handed out, the difference is what rounding up to a size class wastes
+        VkDeviceSize requested, allocated;
+        //Free buffers kept for reuse
+        uint32_t stashedCount;
+        VkDeviceSize stashedBytes;
+        std::vector<VkDeviceSize> classes;
+        //Requested sizes rounded up to 16 bytes and how often each was asked for, shared buffer ranges aren't counted
+        std::vector<std::pair<VkDeviceSize, uint64_t>> histogram;
     };
     struct MemoryPool
     {
         VkRenderTarget* target;
+        //Free buffers per size class, and past the largest class ordered by size for a best fit
         std::vector<std::vector<VK::Buffer>> stashed;
+        std::multimap<VkDeviceSize, VK::Buffer> oversize;
+        //Sizes buffers are rounded up to, MemPoolSizes until adaptClasses picks them from the histogram
+        std::vector<VkDeviceSize> classes;
+        std::map<VkDeviceSize, uint64_t> histogram;
+        uint64_t allocations = 0, reused = 0;
+        VkDeviceSize requested = 0, allocated = 0;
         VmaPool pool;
         VkBufferUsageFlags usage;
         VK::BufferType type;
+        //Size of the shared buffers, 0 when every allocation is its own VkBuffer
+        VkDeviceSize sharedSize = 0;
+        std::vector<VK::SharedBuffer> shared;
 
         void init(VkRenderTarget* target, VK::BufferType type);
-        VK::Buffer alloc(void* memory, size_t size);
+        //alignment only applies to shared buffer ranges, it doesn't need to be a power of 2 so a vertex stride works
+        VK::Buffer alloc(void* memory, size_t size, VkDeviceSize alignment = 16);
+        VK::Buffer allocShared(size_t size, VkDeviceSize alignment);
         void free(VK::Buffer buffer);
         size_t PoolIndex(size_t);
+        VK::MemoryPoolStats stats();
+        //Replaces the size classes with up to count sizes at even quantiles of the histogram, plus the largest class.
+        //Stashed buffers are released, call it between levels once the histogram reflects the workload
+        void adaptClasses(uint32_t count);
     };
     struct MemoryPools
     {
-        MemoryPool transfer, vertex, index, uniform;
+        MemoryPool transfer, vertex, index, uniform, stream, storage;
+    };
+    //Piece of the current frame's uniform ring, bound through a UNIFORM_BUFFER_DYNAMIC descriptor with offset as the dynamic offset
+    struct UniformSlice
+    {
+        VkBuffer buffer;
+        uint32_t offset;
+        void* mapped;
     };
+    struct UniformRing
+    {
+        VkBuffer buffer;
+        VmaAllocation allocation;
+        uint8_t* mapped;
+        VkDeviceSize head;
+    };
+    //Piece of the current frame's descriptor buffer, offset is what vkCmdSetDescriptorBufferOffsetsEXT takes
+    struct DescriptorSlice
+    {
+        VkDeviceSize offset;
+        uint8_t* mapped;
+    };
+    //Piece of the current frame's staging ring, copy commands read it from buffer at offset
+    struct StagingSlice
+    {
+        VkBuffer buffer;
+        VkDeviceSize offset;
+        uint8_t* mapped;
+    };
+    struct StagingRing
+    {
+        VkBuffer buffer;
+        VmaAllocation allocation;
+        uint8_t* mapped;
+        VkDeviceSize size, head;
+        //Bytes staged this frame, including what went into retired rings
+        VkDeviceSize staged;
+        //Graphics and transfer timeline values of the last submissions whose uploads read the ring
+        uint64_t value, transferValue;
+        //Rings this one grew out of, still read by copies recorded this frame
+        std::vector<VK::Buffer> retired;
+    };
+    //Upload or framebuffer command buffer, free once its queue's timeline reaches value
+    struct UploadBatch
+    {
+        VkCommandBuffer cmd;
+        uint64_t value;
+    };
+    //When an upload is done. Transfer queue uploads are complete once their copies are, and become usable by the
+    //first graphics submission after that; graphics queue uploads are usable right away in submission order
+    struct UploadToken
+    {
+        uint64_t value;
+        bool transfer;
+    };
+    //Graphics queue half of a transfer queue upload's ownership transfer, recorded once the copy is complete
+    struct UploadAcquire
+    {
+        uint64_t value;
+        bool image;
+        VkBufferMemoryBarrier2 bufferBarrier;
+        VkImageMemoryBarrier2 imageBarrier;
+    };
+    struct StagingStats
+    {
+        //Bytes staged so far this frame and the current frame's ring size
+        VkDeviceSize used, size;
+        //Most any frame has staged, and how often a ring had to grow
+        VkDeviceSize peak;
+        uint32_t grows;
+    };
+    struct DescriptorRing
+    {
+        VkBuffer buffer;
+        VmaAllocation allocation;
+        uint8_t* mapped;
+        VkDeviceAddress address;
+        VkDeviceSize head;
+    };
+    //Depth attachment formats, created with depth/stencil usage and viewed through the depth aspect
+    inline bool IsDepthFormat(VkFormat f)
+    {
+        switch (f)
+        {
+        case VK_FORMAT_D16_UNORM:
+        case VK_FORMAT_X8_D24_UNORM_PACK32:
+        case VK_FORMAT_D32_SFLOAT:
+        case VK_FORMAT_D16_UNORM_S8_UINT:
+        case VK_FORMAT_D24_UNORM_S8_UINT:
+        case VK_FORMAT_D32_SFLOAT_S8_UINT:
+            return true;
+        default:
+            return false;
+        }
+    }
+    //Only these get a stencil aspect and attachment
+    inline bool HasStencil(VkFormat f)
+    {
+        return f == VK_FORMAT_D16_UNORM_S8_UINT || f == VK_FORMAT_D24_UNORM_S8_UINT || f == VK_FORMAT_D32_SFLOAT_S8_UINT;
+    }
 }
 
 
@@ -190,21 +381,78 @@ public:
 
     VkCommandPool commandPool;
     //VkCommandBuffer mainCommandBuffers[COMMAND_BUFFER_COUNT];
+    //Recording between BeginFramebuffer and EndFramebuffer
     VkCommandBuffer fboCmd;
     VkCommandBuffer currentCmd;
     VK::Texture currentImage;
-    VkCommandBuffer GetUploadCmd() { return uploadCommandBuffer[currUpload_]; }
-
-    VkFence fboFence;
-    
-    VkRenderPass renderPass;
-    VkRenderPass fboPass;
+    //Graphics batch opened by BeginUploadCommands(), everything recorded into it is submitted ahead of the next frame or framebuffer
+    VkCommandBuffer GetUploadCmd() { return uploadBatches_[openUpload_].cmd; }
+    //Signaled with an increasing value by every graphics submission
+    VkSemaphore graphicsTimeline;
+    //Set before InitVulkan to run VkBufferTools and VK::CreateTexture copies on a dedicated transfer queue family,
+    //cleared when the device has none. Resources uploaded there are only usable once their token completes
+    bool asyncTransfer = false;
+    VkQueue transferQueue = VK_NULL_HANDLE;
+    VkSemaphore transferTimeline = VK_NULL_HANDLE;
+
+    VkRenderPass renderPass = VK_NULL_HANDLE;
+    VkRenderPass fboPass = VK_NULL_HANDLE;
+    //Set before InitVulkan, formats without stencil (e.g. VK_FORMAT_D32_SFLOAT) leave the stencil attachment out
+    VkFormat depthFormat = VK_FORMAT_D24_UNORM_S8_UINT;
+
+    //Set before InitVulkan to render with VK_KHR_dynamic_rendering instead of VkRenderPass/VkFramebuffer objects,
+    //cleared when the device doesn't support it. Collections need to be generated with "dynamicRendering"
+    bool dynamicRendering = false;
+
+    //Set when VK_EXT_graphics_pipeline_library is enabled, generated pipelines are then linked from shared libraries
+    bool graphicsPipelineLibrary = false;
+    //Set when VK_EXT_shader_object is enabled, generated draws then bind shader objects and set all state dynamically
+    bool shaderObject = false;
+    VKShaderObjectState shaderState = {};
+    //Set before InitVulkan to carve vertex and index buffers out of shared VkBuffers of this size (e.g. 64 MiB) instead of
+    //creating one per mesh. Draws from "sharedBuffers" collections then only rebind when the buffers change
+    VkDeviceSize sharedBufferSize = 0;
+    VKBufferBindState bindState = {};
+    //Set when VK_EXT_vertex_input_dynamic_state is enabled, required by "dynamicVertexInput" pipelines
+    bool vertexInputDynamicState = false;
+
+    //Size of each frame in flight's persistently mapped uniform ring, set before InitVulkan
+    VkDeviceSize uniformRingSize = 4 * 1024 * 1024;
+    //minUniformBufferOffsetAlignment, every slice starts on it
+    VkDeviceSize uniformAlignment = 256;
+    //Set when the ring landed in uncached device local memory, AllocUniform then uses streaming stores
+    bool uniformRingWriteCombined = false;
+    //Copies size bytes (when data is set) into the current frame's ring, the slice is valid until this frame comes around again
+    VK::UniformSlice AllocUniform(const void* data, VkDeviceSize size);
+    VkBuffer GetUniformRing() { return uniformRings_[currentFrame].buffer; }
+    VkBuffer GetUniformRing(size_t frame) { return uniformRings_[frame].buffer; }
+    //Size each frame in flight's persistently mapped staging ring starts with, set before InitVulkan. A full ring grows to fit
+    VkDeviceSize stagingRingSize = 8 * 1024 * 1024;
+    //Copies size bytes (when data is set) into the current frame's staging ring for an upload command to read,
+    //the slice is valid until this frame comes around again. The memory is coherent, writing through mapped needs no flush
+    VK::StagingSlice AllocStaging(const void* data, VkDeviceSize size, VkDeviceSize alignment = 16);
+    VK::StagingStats GetStagingStats();
+    //Set before InitVulkan to write descriptors into a per frame VK_EXT_descriptor_buffer ring instead of allocating sets
+    //from the pools, cleared when the device doesn't support it. Collections need to be generated with "descriptorBuffer"
+    bool descriptorBuffer = false;
+    //Size of each frame in flight's descriptor ring, set before InitVulkan
+    VkDeviceSize descriptorRingSize = 1024 * 1024;
+    //Descriptor sizes and the ring's offset alignment, filled in when descriptorBuffer is on
+    VkPhysicalDeviceDescriptorBufferPropertiesEXT descriptorBufferProperties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_PROPERTIES_EXT };
+    //Room for size bytes of descriptors in the current frame's ring, valid until this frame comes around again
+    VK::DescriptorSlice AllocDescriptors(VkDeviceSize size);
+    //Binds the current frame's ring as descriptor buffer 0, StartRender and BeginFramebuffer do this for their command buffers
+    void BindDescriptorBuffer(VkCommandBuffer cmd);
+    VkDeviceAddress GetBufferAddress(VkBuffer buffer);
+    //Set before InitVulkan so every GPU readable memory pool buffer has a VK::Buffer::address for buffer_reference pointers,
+    //cleared when the device doesn't support it. Collections generated with "bufferDeviceAddress" need it
+    bool bufferDeviceAddress = false;
+    //Shared by every "deltaPushConstants" collection, pushRecorder.lastFrameBytes reports what the last frame pushed
+    VkPushRecorder pushRecorder;
 
     struct SubmissionResources {
-        VkFence fence;
         VkSemaphore image_acquired_semaphore;
         VkCommandBuffer cmd;
-        uint16_t startUpload, countUpload;
         //VkCommandBuffer graphics_to_present_cmd;
         //VkBuffer uniform_buffer;
         //VkDeviceMemory uniform_memory;
@@ -232,8 +480,21 @@ public:
 
     void InitVulkan(void* window);
 
-    void BeginUploadCommands();
+    //Opens the batch copies are recorded into. With transfer set and asyncTransfer on it is the transfer queue's batch,
+    //which only takes copies and barriers
+    VkCommandBuffer BeginUploadCommands(bool transfer = false);
+    //Barriers the batch's copies need before they are read, merged into one vkCmdPipelineBarrier2 when the batch is submitted.
+    //On the transfer batch they become the release and acquire halves of a queue family ownership transfer
+    void AddUploadBarrier(const VK::Buffer& buffer, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess, bool transfer = false);
+    void AddUploadImageBarrier(const VkImageMemoryBarrier2& barrier, bool transfer = false);
+    //Submits the batches on their own, EndRender and EndFramebuffer put the graphics one in their submission instead.
+    //The transfer batch's acquires wait for the first graphics submission after its copies are done
     void PushUploads();
+    //Token for the uploads recorded so far into the graphics or transfer batch
+    VK::UploadToken GetUploadToken(bool transfer = false);
+    bool IsUploadComplete(VK::UploadToken token);
+    //Blocks until a transfer queue upload's copies are done, so the next graphics submission acquires it
+    void WaitUpload(VK::UploadToken token);
 
     void BeginFramebuffer(VkExtent2D extent, VkFormat imageFormat);
     void EndFramebuffer();
@@ -245,14 +506,39 @@ public:
     VkDescriptorSet getDescSet(VkDescFormat fmt, uint32_t subIndex, VkDescriptorSetLayout* layout);
     void PushSingleFrameBuffer(VK::Buffer staging);
     void PushSingleTexture(VK::Texture& staging);
+    //Destroyed once the frames that may have drawn with it are done, for pipelines replaced while in use
+    void PushSingleFramePipeline(VkPipeline pipeline);
+    //Generated draws bind their pipelines through here, so a shader object draw after it rebinds its shaders and state
+    void BindGraphicsPipeline(VkCommandBuffer command, VkPipeline pipeline);
 private:
     SwapChainSupportDetails swapChainSupport_;
     uint32_t imageIndex;
-    bool uploadStarted_ = false;
-    int currUpload_ = 0;
-#define UPLOAD_BUFFER_COUNT 16
-    VkCommandBuffer uploadCommandBuffer[UPLOAD_BUFFER_COUNT];
-    VkFence uploadFences[UPLOAD_BUFFER_COUNT];
+    std::vector<VK::UploadBatch> uploadBatches_;
+    int openUpload_ = -1;
+    VkMemoryBarrier2 uploadBarrier_ = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+    std::vector<VkImageMemoryBarrier2> uploadImageBarriers_;
+    //Staging rings written since the last batch went out, one bit per frame in flight
+    uint32_t uploadRings_ = 0;
+    //Last value a graphics submission signals graphicsTimeline with
+    uint64_t graphicsValue_ = 0;
+    VkCommandPool transferPool_ = VK_NULL_HANDLE;
+    uint32_t graphicsFamily_ = 0, transferFamily_ = 0;
+    std::vector<VK::UploadBatch> transferBatches_;
+    int openTransfer_ = -1;
+    std::vector<VkBufferMemoryBarrier2> uploadBufferBarriers_, releaseBuffers_;
+    std::vector<VkImageMemoryBarrier2> releaseImages_;
+    std::vector<VK::UploadAcquire> acquires_;
+    uint64_t transferValue_ = 0;
+    std::vector<VK::UploadBatch> fboBatches_;
+    int openFbo_ = -1;
+    int beginBatch(VkCommandPool pool, VkSemaphore timeline, std::vector<VK::UploadBatch>& batches);
+    void flushTransfer();
+    bool endUploads(VkCommandBufferSubmitInfo& info, VkSemaphoreSubmitInfo& transferWait);
+    VK::UniformRing uniformRings_[COMMAND_BUFFER_COUNT] = {};
+    VK::DescriptorRing descriptorRings_[COMMAND_BUFFER_COUNT] = {};
+    VK::StagingRing stagingRings_[COMMAND_BUFFER_COUNT] = {};
+    VkDeviceSize stagingPeak_ = 0;
+    uint32_t stagingGrows_ = 0;
     void* window_;
     
     void destroyTexture(VK::Texture& tex);
@@ -263,6 +549,7 @@ private:
     void createInstance(void* window);
     void createSurface(void* window);
     void createMemAlloc();
+    void createStagingRing(VK::StagingRing& ring, VkDeviceSize size);
 
     void createCommandPool();
 
@@ -305,7 +592,11 @@ private:
     void setupDebugMessenger();
 
     VkImageView createImageView(VkImage image, VkFormat format);
+    void transitionAttachment(VkCommandBuffer cmd, VkImage image, VkImageAspectFlags aspect, VkImageLayout oldLayout, VkImageLayout newLayout);
+    void beginRendering(VkCommandBuffer cmd, VK::FrameBuffer& fbo, VkExtent2D extent, VkClearValue* clearValues);
     void createDescPools();
+    void createUniformRings();
+    void createDescriptorRings();
 };
 
 #endif
\ No newline at end of file
@@ -30,7 +30,9 @@ const char* vert_frag_1=R"z(
     fragShaderStageInfo.pName = "main";
 
     VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
+)z";
 
+const char* vertex_input_1 = R"z(
     VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
     vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 )z";
@@ -51,12 +53,16 @@ const char* shader_mid2 = R"z( };
     dynamicStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
     dynamicStateCreateInfo.dynamicStateCount = sizeof(dynamicState) / sizeof(dynamicState[0]);
     dynamicStateCreateInfo.pDynamicStates = dynamicState;
+)z";
 
+const char* shader_multisample = R"z(
     VkPipelineMultisampleStateCreateInfo multisampling = {};
     multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
     multisampling.sampleShadingEnable = VK_FALSE;
     multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+)z";
 
+const char* shader_rasterizer = R"z(
     VkPipelineRasterizationStateCreateInfo rasterizer = {};
     rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
     rasterizer.depthClampEnable = VK_FALSE;
@@ -75,6 +81,7 @@ const char* shader_mid3 = R"z(
 )z";
 
 const char* shader_end = R"z(
+    pipelineInfo.pDepthStencilState = &depthStencil;
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
     pipelineInfo.stageCount = 2;
     pipelineInfo.pStages = shaderStages;
@@ -98,3 +105,71 @@ const char* shader_end = R"z(
     vkDestroyShaderModule(target->device, vertShaderModule, nullptr);
 }
 )z";
+
+const char* pipeline_rendering = R"z(
+    VkPipelineRenderingCreateInfo renderingInfo = { VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO };
+    renderingInfo.colorAttachmentCount = 1;
+    renderingInfo.pColorAttachmentFormats = &target->swapChainImageFormat;
+    renderingInfo.depthAttachmentFormat = target->depthFormat;
+    renderingInfo.stencilAttachmentFormat = VK::HasStencil(target->depthFormat) ? target->depthFormat : VK_FORMAT_UNDEFINED;
+)z";
+
+const char* library_vert_stage = R"z(
+    VkPipelineShaderStageCreateInfo vertShaderStageInfo = {};
+    vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+    vertShaderStageInfo.module = vertShaderModule;
+    vertShaderStageInfo.pName = "main";
+)z";
+
+const char* library_frag_stage = R"z(
+    VkPipelineShaderStageCreateInfo fragShaderStageInfo = {};
+    fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    fragShaderStageInfo.module = fragShaderModule;
+    fragShaderStageInfo.pName = "main";
+)z";
+
+const char* library_begin = R"z(
+    VkGraphicsPipelineCreateInfo pipelineInfo = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+    pipelineInfo.pNext = &libraryInfo;
+    pipelineInfo.flags = VK_PIPELINE_CREATE_LIBRARY_BIT_KHR | VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT;
+    pipelineInfo.pDynamicState = &dynamicStateCreateInfo;
+)z";
+
+const char* library_end = R"z(
+    if (vkCreateGraphicsPipelines(target->device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &library) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create graphics pipeline library!");
+    }
+)z";
+
+const char* shader_object_state = R"z(
+static void ResetShaderObjectGroups(VKShaderObjectState& cache, const void* owner) {
+    cache.owner = owner;
+    cache.vertexInput = -1;
+    cache.topology = -1;
+    cache.rasterizer = -1;
+    cache.depth = -1;
+    cache.depthBias = -1;
+    cache.stencil = -1;
+    cache.blend = -1;
+}
+static void BeginShaderObjectState(VkCommandBuffer command, VKShaderObjectState& cache) {
+    cache.command = command;
+    cache.vert = VK_NULL_HANDLE;
+    cache.frag = VK_NULL_HANDLE;
+    ResetShaderObjectGroups(cache, nullptr);
+
+    //State no shader in compileinfo.json changes, set once per command buffer
+    VkSampleMask sampleMask = 0xFFFFFFFF;
+    vkCmdSetRasterizerDiscardEnable(command, VK_FALSE);
+    vkCmdSetPolygonModeEXT(command, VK_POLYGON_MODE_FILL);
+    vkCmdSetRasterizationSamplesEXT(command, VK_SAMPLE_COUNT_1_BIT);
+    vkCmdSetSampleMaskEXT(command, VK_SAMPLE_COUNT_1_BIT, &sampleMask);
+    vkCmdSetAlphaToCoverageEnableEXT(command, VK_FALSE);
+    vkCmdSetDepthClampEnableEXT(command, VK_FALSE);
+    vkCmdSetDepthBoundsTestEnable(command, VK_FALSE);
+    vkCmdSetLogicOpEnableEXT(command, VK_FALSE);
+    vkCmdSetLineWidth(command, 1.0f);
+}
+)z";
@@ -2,6 +2,8 @@
 #include "rapidyaml-0.5.0.hpp"
 #include "vulkan/vulkan_core.h"
 #include <unordered_map>
+#include <algorithm>
+#include <string.h>
 
 namespace Binding
 {
@@ -22,6 +24,7 @@ namespace Binding
         UVEC2,
         UVEC3,
         UVEC4,
+        ADDRESS, //buffer_reference pointer, a VkDeviceAddress on the C++ side
         STRUCT
     };
 }
@@ -59,6 +62,8 @@ std::string BindingToStride(Binding::BindingEnum e)
         return "12";
     case Binding::UVEC4:
         return "16";
+    case Binding::ADDRESS:
+        return "8";
     default:
         return "16";
     }
@@ -97,6 +102,8 @@ int BindingToStrideI(Binding::BindingEnum e)
         return 12;
     case Binding::UVEC4:
         return 16;
+    case Binding::ADDRESS:
+        return 8;
     default:
         return 16;
     }
@@ -108,7 +115,50 @@ struct BindingDef
     std::string offset, stride;
     Binding::BindingEnum type;
     std::string format, rate;
+    std::string packed; //half, snorm16, unorm16, snorm8 or unorm8
+    int packedLanes = 0;
+    int byteOffset = 0; //Offset within the binding for generated layouts
+    bool batched = false; //Instance attribute read from the entry's batch struct
 };
+//Compact formats an "inputs" entry can ask for with "packed", float based inputs only
+bool ApplyPacking(BindingDef& input)
+{
+    int components = input.type == Binding::FLOAT ? 1 : input.type == Binding::VEC2 ? 2 :
+        input.type == Binding::VEC3 ? 3 : input.type == Binding::VEC4 ? 4 : 0;
+    if (components == 0)
+    {
+        printf("Packed input %s must be a float, vec2, vec3 or vec4\n", input.name.c_str());
+        return false;
+    }
+    if (input.packed == "half" || input.packed == "snorm16" || input.packed == "unorm16")
+    {
+        //3 component 16 bit formats lack vertex buffer support on many devices, vec3 uses 4 lanes
+        const char* lanes[] = { "", "R16_", "R16G16_", "", "R16G16B16A16_" };
+        input.packedLanes = components == 3 ? 4 : components;
+        input.format = "VK_FORMAT_" + std::string(lanes[input.packedLanes]) +
+            (input.packed == "half" ? "SFLOAT" : input.packed == "snorm16" ? "SNORM" : "UNORM");
+        return true;
+    }
+    if (input.packed == "snorm8" || input.packed == "unorm8")
+    {
+        input.packedLanes = 4;
+        input.format = input.packed == "snorm8" ? "VK_FORMAT_R8G8B8A8_SNORM" : "VK_FORMAT_R8G8B8A8_UNORM";
+        return true;
+    }
+    printf("Unknown packed format %s for input %s\n", input.packed.c_str(), input.name.c_str());
+    return false;
+}
+int PackedLaneBytes(const BindingDef& input)
+{
+    return input.packed == "snorm8" || input.packed == "unorm8" ? 1 : 2;
+}
+//Bytes an input takes in a vertex, packed inputs are padded to keep attributes 4 byte aligned
+int InputSize(const BindingDef& input)
+{
+    if (input.packed.empty())
+        return BindingToStrideI(input.type);
+    return (input.packedLanes * PackedLaneBytes(input) + 3) & ~3;
+}
 struct TextureDef
 {
     std::string name;
@@ -117,11 +167,21 @@ struct TextureDef
 struct UniformDef
 {
     std::string name;
+    std::string structName; //Reflected block type, the generated struct
     int binding, set;
+    bool storage = false; //Storage buffer, bound as VK_DESCRIPTOR_TYPE_STORAGE_BUFFER over the whole buffer
+};
+struct SpecConstantDef
+{
+    std::string name;
+    int id;
+    std::string type;
+    std::string value; //Reflected default
 };
 struct ShaderFragDef
 {
     std::string name;
+    std::vector<SpecConstantDef> specs;
     std::vector<TextureDef> texs;
     std::vector<UniformDef> ubos;
     std::string push;
@@ -130,11 +190,25 @@ struct ShaderFragDef
 struct ShaderVertDef
 {
     std::string name;
+    std::vector<SpecConstantDef> specs;
     std::vector<BindingDef> inputs;
+    bool generatedLayout = false; //Layout built from the reflected inputs, vertex rate streams in binding 0 and 1
+    std::string split; //Input given its own stream in binding 0, the rest go to binding 1
+    std::vector<TextureDef> texs;
+    std::vector<UniformDef> ubos;
+    std::string push;
+    std::string pushStages;
+};
+struct ShaderCompDef
+{
+    std::string name;
+    std::vector<SpecConstantDef> specs;
     std::vector<TextureDef> texs;
     std::vector<UniformDef> ubos;
     std::string push;
     std::string pushStages;
+    int localSize[3] = { 1, 1, 1 }; //Reflected workgroup size
+    int localSizeSpec[3] = { -1, -1, -1 }; //Constant id when a dimension is a specialization constant
 };
 struct StencilDef
 {
@@ -168,30 +242,85 @@ struct DepthBias
     std::string depthBiasSlopeFactor;
 };
 
+enum LibraryPartType
+{
+    LIBRARY_VERTEX_INPUT,
+    LIBRARY_PRE_RASTERIZATION,
+    LIBRARY_FRAGMENT_SHADER,
+    LIBRARY_FRAGMENT_OUTPUT,
+    LIBRARY_PART_COUNT
+};
+//Groups of vkCmdSet* calls a shader object draw is elided on, matching VKShaderObjectState
+enum ShaderStateGroup
+{
+    STATE_VERTEX_INPUT,
+    STATE_TOPOLOGY,
+    STATE_RASTERIZER,
+    STATE_DEPTH,
+    STATE_DEPTH_BIAS,
+    STATE_STENCIL,
+    STATE_BLEND,
+    STATE_GROUP_COUNT
+};
+const char* ShaderStateGroupFields[STATE_GROUP_COUNT] = {
+    "vertexInput",
+    "topology",
+    "rasterizer",
+    "depth",
+    "depthBias",
+    "stencil",
+    "blend",
+};
+
 struct ShaderDef
 {
     std::string name;
     ShaderVertDef vert;
     ShaderFragDef frag;
+    ShaderCompDef comp; //Only set for entries in ShaderProcess::computes
     std::string topo, depth, cullMode = "VK_CULL_MODE_NONE", frontFace = "VK_FRONT_FACE_COUNTER_CLOCKWISE";
     DepthBias depthBias = {};
     bool depthWrite;
     std::vector<std::string> dynamicStates;
     StencilDef stencil;
     BlendDef blend;
+    int libraryParts[LIBRARY_PART_COUNT] = {};
+    int shaderObjects[2] = {}; //Vertex and fragment VkShaderEXT
+    int stateGroups[STATE_GROUP_COUNT] = {};
+    //Entries sharing one pipeline with the state that differs made dynamic
+    int pipelineOwner = -1;
+    std::vector<std::string> collapsedStates;
+    std::string statePreamble;
+    //<Shader>_DepthOnly variant: position stream only, binding 1 is a stride 0 source for the other attributes
+    bool depthOnly = false;
+    bool noFragment = false;
+    //Struct whose members feed the matching inputs per instance, <Shader>_Batch collects them into instanced draws
+    std::string batch;
+    //Push block over the push constant limit, read from a dynamic uniform slice at (pushSet, 0) instead
+    bool pushUniform = false;
+    int pushSet = 0;
+    //Specialization constant values of a named variant from "specialization", by constant name
+    std::vector<std::pair<std::string, std::string>> specValues;
+    //Combination of a "variants" matrix, variantShared entries are created by their group's indexed function
+    int variantGroup = -1;
+    int variantIndex = 0;
+    bool variantShared = false;
 };
 struct ShaderStructPart
 {
     Binding::BindingEnum type;
     std::string structName;
     std::string name;
-    int count;
+    int count; //0 for a runtime array
+    int offset = -1, arrayStride = 0, matrixStride = 0; //As reflected, used by explicit layouts
+    std::string pointee; //Struct an ADDRESS member points at, empty when it isn't a reflected struct
 };
 struct ShaderStruct
 {
     std::string name;
     std::vector<ShaderStructPart> parts;
     int totalStride;
+    bool explicitLayout = false; //Storage buffer (std430) struct, emitted from the reflected offsets
 };
 
 template<class T>
@@ -201,25 +330,109 @@ struct StagesDef
     std::string stages;
 };
 
+const char* LibraryPartFlags[LIBRARY_PART_COUNT] = {
+    "VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT",
+    "VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT",
+    "VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT",
+    "VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT",
+};
+struct PipelineLibraryPart
+{
+    LibraryPartType type;
+    std::string key;
+    int shader; //First shader using the part, it provides the modules and layout
+};
+struct ShaderObjectPart
+{
+    bool frag;
+    std::string key;
+    int shader; //First shader using the object, it provides the layout
+};
+//Entries expanded from a "variants" matrix, contiguous in ShaderProcess::shaders with the last axis varying fastest
+struct VariantGroup
+{
+    std::string name; //<Shader>, or with the specialization variant and _DepthOnly suffixes
+    std::string owner; //Entry the axes were declared on, names the axis enums
+    std::vector<std::string> axes;
+    std::vector<std::vector<std::string>> options;
+    int first; //First combination in ShaderProcess::shaders
+    int count;
+    bool lazy = false;
+    std::vector<int> fields; //VariantStateFields that differ between the combinations
+};
+
 struct ShaderProcess
 {
     std::string name;
     std::vector<std::string> includes;
     std::vector<ShaderDef> shaders;
+    //Entries with a "comp" stage, built as compute pipelines with their own enum
+    std::vector<ShaderDef> computes;
+    std::vector<VariantGroup> variantGroups;
     std::unordered_map<std::string, ShaderStruct> structs;
+    //VK_EXT_graphics_pipeline_library: shared library parts, fast link and background optimized link
+    bool pipelineLibrary = false;
+    std::vector<PipelineLibraryPart> libraries;
+    //VK_EXT_shader_object: unlinked shaders with all state set dynamically
+    bool shaderObject = false;
+    std::vector<ShaderObjectPart> shaderObjects;
+    std::vector<std::string> stateGroups[STATE_GROUP_COUNT];
+    //VK_EXT_extended_dynamic_state 1/2/3: entries differing only in dynamic capable state share a pipeline
+    bool collapseDynamicState = false;
+    //VK_EXT_vertex_input_dynamic_state: draws set their vertex layout, entries differing only in layout share a pipeline
+    bool dynamicVertexInput = false;
+    //VK_KHR_dynamic_rendering: pipelines carry attachment formats and are used without a render pass
+    bool dynamicRendering = false;
+    //Emit a struct, layout static_asserts and a pack function for every generated vertex layout
+    bool vertexStructs = false;
+    //Uniform buffers are UNIFORM_BUFFER_DYNAMIC slices of the render target's per frame ring, draws take their offsets
+    bool dynamicUniforms = false;
+    //Push blocks larger than this many bytes are promoted to dynamic uniforms, 128 is the guaranteed maxPushConstantsSize
+    int pushConstantLimit = 128;
+    //Modules rewritten to read their push block from a uniform, by array name
+    std::unordered_map<std::string, std::vector<unsigned char>> pushUniformSpirv;
+    //Push constants go through the render target's VkPushRecorder, only members that changed are pushed
+    bool deltaPushConstants = false;
+    //Structs are alignas(16) and every uniform and push block gets a Write<Struct> using streaming stores
+    bool uniformWriters = false;
+    //VK_EXT_descriptor_buffer: descriptors are written into the render target's per frame descriptor ring
+    bool descriptorBuffer = false;
+    //buffer_reference pointers are used, _PopulatePipeline checks the render target enabled buffer device addresses
+    bool bufferDeviceAddress = false;
+    //Indexed draws take a vertexOffset and draws skip vertex and index binds matching the last ones,
+    //for meshes sub-allocated out of the render target's shared buffers
+    bool sharedBuffers = false;
 };
 
+bool ParseBool(const std::string& str)
+{
+    return !(_strcmpi(str.data(), "VK_FALSE") == 0 || _strcmpi(str.data(), "false") == 0 || _strcmpi(str.data(), "0") == 0);
+}
+
+void MarkExplicitLayout(ShaderProcess& process, const std::string& name);
 std::unordered_map<std::string, std::string> ParseStruct(ryml::Tree& doc, ShaderProcess& process)
 {
     std::unordered_map<std::string, std::string> fileMapping;
     if (doc.has_child(doc.root_id(), "types"))
     {
+        //buffer_reference pointers are types of their own, by key to the key of the type they point at
+        std::unordered_map<std::string, std::string> pointers;
+        for (const auto& type : doc["types"].children())
+        {
+            if (type.has_child("physical_pointer"))
+            {
+                std::string pointee;
+                type["type"] >> pointee;
+                pointers[std::string(type.key().str, type.key().len)] = pointee;
+            }
+        }
+        std::vector<std::string> added;
         for (const auto& type : doc["types"].children())
         {
             std::string name, key;
             key = std::string(type.key().str, type.key().len);
             type["name"] >> name;
-            if (name.compare("gl_PerVertex") == 0)
+            if (name.compare("gl_PerVertex") == 0 || pointers.count(key))
                 continue;
 
             fileMapping[key] = name;
@@ -232,6 +445,12 @@ std::unordered_map<std::string, std::string> ParseStruct(ryml::Tree& doc, Shader
                     ShaderStructPart part = {};
                     mem["name"] >> part.name;
                     part.count = 1;
+                    if (mem.has_child("offset"))
+                        mem["offset"] >> part.offset;
+                    if (mem.has_child("array_stride"))
+                        mem["array_stride"] >> part.arrayStride;
+                    if (mem.has_child("matrix_stride"))
+                        mem["matrix_stride"] >> part.matrixStride;
                     if (mem.has_child("array"))
                     {
                         auto arr = mem["array"];
@@ -240,7 +459,14 @@ std::unordered_map<std::string, std::string> ParseStruct(ryml::Tree& doc, Shader
                             part.count *= atoi(arr[c].val().data());
                         }
                     }
-                    if (mem["type"] == "float")
+                    std::string memberType;
+                    mem["type"] >> memberType;
+                    if (pointers.count(memberType))
+                    {
+                        part.type = Binding::ADDRESS;
+                        part.pointee = pointers[memberType];
+                    }
+                    else if (mem["type"] == "float")
                     {
                         part.type = Binding::FLOAT;
                     }
@@ -315,11 +541,81 @@ std::unordered_map<std::string, std::string> ParseStruct(ryml::Tree& doc, Shader
                     strct.parts.push_back(part);
                 }
                 process.structs[name] = strct;
+                added.push_back(name);
+            }
+        }
+        //Pointees can come after the structs pointing at them. Both sides are laid out from the reflected offsets
+        for (auto& name : added)
+        {
+            for (auto& part : process.structs[name].parts)
+            {
+                if (part.type != Binding::ADDRESS)
+                    continue;
+                auto pointee = fileMapping.find(part.pointee);
+                part.pointee = pointee == fileMapping.end() ? "" : pointee->second;
+                MarkExplicitLayout(process, part.pointee);
+                MarkExplicitLayout(process, name);
             }
         }
     }
     return fileMapping;
 }
+void MarkExplicitLayout(ShaderProcess& process, const std::string& name)
+{
+    auto s = process.structs.find(name);
+    if (s == process.structs.end() || s->second.explicitLayout)
+        return;
+    s->second.explicitLayout = true;
+    for (auto& part : s->second.parts)
+    {
+        if (part.type == Binding::STRUCT)
+            MarkExplicitLayout(process, part.structName);
+    }
+}
+//Storage buffers share the stage's buffer list with the uniform blocks, kept in binding order
+void ReadStorageBuffers(ryml::Tree& doc, ShaderProcess& process, std::unordered_map<std::string, std::string>& structMap, std::vector<UniformDef>& buffers)
+{
+    if (!doc.has_child(doc.root_id(), "ssbos"))
+        return;
+    for (const auto& yssbo : doc["ssbos"])
+    {
+        UniformDef input = {};
+        std::string id;
+        yssbo["name"] >> input.name;
+        yssbo["type"] >> id;
+        input.structName = structMap[id];
+        yssbo["binding"] >> input.binding;
+        yssbo["set"] >> input.set;
+        input.storage = true;
+        MarkExplicitLayout(process, input.structName);
+        int i = 0;
+        for (; i < buffers.size(); ++i)
+        {
+            if (buffers[i].binding > input.binding)
+            {
+                buffers.insert(buffers.begin() + i, input);
+                break;
+            }
+        }
+        if (i == buffers.size())
+            buffers.push_back(input);
+    }
+}
+void ReadSpecConstants(ryml::Tree& doc, std::vector<SpecConstantDef>& specs)
+{
+    if (!doc.has_child(doc.root_id(), "specialization_constants"))
+        return;
+    for (const auto& yspec : doc["specialization_constants"])
+    {
+        SpecConstantDef spec = {};
+        yspec["name"] >> spec.name;
+        yspec["id"] >> spec.id;
+        yspec["type"] >> spec.type;
+        if (yspec.has_child("default_value"))
+            yspec["default_value"] >> spec.value;
+        specs.push_back(spec);
+    }
+}
 void ReadVertJson(std::string file, ShaderProcess& process, ShaderDef& shader)
 {
     ShaderVertDef& vert = shader.vert;
@@ -427,7 +723,10 @@ void ReadVertJson(std::string file, ShaderProcess& process, ShaderDef& shader)
         {
             UniformDef input = {};
 
+            std::string id;
             ytex["name"] >> input.name;
+            ytex["type"] >> id;
+            input.structName = structMap[id];
             ytex["binding"] >> input.binding;
             ytex["set"] >> input.set;
             int i = 0;
@@ -443,6 +742,8 @@ void ReadVertJson(std::string file, ShaderProcess& process, ShaderDef& shader)
                 vert.ubos.push_back(input);
         }
     }
+    ReadStorageBuffers(doc, process, structMap, vert.ubos);
+    ReadSpecConstants(doc, vert.specs);
     if (doc.has_child(doc.root_id(), "textures"))
     {
         for (const auto& ytex : doc["textures"])
@@ -498,12 +799,17 @@ void ReadFragJson(std::string file, ShaderProcess& process, ShaderDef& shader)
         {
             UniformDef input = {};
 
+            std::string id;
             ytex["name"] >> input.name;
+            ytex["type"] >> id;
+            input.structName = structMap[id];
             ytex["binding"] >> input.binding;
             ytex["set"] >> input.set;
             frag.ubos.push_back(input);
         }
     }
+    ReadStorageBuffers(doc, process, structMap, frag.ubos);
+    ReadSpecConstants(doc, frag.specs);
     if (doc.has_child(doc.root_id(), "textures"))
     {
         for (const auto& ytex : doc["textures"])
@@ -524,6 +830,86 @@ void ReadFragJson(std::string file, ShaderProcess& process, ShaderDef& shader)
         shader.frag.pushStages = "VK_SHADER_STAGE_FRAGMENT_BIT";
     }
 }
+void ReadCompJson(std::string file, ShaderProcess& process, ShaderDef& shader)
+{
+    ShaderCompDef& comp = shader.comp;
+    std::vector<char> fileBuf;
+
+    FILE* f = 0;
+    auto err = fopen_s(&f, (file + ".json").c_str(), "rb");
+    fseek(f, 0, SEEK_END);
+    size_t fLen = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    fileBuf.resize(fLen);
+    fread(fileBuf.data(), fLen, 1, f);
+    fclose(f);
+
+    auto doc = ryml::parse_in_arena(ryml::to_csubstr(fileBuf));
+    std::unordered_map<std::string, std::string> structMap = ParseStruct(doc, process);
+
+    ReadSpecConstants(doc, comp.specs);
+    if (doc.has_child(doc.root_id(), "entryPoints"))
+    {
+        auto entry = doc["entryPoints"][0];
+        if (entry.has_child("workgroup_size"))
+        {
+            for (int i = 0; i < 3 && i < entry["workgroup_size"].num_children(); ++i)
+            {
+                entry["workgroup_size"][i] >> comp.localSize[i];
+                if (!entry.has_child("workgroup_size_is_spec_constant_id"))
+                    continue;
+                std::string isSpec;
+                entry["workgroup_size_is_spec_constant_id"][i] >> isSpec;
+                if (!ParseBool(isSpec))
+                    continue;
+                //The size is the constant's id, use its default until a variant overrides it
+                comp.localSizeSpec[i] = comp.localSize[i];
+                for (auto& spec : comp.specs)
+                {
+                    if (spec.id == comp.localSizeSpec[i])
+                        comp.localSize[i] = std::stoi(spec.value);
+                }
+            }
+        }
+    }
+    if (doc.has_child(doc.root_id(), "ubos"))
+    {
+        for (const auto& ytex : doc["ubos"])
+        {
+            UniformDef input = {};
+
+            std::string id;
+            ytex["name"] >> input.name;
+            ytex["type"] >> id;
+            input.structName = structMap[id];
+            ytex["binding"] >> input.binding;
+            ytex["set"] >> input.set;
+            comp.ubos.push_back(input);
+        }
+    }
+    ReadStorageBuffers(doc, process, structMap, comp.ubos);
+    if (doc.has_child(doc.root_id(), "textures"))
+    {
+        for (const auto& ytex : doc["textures"])
+        {
+            TextureDef input = {};
+
+            ytex["name"] >> input.name;
+            ytex["binding"] >> input.binding;
+            ytex["set"] >> input.set;
+            comp.texs.push_back(input);
+        }
+    }
+    if (doc.has_child(doc.root_id(), "images"))
+        printf("%s uses storage images, only sampled textures and buffers are bound\n", comp.name.c_str());
+    if (doc.has_child(doc.root_id(), "push_constants"))
+    {
+        std::string id;
+        doc["push_constants"][0]["type"] >> id;
+        comp.push = structMap[id];
+        comp.pushStages = "VK_SHADER_STAGE_COMPUTE_BIT";
+    }
+}
 
 template<class T>
 std::vector<StagesDef<T>> BuildStages(std::vector<T>& vertex, std::vector<T>& frags)
@@ -558,6 +944,67 @@ std::vector<StagesDef<T>> BuildStages(std::vector<T>& vertex, std::vector<T>& fr
     }
     return ret;
 }
+//Descriptors of either the vertex/fragment pair or the compute stage
+std::vector<StagesDef<TextureDef>> GetTextureStages(ShaderDef& shader)
+{
+    if (shader.comp.name.empty())
+        return BuildStages(shader.vert.texs, shader.frag.texs);
+    std::vector<StagesDef<TextureDef>> ret;
+    for (auto& def : shader.comp.texs)
+        ret.push_back({ def, "VK_SHADER_STAGE_COMPUTE_BIT" });
+    return ret;
+}
+std::vector<StagesDef<UniformDef>> GetBufferStages(ShaderDef& shader)
+{
+    if (shader.comp.name.empty())
+        return BuildStages(shader.vert.ubos, shader.frag.ubos);
+    std::vector<StagesDef<UniformDef>> ret;
+    for (auto& def : shader.comp.ubos)
+        ret.push_back({ def, "VK_SHADER_STAGE_COMPUTE_BIT" });
+    return ret;
+}
+//Dynamic offsets are consumed in binding order
+std::vector<UniformDef> GetDynamicUniforms(ShaderProcess& process, ShaderDef& shader)
+{
+    std::vector<UniformDef> ubos;
+    if (!process.dynamicUniforms)
+        return ubos;
+    for (auto& def : GetBufferStages(shader))
+    {
+        if (!def.def.storage)
+            ubos.push_back(def.def);
+    }
+    std::stable_sort(ubos.begin(), ubos.end(), [](const UniformDef& a, const UniformDef& b) { return a.binding < b.binding; });
+    return ubos;
+}
+//Element of the sets the descriptor functions take and return
+std::string GetDescriptorSetType(ShaderProcess& process)
+{
+    return process.descriptorBuffer ? "VKDescriptorSet" : "VkDescriptorSet";
+}
+//Pipelines have to be created for descriptor buffers, info is the create info variable
+std::string GetDescriptorBufferFlagSource(ShaderProcess& process, const std::string& info)
+{
+    if (!process.descriptorBuffer)
+        return "";
+    return "    if (target->descriptorBuffer)\n        " + info + ".flags |= VK_PIPELINE_CREATE_DESCRIPTOR_BUFFER_BIT_EXT;\n";
+}
+//Points set 0 at the draw's descriptors, in the frame's descriptor buffer or as a set
+std::string GetDescriptorBufferBindSource(const std::string& bindPoint, const std::string& pipeline)
+{
+    std::string out = "    if (pipeline.target->descriptorBuffer)\n    {\n";
+    out += "        uint32_t bufferIndex = 0;\n";
+    out += "        vkCmdSetDescriptorBufferOffsetsEXT(command, " + bindPoint + ", " + pipeline + ".pipelineLayout, 0, 1, &bufferIndex, &sets[0].offset);\n";
+    out += "    }\n    else\n";
+    out += "        vkCmdBindDescriptorSets(command, " + bindPoint + ", " + pipeline + ".pipelineLayout, 0, 1, &sets[0].set, 0, nullptr);\n";
+    return out;
+}
+std::string GetUniformDescriptorType(ShaderProcess& process, const UniformDef& def)
+{
+    if (def.storage)
+        return "VK_DESCRIPTOR_TYPE_STORAGE_BUFFER";
+    return process.dynamicUniforms ? "VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC" : "VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER";
+}
 
 #include "VkShader2HeaderConst.h"
 std::string GetShaderArray(const std::string& super, std::string name)
@@ -572,55 +1019,327 @@ std::string GetShaderArray(const std::string& super, std::string name)
     }
     return super + "_" + name;
 }
+std::string GetPushType(ShaderDef& shader)
+{
+    if (!shader.comp.push.empty())
+        return shader.comp.push;
+    if (!shader.vert.push.empty())
+    {
+        if (!shader.frag.push.empty() && shader.frag.push.compare(shader.vert.push))
+            return shader.vert.push + "_" + shader.frag.push;
+        return shader.vert.push;
+    }
+    return shader.frag.push;
+}
+std::string GetPushParam(ShaderDef& shader)
+{
+    std::string type = GetPushType(shader);
+    return type.empty() ? "" : ", " + type + "* push";
+}
+std::string GetPushStages(ShaderDef& shader)
+{
+    if (!shader.comp.push.empty())
+        return shader.comp.pushStages;
+    if (shader.vert.push.empty())
+        return shader.frag.pushStages;
+    if (shader.frag.push.empty())
+        return shader.vert.pushStages;
+    return shader.vert.pushStages + "|" + shader.frag.pushStages;
+}
+int GetPushSize(ShaderProcess& process, ShaderDef& shader)
+{
+    int size = 0;
+    if (!shader.vert.push.empty())
+        size += process.structs[shader.vert.push].totalStride;
+    if (!shader.frag.push.empty() && shader.frag.push.compare(shader.vert.push))
+        size += process.structs[shader.frag.push].totalStride;
+    return size;
+}
+//Name of the SPIR-V array a stage is created from, promoted push blocks use a rewritten copy of the module
+std::string GetModuleArray(ShaderProcess& process, ShaderDef& shader, bool frag)
+{
+    std::string array = GetShaderArray(process.name, frag ? shader.frag.name : shader.vert.name);
+    if (shader.pushUniform && !(frag ? shader.frag.push : shader.vert.push).empty())
+        array += "_push" + std::to_string(shader.pushSet);
+    return array;
+}
+bool IsDepthOnlyDefaults(ShaderDef& shader, int binding)
+{
+    return shader.depthOnly && binding == 1;
+}
+//Combinations of a "variants" matrix share one set of functions and structs, named after their group
+std::string GetGroupName(ShaderProcess& process, ShaderDef& shader)
+{
+    return shader.variantGroup == -1 ? shader.name : process.variantGroups[shader.variantGroup].name;
+}
+//Only the group's first combination emits what the group shares
+bool EmitsGroupFunctions(ShaderDef& shader)
+{
+    return shader.variantGroup == -1 || shader.variantIndex == 0;
+}
+//Functions that pick the combination by a variant index, the plain entry for shaders outside a group
+std::string GetVariantStem(ShaderProcess& process, ShaderDef& shader)
+{
+    return GetGroupName(process, shader) + (shader.variantGroup == -1 ? "" : "Variant");
+}
+std::string GetVariantParam(ShaderDef& shader)
+{
+    return shader.variantGroup == -1 ? "" : ", uint32_t variant";
+}
 std::string GetDrawFunctionName(ShaderProcess& process, ShaderDef& shader, std::vector<std::pair<int, int>>& bindingDescSets, bool drawIndexed, bool instanced)
 {
     bool descSets = shader.frag.texs.size() + shader.frag.ubos.size() + shader.vert.texs.size() + shader.vert.ubos.size() > 0;
-    std::string out = "void " + process.name + "_Draw" + shader.name + (drawIndexed ? "" : "_NI") + "(" + process.name + R"(_Pipeline_Collection& pipeline, VkCommandBuffer command)";
+    std::string out = "void " + process.name + "_Draw" + GetVariantStem(process, shader) + (drawIndexed ? "" : "_NI") + "(" + process.name +
+        "_Pipeline_Collection& pipeline, VkCommandBuffer command" + GetVariantParam(shader);
     if (descSets)
-        out += ", std::vector<VkDescriptorSet>& sets";
+        out += ", std::vector<" + GetDescriptorSetType(process) + ">& sets";
+    for (auto& ubo : GetDynamicUniforms(process, shader))
+        out += ", uint32_t uboOffset_" + ubo.name;
     if (drawIndexed)
-        out += ", VkBuffer indexBuffer, uint32_t indexCount, uint32_t indexOffset, VkIndexType indexType";
+        out += ", VkBuffer indexBuffer, uint32_t indexCount, uint32_t indexOffset, " + std::string(process.sharedBuffers ? "int32_t vertexOffset, " : "") + "VkIndexType indexType";
     else
         out += ", uint32_t vertexCount";
     if (instanced)
         out += ", uint32_t instanceCount";
     for (auto& inp : bindingDescSets)
     {
+        if (IsDepthOnlyDefaults(shader, inp.first))
+            continue;
         out += ", VkBuffer " + shader.vert.inputs[inp.second].name + ", VkDeviceSize offset_" + shader.vert.inputs[inp.second].name;
     }
-    if (!shader.vert.push.empty())
-    {
-        if (!shader.frag.push.empty() && shader.frag.push.compare(shader.vert.push))
-        {
-            out += ", " + shader.vert.push + "_" + shader.frag.push + "* push";
-        }
-        else
-        {
-            out += ", " + shader.vert.push + "* push";
-        }
-    }
-    else if (!shader.frag.push.empty())
-    {
-        out += ", " + shader.frag.push + "* push";
-    }
+    out += GetPushParam(shader);
     out += std::string(")");
     return out;
 }
 std::string GetDescSetFunctionName(ShaderProcess& process, ShaderDef& shader,
     std::vector<StagesDef<UniformDef>>& ubos, std::vector<StagesDef<TextureDef>>& texs)
 {
-    std::string out = "void " + process.name + "_Update" + shader.name + "DescriptorSets(VkRenderTarget * target, "+process.name+"_Pipeline_Collection& pipeline, std::vector<VkDescriptorSet>& output";
+    std::string out = "void " + process.name + "_Update" + GetGroupName(process, shader) + "DescriptorSets(VkRenderTarget * target, "+process.name+"_Pipeline_Collection& pipeline, std::vector<" + GetDescriptorSetType(process) + ">& output";
     for (auto& def : texs)
     {
         out += ", VK::Texture* texture_" + def.def.name;
     }
     for (auto& def : ubos)
     {
-        out += ", VK::Buffer ubo_" + def.def.name;
+        if (def.def.storage)
+            out += ", VK::Buffer ssbo_" + def.def.name;
+        else if (!process.dynamicUniforms)
+            out += ", VK::Buffer ubo_" + def.def.name;
     }
     out += ")";
     return out;
 }
+std::vector<BindingDef*> GetInputsByLocation(ShaderDef& shader)
+{
+    std::vector<BindingDef*> inputs;
+    for (auto& input : shader.vert.inputs)
+        inputs.push_back(&input);
+    std::sort(inputs.begin(), inputs.end(), [](BindingDef* a, BindingDef* b) { return a->loc < b->loc; });
+    return inputs;
+}
+bool HasVertexStruct(ShaderProcess& process, ShaderDef& shader)
+{
+    if (!shader.vert.generatedLayout)
+        return false;
+    if (process.vertexStructs || !shader.vert.split.empty())
+        return true;
+    for (auto& input : shader.vert.inputs)
+    {
+        if (!input.packed.empty())
+            return true;
+    }
+    return false;
+}
+int GetVertexStreamCount(ShaderDef& shader)
+{
+    return shader.vert.split.empty() ? 1 : 2;
+}
+std::string GetInputCType(const BindingDef& input, int& count)
+{
+    if (!input.packed.empty())
+    {
+        count = input.packedLanes;
+        if (input.packed == "snorm16")
+            return "int16_t";
+        if (input.packed == "snorm8")
+            return "int8_t";
+        return input.packed == "unorm8" ? "uint8_t" : "uint16_t";
+    }
+    count = BindingToStrideI(input.type) / 4;
+    if (input.type >= Binding::INT && input.type <= Binding::IVEC4)
+        return "int32_t";
+    if (input.type >= Binding::UINT && input.type <= Binding::UVEC4)
+        return "uint32_t";
+    return "float";
+}
+std::string GetVertexStructName(ShaderProcess& process, ShaderDef& shader, int stream)
+{
+    if (GetVertexStreamCount(shader) == 1)
+        return process.name + "_" + GetGroupName(process, shader) + "_Vertex";
+    return process.name + "_" + GetGroupName(process, shader) + "_Stream" + std::to_string(stream);
+}
+//One struct per vertex buffer binding, the static_asserts hold it to the offsets and stride the pipeline was built with
+std::string GetVertexStructs(ShaderProcess& process, ShaderDef& shader)
+{
+    std::string out;
+    for (int stream = 0; stream < GetVertexStreamCount(shader); ++stream)
+    {
+        std::string name = GetVertexStructName(process, shader, stream);
+        std::string asserts;
+        int stride = 0;
+        out += "struct " + name + " {\n";
+        for (BindingDef* input : GetInputsByLocation(shader))
+        {
+            if (input->binding != stream)
+                continue;
+            int count;
+            std::string type = GetInputCType(*input, count);
+            out += "    " + type + " " + input->name + "[" + std::to_string(count) + "];\n";
+            int size = input->packed.empty() ? count * 4 : count * PackedLaneBytes(*input);
+            if (InputSize(*input) > size)
+                out += "    uint8_t " + input->name + "_pad[" + std::to_string(InputSize(*input) - size) + "];\n";
+            asserts += "static_assert(offsetof(" + name + ", " + input->name + ") == " + std::to_string(input->byteOffset) +
+                ", \"" + name + "::" + input->name + " does not match its vertex attribute offset\");\n";
+            stride += InputSize(*input);
+        }
+        out += "};\n";
+        out += asserts;
+        out += "static_assert(sizeof(" + name + ") == " + std::to_string(stride) + ", \"" + name + " does not match its vertex binding stride\");\n";
+    }
+    return out;
+}
+std::string GetPackVerticesName(ShaderProcess& process, ShaderDef& shader)
+{
+    std::string out = "void " + process.name + "_Pack" + GetGroupName(process, shader) + "Vertices(";
+    if (GetVertexStreamCount(shader) == 1)
+        out += GetVertexStructName(process, shader, 0) + "* output";
+    else
+    {
+        for (int stream = 0; stream < GetVertexStreamCount(shader); ++stream)
+            out += std::string(stream ? ", " : "") + GetVertexStructName(process, shader, stream) + "* output" + std::to_string(stream);
+    }
+    out += ", uint32_t count";
+    for (BindingDef* input : GetInputsByLocation(shader))
+    {
+        if (input->batched)
+            continue;
+        int count;
+        std::string type = input->packed.empty() ? GetInputCType(*input, count) : "float";
+        out += ", const " + type + "* " + input->name;
+    }
+    return out + ")";
+}
+std::string GetPackVerticesSource(ShaderProcess& process, ShaderDef& shader)
+{
+    std::string out = GetPackVerticesName(process, shader) + " {\n";
+    for (BindingDef* input : GetInputsByLocation(shader))
+    {
+        if (input->batched)
+            continue;
+        std::string output = GetVertexStreamCount(shader) == 1 ? "output" : "output" + std::to_string(input->binding);
+        if (input->packed.empty())
+        {
+            int count;
+            GetInputCType(*input, count);
+            out += "    for (uint32_t i = 0; i < count; ++i)\n";
+            out += "        memcpy(" + output + "[i]." + input->name + ", " + input->name + " + i * " + std::to_string(count) + ", sizeof(" + output + "[i]." + input->name + "));\n";
+            continue;
+        }
+        std::string kernel = input->packed == "half" ? "Half" : input->packed == "snorm16" ? "Snorm16" :
+            input->packed == "unorm16" ? "Unorm16" : input->packed == "snorm8" ? "Snorm8" : "Unorm8";
+        out += "    VkVertexPacking::Pack" + kernel + "(" + input->name + ", " + std::to_string(BindingToStrideI(input->type) / 4) +
+            ", " + output + "->" + input->name + ", sizeof(*" + output + "), " + std::to_string(input->packedLanes) + ", count);\n";
+    }
+    out += "}\n";
+    return out;
+}
+bool HasDescriptorSets(ShaderDef& shader)
+{
+    return shader.frag.texs.size() + shader.frag.ubos.size() + shader.vert.texs.size() + shader.vert.ubos.size() > 0;
+}
+std::string GetBatchFunctionNames(ShaderProcess& process, ShaderDef& shader, bool flush)
+{
+    std::string batch = process.name + "_" + GetGroupName(process, shader) + "_Batch";
+    if (!flush)
+        return "void " + process.name + "_Batch" + GetGroupName(process, shader) + "(" + batch + "& batch" +
+            (HasDescriptorSets(shader) ? ", " + GetDescriptorSetType(process) + " set" : "") + ", const " + shader.batch + "& instance)";
+    std::string out = "void " + process.name + "_Flush" + GetVariantStem(process, shader) + "(VkRenderTarget* target, " + process.name +
+        "_Pipeline_Collection& pipeline, VkCommandBuffer command" + GetVariantParam(shader) + ", " + batch + "& batch";
+    for (auto& ubo : GetDynamicUniforms(process, shader))
+        out += ", uint32_t uboOffset_" + ubo.name;
+    out += ", uint32_t vertexCount";
+    for (auto& input : shader.vert.inputs)
+    {
+        if (input.batched)
+            continue;
+        bool first = true;
+        for (auto& other : shader.vert.inputs)
+        {
+            if (other.binding == input.binding && &other != &input)
+            {
+                first = &input < &other;
+                break;
+            }
+        }
+        if (first)
+            out += ", VkBuffer " + input.name + ", VkDeviceSize offset_" + input.name;
+    }
+    return out + GetPushParam(shader) + ")";
+}
+std::string GetBatchStruct(ShaderProcess& process, ShaderDef& shader)
+{
+    std::string out = "struct " + process.name + "_" + GetGroupName(process, shader) + "_Batch {\n";
+    out += "    struct Run { " + GetDescriptorSetType(process) + " set; uint32_t first, count; };\n";
+    out += "    std::vector<" + shader.batch + "> instances;\n";
+    out += "    std::vector<Run> runs;\n";
+    out += "    uint32_t drawCalls = 0; //Instanced draws recorded by the last flush\n";
+    out += "};\n";
+    out += GetBatchFunctionNames(process, shader, false) + ";\n";
+    out += GetBatchFunctionNames(process, shader, true) + ";\n";
+    return out;
+}
+std::vector<std::pair<int,int>> GetVertBindings(ShaderDef& shader);
+std::string GetBatchSource(ShaderProcess& process, ShaderDef& shader)
+{
+    bool descSets = HasDescriptorSets(shader);
+    std::string out = GetBatchFunctionNames(process, shader, false) + " {\n";
+    out += "    if (batch.runs.empty()" + std::string(descSets ? " || batch.runs.back().set != set" : "") + ")\n";
+    out += "        batch.runs.push_back({ " + std::string(descSets ? "set" : process.descriptorBuffer ? "{}" : "VK_NULL_HANDLE") + ", (uint32_t)batch.instances.size(), 0 });\n";
+    out += "    batch.runs.back().count++;\n";
+    out += "    batch.instances.push_back(instance);\n";
+    out += "}\n";
+
+    out += GetBatchFunctionNames(process, shader, true) + " {\n";
+    out += "    batch.drawCalls = (uint32_t)batch.runs.size();\n";
+    out += "    if (batch.instances.empty())\n        return;\n";
+    out += "    //The instance records live for one frame in host visible memory the vertex stage reads directly\n";
+    out += "    VK::Buffer instances = target->vmaPools_.stream.alloc(batch.instances.data(), batch.instances.size() * sizeof(" + shader.batch + "));\n";
+    out += "    target->PushSingleFrameBuffer(instances);\n";
+    if (descSets)
+        out += "    std::vector<" + GetDescriptorSetType(process) + "> sets(1);\n";
+    out += "    for (auto& run : batch.runs)\n    {\n";
+    if (descSets)
+        out += "        sets[0] = run.set;\n";
+    out += "        " + process.name + "_Draw" + GetVariantStem(process, shader) + "_NI(pipeline, command" + (shader.variantGroup == -1 ? "" : ", variant") +
+        (descSets ? ", sets" : "");
+    for (auto& ubo : GetDynamicUniforms(process, shader))
+        out += ", uboOffset_" + ubo.name;
+    out += ", vertexCount, run.count";
+    for (auto& inp : GetVertBindings(shader))
+    {
+        BindingDef& input = shader.vert.inputs[inp.second];
+        if (input.batched)
+            out += ", instances.buffer, run.first * sizeof(" + shader.batch + ")";
+        else
+            out += ", " + input.name + ", offset_" + input.name;
+    }
+    out += std::string(GetPushParam(shader).empty() ? "" : ", push") + ");\n";
+    out += "    }\n";
+    out += "    batch.instances.clear();\n";
+    out += "    batch.runs.clear();\n";
+    out += "}\n";
+    return out;
+}
 std::vector<std::pair<int,int>> GetVertBindings(ShaderDef& shader)
 {
     std::vector<std::pair<int, int>> bindingDescIndexes;
@@ -642,132 +1361,124 @@ std::vector<std::pair<int,int>> GetVertBindings(ShaderDef& shader)
     }
     return bindingDescIndexes;
 }
-void OutputShaderImpl(ShaderProcess& process, std::string baseFolder)
+std::string GetPrimitiveRestart(ShaderDef& shader)
 {
-    std::string out = R"(//THIS FILE WAS AUTO-GENERATED BY VKSHADERTOHEADER
-#include ")" + process.name + R"(_shaderdef.h"
-#include "VkRenderTarget.h"
-#include <stdexcept>
-)";
-    for (auto& p : process.includes)
+    return (shader.topo.compare("VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST") == 0 ||
+        (shader.topo.compare("VK_PRIMITIVE_TOPOLOGY_POINT_LIST") == 0))
+        ? "VK_FALSE" : "VK_TRUE";
+}
+//Matrix inputs take one location and attribute per column
+int GetAttributeColumns(const BindingDef& input)
+{
+    return input.type == Binding::MAT2 ? 2 : input.type == Binding::MAT3 ? 3 : input.type == Binding::MAT4 ? 4 : 1;
+}
+int GetAttributeCount(ShaderDef& shader)
+{
+    int count = 0;
+    for (auto& input : shader.vert.inputs)
+        count += GetAttributeColumns(input);
+    return count;
+}
+std::string GetAttributeOffset(const BindingDef& input, int column)
+{
+    if (column == 0)
+        return input.offset;
+    return input.offset + " + " + std::to_string(BindingToStrideI(input.type) / GetAttributeColumns(input) * column);
+}
+std::string GetVertexInputSource(ShaderDef& shader)
+{
+    std::string out = vertex_input_1;
+    std::vector<std::pair<int, int>> bindingDescIndexes = GetVertBindings(shader);
+    out += "    VkVertexInputBindingDescription bindingDescription[" + std::to_string(bindingDescIndexes.size()) + "] = {};\n";
+    for (int i = 0; i < bindingDescIndexes.size(); ++i)
     {
-        out += "#include \"" + p + "\"\n";
+        std::string indexStr = "[" + std::to_string(i) + "]";
+        out += "    {\n";
+        out += "        bindingDescription" + indexStr + ".binding = " + std::to_string(bindingDescIndexes[i].first) + ";\n";
+        out += "        bindingDescription" + indexStr + ".stride = " + shader.vert.inputs[bindingDescIndexes[i].second].stride + ";\n";
+        out += "        bindingDescription" + indexStr + ".inputRate = " + shader.vert.inputs[bindingDescIndexes[i].second].rate + ";\n";
+        out += "    }\n";
     }
-
-    out += createShaderModule;
-
-    for (auto& shader : process.shaders)
+    out += "    VkVertexInputAttributeDescription attributeDescriptions[" + std::to_string(GetAttributeCount(shader)) + "] = {};\n";
+    int attribute = 0;
+    for (int i = 0; i < shader.vert.inputs.size(); ++i)
     {
-        std::string vert = GetShaderArray(process.name, shader.vert.name);
-        std::string frag = GetShaderArray(process.name, shader.frag.name);
-
-        //CREATE SHADER
-        out += "void " + process.name + "_Create" + shader.name + "Pipeline(VkRenderTarget* target, VKPipelineData& pipeline) {\n" +
-            "    VkShaderModule vertShaderModule = createShaderModule(target->device, " + vert + ", sizeof(" + vert + "));" +
-            "    VkShaderModule fragShaderModule = createShaderModule(target->device, " + frag + ", sizeof(" + frag + "));";
-        out += vert_frag_1;
-
-        std::vector<std::pair<int, int>> bindingDescIndexes = GetVertBindings(shader);
-        out += "    VkVertexInputBindingDescription bindingDescription[" + std::to_string(bindingDescIndexes.size()) + "] = {};\n";
-        for (int i = 0; i < bindingDescIndexes.size(); ++i)
-        {
-            std::string indexStr = "[" + std::to_string(i) + "]";
-            out += "    {\n";
-            out += "        bindingDescription" + indexStr + ".binding = " + std::to_string(bindingDescIndexes[i].first) + ";\n";
-            out += "        bindingDescription" + indexStr + ".stride = " + shader.vert.inputs[bindingDescIndexes[i].second].stride + ";\n";
-            out += "        bindingDescription" + indexStr + ".inputRate = " + shader.vert.inputs[bindingDescIndexes[i].second].rate + ";\n";
-            out += "    }\n";
-        }
-        out += "    VkVertexInputAttributeDescription attributeDescriptions[" + std::to_string(shader.vert.inputs.size()) + "] = {};\n";
-        for (int i = 0; i < shader.vert.inputs.size(); ++i)
+        for (int column = 0; column < GetAttributeColumns(shader.vert.inputs[i]); ++column, ++attribute)
         {
-            std::string indexStr = "[" + std::to_string(i) + "]";
+            std::string indexStr = "[" + std::to_string(attribute) + "]";
             out += "    {\n";
             out += "        attributeDescriptions" + indexStr + ".binding = " + std::to_string(shader.vert.inputs[i].binding) + ";\n";
-            out += "        attributeDescriptions" + indexStr + ".location = " + std::to_string(shader.vert.inputs[i].loc) + ";\n";
+            out += "        attributeDescriptions" + indexStr + ".location = " + std::to_string(shader.vert.inputs[i].loc + column) + ";\n";
             out += "        attributeDescriptions" + indexStr + ".format = " + shader.vert.inputs[i].format + ";\n";
-            out += "        attributeDescriptions" + indexStr + ".offset = " + shader.vert.inputs[i].offset + ";\n";
+            out += "        attributeDescriptions" + indexStr + ".offset = " + GetAttributeOffset(shader.vert.inputs[i], column) + ";\n";
             out += "    }\n";
         }
+    }
 
-        out += "    vertexInputInfo.vertexBindingDescriptionCount = " + std::to_string(bindingDescIndexes.size()) + ";\n";
-        out += "    vertexInputInfo.vertexAttributeDescriptionCount = " + std::to_string(shader.vert.inputs.size()) + ";\n";
-        out += R"z(
+    out += "    vertexInputInfo.vertexBindingDescriptionCount = " + std::to_string(bindingDescIndexes.size()) + ";\n";
+    out += "    vertexInputInfo.vertexAttributeDescriptionCount = " + std::to_string(GetAttributeCount(shader)) + ";\n";
+    out += R"z(
     vertexInputInfo.pVertexBindingDescriptions = bindingDescription;
     vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions;
 
     VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
     inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
     inputAssembly.topology = )z" + shader.topo + R"z(;
-    inputAssembly.primitiveRestartEnable = )z" + 
-            ((shader.topo.compare("VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST") == 0 || 
-                (shader.topo.compare("VK_PRIMITIVE_TOPOLOGY_POINT_LIST") == 0))
-                ? "VK_FALSE" : "VK_TRUE") 
-            + ";";
-        //Create Desc Layout
-        std::vector<StagesDef<TextureDef>> texs = BuildStages(shader.vert.texs, shader.frag.texs);
-        std::vector<StagesDef<UniformDef>> ubos = BuildStages(shader.vert.ubos, shader.frag.ubos);
-        std::string dstype = "";
-        for (auto& def : texs)
-            dstype += "T";
-        for (auto& def : ubos)
-            dstype += "U";
-        out += shader_mid1;
-        out += "VkDynamicState dynamicState[" + std::to_string(2 + shader.dynamicStates.size()) + "] = { VK_DYNAMIC_STATE_VIEWPORT , VK_DYNAMIC_STATE_SCISSOR";
-        for (auto& dyn : shader.dynamicStates)
-        {
-            out += ", " + dyn;
-        }
-        out += shader_mid2;
-
-        out += "    rasterizer.frontFace = " + shader.frontFace + ";\n";
-        out += "    rasterizer.cullMode = " + shader.cullMode + ";\n";
-        if (shader.depthBias.enabled)
-        {
-            /*
-    VkBool32                                   depthBiasEnable;
-    float                                      depthBiasConstantFactor;
-    float                                      depthBiasClamp;
-    float                                      depthBiasSlopeFactor;
-            */
-            out += "    rasterizer.depthBiasEnable = VK_TRUE;\n";
-            if (!shader.depthBias.depthBiasClamp.empty()) out += "    rasterizer.depthBiasClamp = " + shader.depthBias.depthBiasClamp + ";\n";
-            if (!shader.depthBias.depthBiasConstantFactor.empty()) out += "    rasterizer.depthBiasConstantFactor = " + shader.depthBias.depthBiasConstantFactor + ";\n";
-            if (!shader.depthBias.depthBiasSlopeFactor.empty()) out += "    rasterizer.depthBiasSlopeFactor = " + shader.depthBias.depthBiasSlopeFactor + ";\n";
-        }
-
-        out += "    VkPipelineColorBlendAttachmentState colorBlendAttachment = {};\n";
-        out += "    colorBlendAttachment.blendEnable = " + shader.blend.blendEnable + ";\n";
-        out += "    colorBlendAttachment.colorWriteMask = " + shader.blend.colorWriteMask + ";\n";
-        out += "    colorBlendAttachment.srcColorBlendFactor = " + shader.blend.srcColorBlendFactor + ";\n";
-        out += "    colorBlendAttachment.dstColorBlendFactor = " + shader.blend.dstColorBlendFactor + ";\n";
-        out += "    colorBlendAttachment.colorBlendOp = " + shader.blend.colorBlendOp + ";\n";
-        out += "    colorBlendAttachment.srcAlphaBlendFactor = " + shader.blend.srcAlphaBlendFactor + ";\n";
-        out += "    colorBlendAttachment.dstAlphaBlendFactor = " + shader.blend.dstAlphaBlendFactor + ";\n";
-        out += "    colorBlendAttachment.alphaBlendOp = " + shader.blend.alphaBlendOp + ";\n";
-
-        out += shader_mid3;
-        if (texs.size() + ubos.size() > 0)
-        {
-            out += R"(
-
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 1;
-    pipelineLayoutInfo.pSetLayouts = &pipeline.descriptorSetLayout;)";
-        }
-        else
+    inputAssembly.primitiveRestartEnable = )z" + GetPrimitiveRestart(shader) + ";";
+    return out;
+}
+std::string GetDynamicStateSource(ShaderDef& shader)
+{
+    std::string out = shader_mid1;
+    out += "VkDynamicState dynamicState[" + std::to_string(2 + shader.dynamicStates.size() + shader.collapsedStates.size()) + "] = { VK_DYNAMIC_STATE_VIEWPORT , VK_DYNAMIC_STATE_SCISSOR";
+    for (auto& dyn : shader.dynamicStates)
+    {
+        out += ", " + dyn;
+    }
+    for (auto& dyn : shader.collapsedStates)
+    {
+        out += ", " + dyn;
+    }
+    out += shader_mid2;
+    return out;
+}
+std::string GetRasterizerSource(ShaderDef& shader)
+{
+    std::string out = shader_rasterizer;
+    out += "    rasterizer.frontFace = " + shader.frontFace + ";\n";
+    out += "    rasterizer.cullMode = " + shader.cullMode + ";\n";
+    if (shader.depthBias.enabled)
+    {
+        out += "    rasterizer.depthBiasEnable = VK_TRUE;\n";
+        if (!shader.depthBias.depthBiasClamp.empty()) out += "    rasterizer.depthBiasClamp = " + shader.depthBias.depthBiasClamp + ";\n";
+        if (!shader.depthBias.depthBiasConstantFactor.empty()) out += "    rasterizer.depthBiasConstantFactor = " + shader.depthBias.depthBiasConstantFactor + ";\n";
+        if (!shader.depthBias.depthBiasSlopeFactor.empty()) out += "    rasterizer.depthBiasSlopeFactor = " + shader.depthBias.depthBiasSlopeFactor + ";\n";
+    }
+    return out;
+}
+std::string GetColorBlendSource(ShaderDef& shader)
+{
+    std::string out;
+    out += "    VkPipelineColorBlendAttachmentState colorBlendAttachment = {};\n";
+    out += "    colorBlendAttachment.blendEnable = " + shader.blend.blendEnable + ";\n";
+    out += "    colorBlendAttachment.colorWriteMask = " + shader.blend.colorWriteMask + ";\n";
+    out += "    colorBlendAttachment.srcColorBlendFactor = " + shader.blend.srcColorBlendFactor + ";\n";
+    out += "    colorBlendAttachment.dstColorBlendFactor = " + shader.blend.dstColorBlendFactor + ";\n";
+    out += "    colorBlendAttachment.colorBlendOp = " + shader.blend.colorBlendOp + ";\n";
+    out += "    colorBlendAttachment.srcAlphaBlendFactor = " + shader.blend.srcAlphaBlendFactor + ";\n";
+    out += "    colorBlendAttachment.dstAlphaBlendFactor = " + shader.blend.dstAlphaBlendFactor + ";\n";
+    out += "    colorBlendAttachment.alphaBlendOp = " + shader.blend.alphaBlendOp + ";\n";
+    out += shader_mid3;
+    return out;
+}
+std::string GetPushRangeSource(ShaderDef& shader)
+{
+    std::string out;
+    if (shader.vert.push.empty() == false && shader.frag.push.empty() == false)
+    {
+        if (shader.vert.push.compare(shader.frag.push) == 0)
         {
             out += R"(
-
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;)";
-        }
-        if (shader.vert.push.empty() == false && shader.frag.push.empty() == false)
-        {
-            if (shader.vert.push.compare(shader.frag.push) == 0)
-            {
-                out += R"(
     VkPushConstantRange pushConstantRange;
     pushConstantRange.stageFlags = )" + shader.vert.pushStages + "|" + shader.frag.pushStages + R"(;
     pushConstantRange.size = sizeof()" + shader.vert.push + R"();
@@ -776,10 +1487,10 @@ void OutputShaderImpl(ShaderProcess& process, std::string baseFolder)
     // Push constant ranges are part of the pipeline layout
     pipelineLayoutInfo.pushConstantRangeCount = 1;
     pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;)";
-            }
-            else
-            {
-                out += R"(
+        }
+        else
+        {
+            out += R"(
     VkPushConstantRange pushConstantRange[2];
     pushConstantRange[0].stageFlags = )" + shader.vert.pushStages + R"(;
     pushConstantRange[0].size = sizeof()" + shader.vert.push + R"();
@@ -792,122 +1503,1702 @@ void OutputShaderImpl(ShaderProcess& process, std::string baseFolder)
     // Push constant ranges are part of the pipeline layout
     pipelineLayoutInfo.pushConstantRangeCount = 2;
     pipelineLayoutInfo.pPushConstantRanges = pushConstantRange;)";
-            }
         }
-        else if (shader.vert.push.empty() == false)
-        {
-            out += R"(
+    }
+    else if (shader.vert.push.empty() == false)
+    {
+        out += R"(
     VkPushConstantRange pushConstantRange;
     pushConstantRange.stageFlags = )" + shader.vert.pushStages + R"(;
     pushConstantRange.size = sizeof()" + shader.vert.push + R"();
     pushConstantRange.offset = 0;
 
-    // Push constant ranges are part of the pipeline layout
-    pipelineLayoutInfo.pushConstantRangeCount = 1;
-    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;)";
+    // Push constant ranges are part of the pipeline layout
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;)";
+    }
+    else if (shader.frag.push.empty() == false || shader.comp.push.empty() == false)
+    {
+        out += R"(
+    VkPushConstantRange pushConstantRange;
+    pushConstantRange.stageFlags = )" + GetPushStages(shader) + R"(;
+    pushConstantRange.size = sizeof()" + GetPushType(shader) + R"();
+    pushConstantRange.offset = 0;
+
+    // Push constant ranges are part of the pipeline layout
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;)";
+    }
+    return out;
+}
+std::string GetPipelineLayoutSource(ShaderDef& shader, std::vector<StagesDef<TextureDef>>& texs, std::vector<StagesDef<UniformDef>>& ubos)
+{
+    std::string out;
+    if (shader.pushUniform)
+    {
+        //The promoted push block has its own set after the shader's descriptor set
+        out += R"(
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;)";
+        if (texs.size() + ubos.size() > 0)
+            out += R"(
+    VkDescriptorSetLayout setLayouts[] = { pipeline.descriptorSetLayout, pipeline.pushUniformLayout };
+    pipelineLayoutInfo.setLayoutCount = 2;
+    pipelineLayoutInfo.pSetLayouts = setLayouts;)";
+        else
+            out += R"(
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &pipeline.pushUniformLayout;)";
+    }
+    else if (texs.size() + ubos.size() > 0)
+    {
+        out += R"(
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &pipeline.descriptorSetLayout;)";
+    }
+    else
+    {
+        out += R"(
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;)";
+    }
+    if (!shader.pushUniform)
+        out += GetPushRangeSource(shader);
+    out += R"(
+    if (vkCreatePipelineLayout(target->device, &pipelineLayoutInfo, nullptr, &pipeline.pipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create pipeline layout!");
+    }
+)";
+    return out;
+}
+std::string GetDepthStencilSource(ShaderDef& shader)
+{
+    std::string out;
+    if (shader.depth.empty() == false)
+    {
+        out += R"(
+    VkPipelineDepthStencilStateCreateInfo depthStencil{};
+    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = VK_TRUE;
+    depthStencil.depthWriteEnable = )" + std::string(shader.depthWrite ? "VK_TRUE" : "VK_FALSE") + R"(;
+    depthStencil.depthBoundsTestEnable = VK_FALSE;
+    depthStencil.minDepthBounds = 0.0f; // Optional
+    depthStencil.maxDepthBounds = 1.0f; // Optional
+    depthStencil.depthCompareOp = )" + shader.depth + R"(;
+)";
+    }
+    else
+    {
+        out += R"(
+    VkPipelineDepthStencilStateCreateInfo depthStencil{};
+    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = VK_FALSE;
+    depthStencil.depthWriteEnable = VK_FALSE;
+    depthStencil.depthBoundsTestEnable = VK_FALSE;
+    depthStencil.minDepthBounds = 0.0f; // Optional
+    depthStencil.maxDepthBounds = 1.0f; // Optional
+    depthStencil.depthCompareOp = VK_COMPARE_OP_NEVER;
+)";
+    }
+    if (shader.stencil.active)
+    {
+        out += "    depthStencil.stencilTestEnable = VK_TRUE;\n";
+        out += "    depthStencil.front.compareMask = " + shader.stencil.compareMask + ";\n";
+        out += "    depthStencil.front.writeMask = " + shader.stencil.writeMask + ";\n";
+        out += "    depthStencil.front.reference = " + shader.stencil.reference + ";\n";
+        out += "    depthStencil.front.compareOp = " + shader.stencil.compareOp + ";\n";
+        out += "    depthStencil.front.failOp = " + shader.stencil.failOp + ";\n";
+        out += "    depthStencil.front.depthFailOp = " + shader.stencil.depthFailOp + ";\n";
+        out += "    depthStencil.front.passOp = " + shader.stencil.passOp + ";\n";
+        out += "    depthStencil.back = depthStencil.front;\n";
+    }
+    return out;
+}
+std::string GetLayoutSignature(ShaderDef& shader)
+{
+    std::vector<StagesDef<TextureDef>> texs = BuildStages(shader.vert.texs, shader.frag.texs);
+    std::vector<StagesDef<UniformDef>> ubos = BuildStages(shader.vert.ubos, shader.frag.ubos);
+    std::string sig = GetPipelineLayoutSource(shader, texs, ubos);
+    for (auto& def : texs)
+        sig += "T" + std::to_string(def.def.binding) + def.stages;
+    for (auto& def : ubos)
+        sig += (def.def.storage ? "S" : "U") + std::to_string(def.def.binding) + def.stages;
+    return sig;
+}
+//Values a variant gives the constants the stage declares, empty when the stage keeps the reflected defaults
+std::string GetSpecKey(ShaderDef& shader, const std::vector<SpecConstantDef>& specs)
+{
+    std::string key;
+    for (auto& value : shader.specValues)
+    {
+        for (auto& spec : specs)
+        {
+            if (spec.name == value.first)
+                key += spec.name + "=" + value.second + ";";
+        }
+    }
+    return key;
+}
+std::string GetSpecConstantType(const std::string& type)
+{
+    if (type == "int")
+        return "int32_t";
+    if (type == "uint")
+        return "uint32_t";
+    if (type == "float")
+        return "float";
+    if (type == "bool")
+        return "VkBool32";
+    if (type == "double")
+        return "double";
+    if (type == "int64")
+        return "int64_t";
+    if (type == "uint64")
+        return "uint64_t";
+    return "";
+}
+bool HasSpecialization(ShaderProcess& process)
+{
+    for (auto* list : { &process.shaders, &process.computes })
+    {
+        for (auto& shader : *list)
+        {
+            if (!shader.specValues.empty())
+                return true;
+        }
+    }
+    return false;
+}
+std::string GetSpecInfoName(ShaderProcess& process, ShaderDef& shader, const std::string& stage)
+{
+    return process.name + "_" + GetGroupName(process, shader) + "_" + stage + "Spec";
+}
+//VkSpecializationInfo with the variant's values for one stage, constants it doesn't set keep their defaults
+std::string GetSpecializationSource(ShaderProcess& process, ShaderDef& shader, const std::vector<SpecConstantDef>& specs, const std::string& stage)
+{
+    if (GetSpecKey(shader, specs).empty())
+        return "";
+    std::string name = GetSpecInfoName(process, shader, stage);
+    std::string fields, values, entries;
+    int count = 0;
+    for (auto& value : shader.specValues)
+    {
+        for (auto& spec : specs)
+        {
+            if (spec.name != value.first)
+                continue;
+            std::string type = GetSpecConstantType(spec.type);
+            fields += "    " + type + " " + spec.name + ";\n";
+            values += std::string(count ? ", " : "") + (type == "VkBool32" ? (ParseBool(value.second) ? "VK_TRUE" : "VK_FALSE") : value.second);
+            entries += "    { " + std::to_string(spec.id) + ", offsetof(" + name + "Data, " + spec.name + "), sizeof(" + type + ") },\n";
+            ++count;
+        }
+    }
+    std::string out = "struct " + name + "Data {\n" + fields + "};\n";
+    out += "static const " + name + "Data " + name + "Values = { " + values + " };\n";
+    out += "static const VkSpecializationMapEntry " + name + "Map[] = {\n" + entries + "};\n";
+    out += "static const VkSpecializationInfo " + name + " = { " + std::to_string(count) + ", " + name + "Map, sizeof(" + name + "Data), &" +
+        name + "Values };\n";
+    return out;
+}
+std::string GetSpecStageSource(ShaderProcess& process, ShaderDef& shader, const std::vector<SpecConstantDef>& specs, const std::string& stage,
+    const std::string& stageInfo)
+{
+    if (GetSpecKey(shader, specs).empty())
+        return "";
+    return "    " + stageInfo + ".pSpecializationInfo = &" + GetSpecInfoName(process, shader, stage) + ";\n";
+}
+std::string GetLibraryPartKey(ShaderDef& shader, LibraryPartType type)
+{
+    //The emitted state source fully describes a part, so identical source means the part can be shared
+    std::string key = GetDynamicStateSource(shader);
+    switch (type)
+    {
+    case LIBRARY_VERTEX_INPUT:
+        key += GetVertexInputSource(shader);
+        break;
+    case LIBRARY_PRE_RASTERIZATION:
+        key += shader.vert.name + GetSpecKey(shader, shader.vert.specs) + GetLayoutSignature(shader) + GetRasterizerSource(shader);
+        break;
+    case LIBRARY_FRAGMENT_SHADER:
+        key += (shader.noFragment ? std::string("-") : shader.frag.name + GetSpecKey(shader, shader.frag.specs)) + GetLayoutSignature(shader) +
+            GetDepthStencilSource(shader);
+        break;
+    case LIBRARY_FRAGMENT_OUTPUT:
+        key += GetColorBlendSource(shader);
+        break;
+    default:
+        break;
+    }
+    return key;
+}
+void BuildPipelineLibraries(ShaderProcess& process)
+{
+    for (int s = 0; s < process.shaders.size(); ++s)
+    {
+        for (int t = 0; t < LIBRARY_PART_COUNT; ++t)
+        {
+            std::string key = GetLibraryPartKey(process.shaders[s], (LibraryPartType)t);
+            int l = 0;
+            for (; l < process.libraries.size(); ++l)
+            {
+                if (process.libraries[l].type == t && process.libraries[l].key == key)
+                    break;
+            }
+            if (l == process.libraries.size())
+            {
+                PipelineLibraryPart part = {};
+                part.type = (LibraryPartType)t;
+                part.key = key;
+                part.shader = s;
+                process.libraries.push_back(part);
+            }
+            process.shaders[s].libraryParts[t] = l;
+        }
+    }
+    printf("%s: %d pipelines built from %d library parts\n", process.name.c_str(), (int)process.shaders.size(), (int)process.libraries.size());
+}
+bool HasDepthOnly(ShaderProcess& process)
+{
+    for (auto& shader : process.shaders)
+    {
+        if (shader.depthOnly)
+            return true;
+    }
+    return false;
+}
+std::string GetRenderingSource(ShaderProcess& process, bool library)
+{
+    //Attachment formats replace the render pass, pipelines built for a render pass ignore them
+    if (!process.dynamicRendering)
+        return library ? library_begin : "";
+    std::string out = pipeline_rendering;
+    if (!library)
+        return out + "    pipelineInfo.pNext = &renderingInfo;\n";
+    out += library_begin;
+    out += "    renderingInfo.pNext = &libraryInfo;\n";
+    out += "    pipelineInfo.pNext = &renderingInfo;\n";
+    return out;
+}
+std::string GetPipelineLibrarySource(ShaderProcess& process, int index)
+{
+    PipelineLibraryPart& part = process.libraries[index];
+    ShaderDef& shader = process.shaders[part.shader];
+    std::string vert = GetModuleArray(process, shader, false);
+    std::string frag = GetModuleArray(process, shader, true);
+
+    std::string out = "void " + process.name + "_CreatePipelineLibrary" + std::to_string(index) + "(VkRenderTarget* target, VKPipelineData& pipeline, VkPipeline& library) {\n";
+    out += "    VkGraphicsPipelineLibraryCreateInfoEXT libraryInfo = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT };\n";
+    out += "    libraryInfo.flags = " + std::string(LibraryPartFlags[part.type]) + ";\n";
+    out += GetDynamicStateSource(shader);
+    //Every part linked together has to agree on descriptor buffers
+    std::string libraryEnd = GetDescriptorBufferFlagSource(process, "pipelineInfo") + library_end;
+    switch (part.type)
+    {
+    case LIBRARY_VERTEX_INPUT:
+        out += GetVertexInputSource(shader);
+        out += library_begin;
+        out += "    pipelineInfo.pVertexInputState = &vertexInputInfo;\n";
+        out += "    pipelineInfo.pInputAssemblyState = &inputAssembly;\n";
+        out += libraryEnd;
+        break;
+    case LIBRARY_PRE_RASTERIZATION:
+        out += "    VkShaderModule vertShaderModule = createShaderModule(target->device, " + vert + ", sizeof(" + vert + "));\n";
+        out += library_vert_stage;
+        out += GetSpecStageSource(process, shader, shader.vert.specs, "Vert", "vertShaderStageInfo");
+        out += GetRasterizerSource(shader);
+        out += GetRenderingSource(process, true);
+        out += "    pipelineInfo.stageCount = 1;\n";
+        out += "    pipelineInfo.pStages = &vertShaderStageInfo;\n";
+        out += "    pipelineInfo.pViewportState = &viewportState;\n";
+        out += "    pipelineInfo.pRasterizationState = &rasterizer;\n";
+        out += "    pipelineInfo.layout = pipeline.pipelineLayout;\n";
+        out += "    pipelineInfo.renderPass = target->renderPass;\n";
+        out += "    pipelineInfo.subpass = 0;\n";
+        out += libraryEnd;
+        out += "    vkDestroyShaderModule(target->device, vertShaderModule, nullptr);\n";
+        break;
+    case LIBRARY_FRAGMENT_SHADER:
+        if (!shader.noFragment)
+        {
+            out += "    VkShaderModule fragShaderModule = createShaderModule(target->device, " + frag + ", sizeof(" + frag + "));\n";
+            out += library_frag_stage;
+            out += GetSpecStageSource(process, shader, shader.frag.specs, "Frag", "fragShaderStageInfo");
+        }
+        out += shader_multisample;
+        out += GetDepthStencilSource(shader);
+        out += GetRenderingSource(process, true);
+        if (!shader.noFragment)
+        {
+            out += "    pipelineInfo.stageCount = 1;\n";
+            out += "    pipelineInfo.pStages = &fragShaderStageInfo;\n";
+        }
+        out += "    pipelineInfo.pMultisampleState = &multisampling;\n";
+        out += "    pipelineInfo.pDepthStencilState = &depthStencil;\n";
+        out += "    pipelineInfo.layout = pipeline.pipelineLayout;\n";
+        out += "    pipelineInfo.renderPass = target->renderPass;\n";
+        out += "    pipelineInfo.subpass = 0;\n";
+        out += libraryEnd;
+        if (!shader.noFragment)
+            out += "    vkDestroyShaderModule(target->device, fragShaderModule, nullptr);\n";
+        break;
+    case LIBRARY_FRAGMENT_OUTPUT:
+        out += shader_multisample;
+        out += GetColorBlendSource(shader);
+        out += GetRenderingSource(process, true);
+        out += "    pipelineInfo.pMultisampleState = &multisampling;\n";
+        out += "    pipelineInfo.pColorBlendState = &colorBlending;\n";
+        out += "    pipelineInfo.renderPass = target->renderPass;\n";
+        out += "    pipelineInfo.subpass = 0;\n";
+        out += libraryEnd;
+        break;
+    default:
+        break;
+    }
+    out += "}\n";
+    return out;
+}
+std::string GetPipelineLinkCall(ShaderProcess& process, ShaderDef& shader, bool optimize, const std::string& output)
+{
+    return process.name + "_Link" + GetVariantStem(process, shader) + "Pipeline(target, col" +
+        (shader.variantGroup == -1 ? "" : ", " + std::to_string(shader.variantIndex)) + (optimize ? ", true, " : ", false, ") + output + ");\n";
+}
+//A variant group links every combination from one function, reading each one's library parts from a table
+std::string GetPipelineLinkSource(ShaderProcess& process, ShaderDef& shader)
+{
+    std::string out;
+    std::string entry = "PIPELINE_" + process.name + "_" + shader.name;
+    if (shader.variantGroup != -1)
+    {
+        VariantGroup& group = process.variantGroups[shader.variantGroup];
+        std::string table = process.name + "_" + group.name + "_VariantLibraries";
+        out += "static const uint32_t " + table + "[" + std::to_string(group.count) + "][" + std::to_string(LIBRARY_PART_COUNT) + "] = {\n";
+        for (int c = 0; c < group.count; ++c)
+        {
+            out += "    { ";
+            for (int t = 0; t < LIBRARY_PART_COUNT; ++t)
+                out += std::to_string(process.shaders[group.first + c].libraryParts[t]) + ", ";
+            out += "},\n";
+        }
+        out += "};\n";
+        entry += " + variant";
+        out += "void " + process.name + "_Link" + GetVariantStem(process, shader) + "Pipeline(VkRenderTarget* target, " + process.name +
+            "_Pipeline_Collection& col, uint32_t variant, bool optimize, VkPipeline& output) {\n";
+        out += "    VkPipeline libraries[" + std::to_string(LIBRARY_PART_COUNT) + "];\n";
+        out += "    for (int t = 0; t < " + std::to_string(LIBRARY_PART_COUNT) + "; ++t)\n";
+        out += "        libraries[t] = col.libraries[" + table + "[variant][t]];\n";
+    }
+    else
+    {
+        out += "void " + process.name + "_Link" + shader.name + "Pipeline(VkRenderTarget* target, " + process.name + "_Pipeline_Collection& col, bool optimize, VkPipeline& output) {\n";
+        out += "    VkPipeline libraries[" + std::to_string(LIBRARY_PART_COUNT) + "] = { ";
+        for (int t = 0; t < LIBRARY_PART_COUNT; ++t)
+            out += "col.libraries[" + std::to_string(shader.libraryParts[t]) + "], ";
+        out += "};\n";
+    }
+    out += R"(
+    VkPipelineLibraryCreateInfoKHR linkInfo = { VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR };
+    linkInfo.libraryCount = )" + std::to_string(LIBRARY_PART_COUNT) + R"(;
+    linkInfo.pLibraries = libraries;
+
+    VkGraphicsPipelineCreateInfo pipelineInfo = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+    pipelineInfo.pNext = &linkInfo;
+    pipelineInfo.flags = optimize ? VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT : 0;
+    pipelineInfo.layout = col.pipelines[)" + entry + R"(].pipelineLayout;
+)" + GetDescriptorBufferFlagSource(process, "pipelineInfo") + R"(
+    if (vkCreateGraphicsPipelines(target->device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &output) != VK_SUCCESS) {
+        throw std::runtime_error("failed to link graphics pipeline!");
+    }
+}
+)";
+    return out;
+}
+bool IsDynamicState(ShaderDef& shader, const char* state)
+{
+    for (auto& dyn : shader.dynamicStates)
+    {
+        if (dyn.compare(state) == 0)
+            return true;
+    }
+    return false;
+}
+std::string GetStateCall(ShaderDef& shader, const char* state, const std::string& call)
+{
+    //State listed under "dynamic" is owned by the caller, same as with pipelines
+    if (IsDynamicState(shader, state))
+        return "";
+    return "        " + call + ";\n";
+}
+std::string GetShaderStateGroupSource(ShaderDef& shader, ShaderStateGroup group)
+{
+    std::string out;
+    switch (group)
+    {
+    case STATE_VERTEX_INPUT:
+    {
+        if (IsDynamicState(shader, "VK_DYNAMIC_STATE_VERTEX_INPUT_EXT"))
+            break;
+        if (shader.vert.inputs.empty())
+        {
+            out += "        vkCmdSetVertexInputEXT(command, 0, nullptr, 0, nullptr);\n";
+            break;
+        }
+        std::vector<std::pair<int, int>> bindingDescIndexes = GetVertBindings(shader);
+        out += "        VkVertexInputBindingDescription2EXT bindingDescription[" + std::to_string(bindingDescIndexes.size()) + "] = {};\n";
+        for (int i = 0; i < bindingDescIndexes.size(); ++i)
+        {
+            std::string indexStr = "[" + std::to_string(i) + "]";
+            out += "        bindingDescription" + indexStr + ".sType = VK_STRUCTURE_TYPE_VERTEX_INPUT_BINDING_DESCRIPTION_2_EXT;\n";
+            out += "        bindingDescription" + indexStr + ".binding = " + std::to_string(bindingDescIndexes[i].first) + ";\n";
+            out += "        bindingDescription" + indexStr + ".stride = " + shader.vert.inputs[bindingDescIndexes[i].second].stride + ";\n";
+            out += "        bindingDescription" + indexStr + ".inputRate = " + shader.vert.inputs[bindingDescIndexes[i].second].rate + ";\n";
+            out += "        bindingDescription" + indexStr + ".divisor = 1;\n";
+        }
+        out += "        VkVertexInputAttributeDescription2EXT attributeDescriptions[" + std::to_string(GetAttributeCount(shader)) + "] = {};\n";
+        int attribute = 0;
+        for (int i = 0; i < shader.vert.inputs.size(); ++i)
+        {
+            for (int column = 0; column < GetAttributeColumns(shader.vert.inputs[i]); ++column, ++attribute)
+            {
+                std::string indexStr = "[" + std::to_string(attribute) + "]";
+                out += "        attributeDescriptions" + indexStr + ".sType = VK_STRUCTURE_TYPE_VERTEX_INPUT_ATTRIBUTE_DESCRIPTION_2_EXT;\n";
+                out += "        attributeDescriptions" + indexStr + ".binding = " + std::to_string(shader.vert.inputs[i].binding) + ";\n";
+                out += "        attributeDescriptions" + indexStr + ".location = " + std::to_string(shader.vert.inputs[i].loc + column) + ";\n";
+                out += "        attributeDescriptions" + indexStr + ".format = " + shader.vert.inputs[i].format + ";\n";
+                out += "        attributeDescriptions" + indexStr + ".offset = " + GetAttributeOffset(shader.vert.inputs[i], column) + ";\n";
+            }
+        }
+        out += "        vkCmdSetVertexInputEXT(command, " + std::to_string(bindingDescIndexes.size()) + ", bindingDescription, " +
+            std::to_string(GetAttributeCount(shader)) + ", attributeDescriptions);\n";
+        break;
+    }
+    case STATE_TOPOLOGY:
+        out += GetStateCall(shader, "VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY", "vkCmdSetPrimitiveTopology(command, " + shader.topo + ")");
+        out += GetStateCall(shader, "VK_DYNAMIC_STATE_PRIMITIVE_RESTART_ENABLE", "vkCmdSetPrimitiveRestartEnable(command, " + GetPrimitiveRestart(shader) + ")");
+        break;
+    case STATE_RASTERIZER:
+        out += GetStateCall(shader, "VK_DYNAMIC_STATE_CULL_MODE", "vkCmdSetCullMode(command, " + shader.cullMode + ")");
+        out += GetStateCall(shader, "VK_DYNAMIC_STATE_FRONT_FACE", "vkCmdSetFrontFace(command, " + shader.frontFace + ")");
+        break;
+    case STATE_DEPTH:
+    {
+        bool depth = shader.depth.empty() == false;
+        out += GetStateCall(shader, "VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE", std::string("vkCmdSetDepthTestEnable(command, ") + (depth ? "VK_TRUE" : "VK_FALSE") + ")");
+        out += GetStateCall(shader, "VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE", std::string("vkCmdSetDepthWriteEnable(command, ") + (depth && shader.depthWrite ? "VK_TRUE" : "VK_FALSE") + ")");
+        out += GetStateCall(shader, "VK_DYNAMIC_STATE_DEPTH_COMPARE_OP", "vkCmdSetDepthCompareOp(command, " + (depth ? shader.depth : std::string("VK_COMPARE_OP_NEVER")) + ")");
+        break;
+    }
+    case STATE_DEPTH_BIAS:
+        out += GetStateCall(shader, "VK_DYNAMIC_STATE_DEPTH_BIAS_ENABLE", std::string("vkCmdSetDepthBiasEnable(command, ") + (shader.depthBias.enabled ? "VK_TRUE" : "VK_FALSE") + ")");
+        if (shader.depthBias.enabled)
+        {
+            auto factor = [](const std::string& f) { return f.empty() ? std::string("0.0f") : f; };
+            out += GetStateCall(shader, "VK_DYNAMIC_STATE_DEPTH_BIAS", "vkCmdSetDepthBias(command, " + factor(shader.depthBias.depthBiasConstantFactor) + ", " +
+                factor(shader.depthBias.depthBiasClamp) + ", " + factor(shader.depthBias.depthBiasSlopeFactor) + ")");
+        }
+        break;
+    case STATE_STENCIL:
+        out += GetStateCall(shader, "VK_DYNAMIC_STATE_STENCIL_TEST_ENABLE", std::string("vkCmdSetStencilTestEnable(command, ") + (shader.stencil.active ? "VK_TRUE" : "VK_FALSE") + ")");
+        if (shader.stencil.active)
+        {
+            out += GetStateCall(shader, "VK_DYNAMIC_STATE_STENCIL_OP", "vkCmdSetStencilOp(command, VK_STENCIL_FACE_FRONT_AND_BACK, " + shader.stencil.failOp + ", " +
+                shader.stencil.passOp + ", " + shader.stencil.depthFailOp + ", " + shader.stencil.compareOp + ")");
+            out += GetStateCall(shader, "VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK", "vkCmdSetStencilCompareMask(command, VK_STENCIL_FACE_FRONT_AND_BACK, " + shader.stencil.compareMask + ")");
+            out += GetStateCall(shader, "VK_DYNAMIC_STATE_STENCIL_WRITE_MASK", "vkCmdSetStencilWriteMask(command, VK_STENCIL_FACE_FRONT_AND_BACK, " + shader.stencil.writeMask + ")");
+            out += GetStateCall(shader, "VK_DYNAMIC_STATE_STENCIL_REFERENCE", "vkCmdSetStencilReference(command, VK_STENCIL_FACE_FRONT_AND_BACK, " + shader.stencil.reference + ")");
+        }
+        break;
+    case STATE_BLEND:
+        if (!IsDynamicState(shader, "VK_DYNAMIC_STATE_COLOR_BLEND_ENABLE_EXT"))
+        {
+            out += "        VkBool32 blendEnable = " + shader.blend.blendEnable + ";\n";
+            out += "        vkCmdSetColorBlendEnableEXT(command, 0, 1, &blendEnable);\n";
+        }
+        if (!IsDynamicState(shader, "VK_DYNAMIC_STATE_COLOR_BLEND_EQUATION_EXT"))
+        {
+            out += "        VkColorBlendEquationEXT blendEquation = { " + shader.blend.srcColorBlendFactor + ", " + shader.blend.dstColorBlendFactor + ", " +
+                shader.blend.colorBlendOp + ", " + shader.blend.srcAlphaBlendFactor + ", " + shader.blend.dstAlphaBlendFactor + ", " + shader.blend.alphaBlendOp + " };\n";
+            out += "        vkCmdSetColorBlendEquationEXT(command, 0, 1, &blendEquation);\n";
+        }
+        if (!IsDynamicState(shader, "VK_DYNAMIC_STATE_COLOR_WRITE_MASK_EXT"))
+        {
+            out += "        VkColorComponentFlags colorWriteMask = " + shader.blend.colorWriteMask + ";\n";
+            out += "        vkCmdSetColorWriteMaskEXT(command, 0, 1, &colorWriteMask);\n";
+        }
+        break;
+    default:
+        break;
+    }
+    return out;
+}
+std::vector<const char*> GetStateGroupDynamicStates(ShaderStateGroup group)
+{
+    switch (group)
+    {
+    case STATE_VERTEX_INPUT:
+        return { "VK_DYNAMIC_STATE_VERTEX_INPUT_EXT" };
+    case STATE_TOPOLOGY:
+        return { "VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY", "VK_DYNAMIC_STATE_PRIMITIVE_RESTART_ENABLE" };
+    case STATE_RASTERIZER:
+        return { "VK_DYNAMIC_STATE_CULL_MODE", "VK_DYNAMIC_STATE_FRONT_FACE" };
+    case STATE_DEPTH:
+        return { "VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE", "VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE", "VK_DYNAMIC_STATE_DEPTH_COMPARE_OP" };
+    case STATE_DEPTH_BIAS:
+        return { "VK_DYNAMIC_STATE_DEPTH_BIAS_ENABLE", "VK_DYNAMIC_STATE_DEPTH_BIAS" };
+    case STATE_STENCIL:
+        return { "VK_DYNAMIC_STATE_STENCIL_TEST_ENABLE", "VK_DYNAMIC_STATE_STENCIL_OP", "VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK",
+            "VK_DYNAMIC_STATE_STENCIL_WRITE_MASK", "VK_DYNAMIC_STATE_STENCIL_REFERENCE" };
+    case STATE_BLEND:
+        return { "VK_DYNAMIC_STATE_COLOR_BLEND_ENABLE_EXT", "VK_DYNAMIC_STATE_COLOR_BLEND_EQUATION_EXT", "VK_DYNAMIC_STATE_COLOR_WRITE_MASK_EXT" };
+    default:
+        return {};
+    }
+}
+bool IsCollapsedGroup(ShaderProcess& process, int group)
+{
+    return group == STATE_VERTEX_INPUT ? process.dynamicVertexInput : process.collapseDynamicState;
+}
+std::string GetCollapseKey(ShaderProcess& process, ShaderDef& shader)
+{
+    //Everything a pipeline bakes that isn't set dynamically, topology only within its class
+    std::string key = shader.vert.name + GetSpecKey(shader, shader.vert.specs) + "|" +
+        (shader.noFragment ? std::string("-") : shader.frag.name + GetSpecKey(shader, shader.frag.specs)) + "|" + GetLayoutSignature(shader);
+    for (int g = 0; g < STATE_GROUP_COUNT; ++g)
+    {
+        if (!IsCollapsedGroup(process, g))
+            key += "|" + GetShaderStateGroupSource(shader, (ShaderStateGroup)g);
+    }
+    if (shader.topo.find("POINT") != std::string::npos)
+        key += "|point";
+    else if (shader.topo.find("LINE") != std::string::npos)
+        key += "|line";
+    else if (shader.topo.find("PATCH") != std::string::npos)
+        key += "|patch";
+    else
+        key += "|tri";
+    for (auto& dyn : shader.dynamicStates)
+        key += "|" + dyn;
+    return key;
+}
+//Moves the PushConstant block of a SPIR-V module to a uniform block at (set, 0). Push blocks are laid out with
+//std430, modules with array or matrix strides or nested offsets a std140 uniform block can't have are left alone
+bool PromotePushConstantSpirv(std::vector<unsigned char>& code, int set)
+{
+    const uint32_t OpTypeArray = 28, OpTypeRuntimeArray = 29, OpTypeStruct = 30, OpTypePointer = 32, OpVariable = 59, OpDecorate = 71, OpMemberDecorate = 72;
+    const uint32_t StorageUniform = 2, StoragePushConstant = 9;
+    const uint32_t DecorationArrayStride = 6, DecorationMatrixStride = 7, DecorationBinding = 33, DecorationDescriptorSet = 34, DecorationOffset = 35;
+    if (code.size() < 20 || code.size() % 4)
+        return false;
+    std::vector<uint32_t> words(code.size() / 4);
+    memcpy(words.data(), code.data(), code.size());
+    if (words[0] != 0x07230203)
+        return false;
+
+    std::vector<uint32_t> variables;
+    std::vector<uint32_t> pushTypes;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> structMembers, memberOffsets;
+    std::unordered_map<uint32_t, uint32_t> arrayElements;
+    size_t annotations = 0;
+    for (size_t i = 5; i < words.size();)
+    {
+        uint32_t count = words[i] >> 16, op = words[i] & 0xFFFF;
+        if (count == 0 || i + count > words.size())
+            return false;
+        if ((op == OpDecorate || op == OpMemberDecorate) && annotations == 0)
+            annotations = i;
+        if (op == OpDecorate && count >= 4 && words[i + 2] == DecorationArrayStride && words[i + 3] % 16)
+            return false;
+        if (op == OpMemberDecorate && count >= 5 && words[i + 3] == DecorationMatrixStride && words[i + 4] % 16)
+            return false;
+        if (op == OpMemberDecorate && count >= 5 && words[i + 3] == DecorationOffset)
+        {
+            std::vector<uint32_t>& offsets = memberOffsets[words[i + 1]];
+            if (offsets.size() <= words[i + 2])
+                offsets.resize(words[i + 2] + 1, 0);
+            offsets[words[i + 2]] = words[i + 4];
+        }
+        if (op == OpTypeStruct && count >= 2)
+            structMembers[words[i + 1]].assign(words.begin() + i + 2, words.begin() + i + count);
+        if ((op == OpTypeArray || op == OpTypeRuntimeArray) && count >= 3)
+            arrayElements[words[i + 1]] = words[i + 2];
+        if (op == OpTypePointer && count >= 4 && words[i + 2] == StoragePushConstant)
+        {
+            words[i + 2] = StorageUniform;
+            pushTypes.push_back(words[i + 3]);
+        }
+        if (op == OpVariable && count >= 4 && words[i + 3] == StoragePushConstant)
+        {
+            words[i + 3] = StorageUniform;
+            variables.push_back(words[i + 2]);
+        }
+        i += count;
+    }
+    if (variables.empty() || annotations == 0)
+        return false;
+    //std140 starts nested structs and arrays on 16 bytes and pads the member after them to 16, std430 does neither
+    std::unordered_map<uint32_t, bool> visited;
+    while (!pushTypes.empty())
+    {
+        uint32_t type = pushTypes.back();
+        pushTypes.pop_back();
+        if (visited[type])
+            continue;
+        visited[type] = true;
+        auto array = arrayElements.find(type);
+        if (array != arrayElements.end())
+        {
+            pushTypes.push_back(array->second);
+            continue;
+        }
+        auto members = structMembers.find(type);
+        if (members == structMembers.end())
+            continue;
+        std::vector<uint32_t>& offsets = memberOffsets[type];
+        for (size_t m = 0; m < members->second.size(); ++m)
+        {
+            uint32_t member = members->second[m];
+            pushTypes.push_back(member);
+            if (!structMembers.count(member) && !arrayElements.count(member))
+                continue;
+            if ((m < offsets.size() && offsets[m] % 16) || (m + 1 < offsets.size() && offsets[m + 1] % 16))
+                return false;
+        }
+    }
+
+    std::vector<uint32_t> decorations;
+    for (uint32_t variable : variables)
+    {
+        uint32_t add[] = {
+            (4 << 16) | OpDecorate, variable, DecorationDescriptorSet, (uint32_t)set,
+            (4 << 16) | OpDecorate, variable, DecorationBinding, 0 };
+        decorations.insert(decorations.end(), add, add + 8);
+    }
+    words.insert(words.begin() + annotations, decorations.begin(), decorations.end());
+    code.resize(words.size() * 4);
+    memcpy(code.data(), words.data(), code.size());
+    return true;
+}
+//Keeps push blocks within the limit as push constants, larger ones are read from a dynamic uniform slice
+//in their own set so the draw functions keep taking the same push pointer
+void PlanPushConstants(ShaderProcess& process, std::string baseFolder)
+{
+    for (auto& shader : process.shaders)
+    {
+        int size = GetPushSize(process, shader);
+        if (size <= process.pushConstantLimit)
+            continue;
+        shader.pushSet = shader.frag.texs.size() + shader.frag.ubos.size() + shader.vert.texs.size() + shader.vert.ubos.size() > 0 ? 1 : 0;
+        shader.pushUniform = true;
+
+        std::unordered_map<std::string, std::vector<unsigned char>> modules;
+        bool promoted = true;
+        for (int stage = 0; stage < 2 && promoted; ++stage)
+        {
+            std::string& name = stage ? shader.frag.name : shader.vert.name;
+            if ((stage ? shader.frag.push : shader.vert.push).empty() || (stage && shader.noFragment))
+                continue;
+            std::string array = GetModuleArray(process, shader, stage == 1);
+            if (process.pushUniformSpirv.count(array))
+                continue;
+            FILE* f = 0;
+            fopen_s(&f, (baseFolder + "/" + name + ".spv").c_str(), "rb");
+            if (!f)
+            {
+                promoted = false;
+                break;
+            }
+            fseek(f, 0, SEEK_END);
+            size_t fLen = ftell(f);
+            fseek(f, 0, SEEK_SET);
+            std::vector<unsigned char> code(fLen);
+            fread(code.data(), fLen, 1, f);
+            fclose(f);
+            promoted = PromotePushConstantSpirv(code, shader.pushSet);
+            modules[array] = code;
+        }
+        if (!promoted)
+        {
+            printf("%s: push constants of %s (%d bytes) are over the %d byte limit but can't be moved to a uniform block\n",
+                process.name.c_str(), shader.name.c_str(), size, process.pushConstantLimit);
+            shader.pushUniform = false;
+            continue;
+        }
+        for (auto& module : modules)
+            process.pushUniformSpirv[module.first] = module.second;
+        printf("%s: push constants of %s (%d bytes) moved to a dynamic uniform in set %d\n", process.name.c_str(), shader.name.c_str(), size, shader.pushSet);
+    }
+}
+bool HasPushUniforms(ShaderProcess& process)
+{
+    for (auto& shader : process.shaders)
+    {
+        if (shader.pushUniform)
+            return true;
+    }
+    return false;
+}
+bool HasDeltaPush(ShaderProcess& process)
+{
+    if (!process.deltaPushConstants)
+        return false;
+    for (auto& shader : process.shaders)
+    {
+        if (!shader.pushUniform && !GetPushType(shader).empty())
+            return true;
+    }
+    return false;
+}
+//Member boundaries of every pushed struct, read by VkPushRecorder to find what changed
+std::string GetPushMembersSource(ShaderProcess& process)
+{
+    std::string out;
+    std::unordered_map<std::string, bool> added;
+    for (auto& shader : process.shaders)
+    {
+        if (shader.pushUniform)
+            continue;
+        for (auto* push : { &shader.vert.push, &shader.frag.push })
+        {
+            auto s = process.structs.find(*push);
+            if (push->empty() || added[*push] || s == process.structs.end())
+                continue;
+            added[*push] = true;
+            out += "static const uint32_t " + *push + "_PushMembers[] = { ";
+            for (auto& part : s->second.parts)
+                out += "offsetof(" + *push + ", " + part.name + "), ";
+            out += "sizeof(" + *push + ") };\n";
+        }
+    }
+    if (!out.empty())
+        out += "\n";
+    return out;
+}
+std::string GetPushCallSource(ShaderProcess& process, const std::string& pipeline, const std::string& stages, const std::string& offset,
+    const std::string& type, const std::string& data)
+{
+    auto s = process.structs.find(type);
+    if (process.deltaPushConstants && s != process.structs.end())
+    {
+        return "    pipeline.pushRecorder->Push(command, " + pipeline + ".pipelineLayout, " + stages + ", " + offset + ", " + data + ", " +
+            type + "_PushMembers, " + std::to_string(s->second.parts.size()) + ");\n";
+    }
+    return R"(    vkCmdPushConstants(
+        command,
+        )" + pipeline + R"(.pipelineLayout,
+        )" + stages + R"(,
+        )" + offset + R"(,
+        sizeof()" + type + ")" + R"(,
+        )" + data + R"();
+)";
+}
+void CollapsePipelines(ShaderProcess& process)
+{
+    int collapsed = 0;
+    for (int s = 0; s < process.shaders.size(); ++s)
+    {
+        if (process.shaders[s].pipelineOwner != -1)
+            continue;
+        std::string key = GetCollapseKey(process, process.shaders[s]);
+        std::vector<int> group = { s };
+        for (int t = s + 1; t < process.shaders.size(); ++t)
+        {
+            if (process.shaders[t].pipelineOwner == -1 && GetCollapseKey(process, process.shaders[t]) == key)
+                group.push_back(t);
+        }
+        //Dynamic vertex input is set by every draw, other state only where the group differs
+        bool differs[STATE_GROUP_COUNT] = {};
+        differs[STATE_VERTEX_INPUT] = process.dynamicVertexInput;
+        if (group.size() < 2 && !process.dynamicVertexInput)
+            continue;
+        for (int g = STATE_TOPOLOGY; g < STATE_GROUP_COUNT && process.collapseDynamicState; ++g)
+        {
+            std::string source = GetShaderStateGroupSource(process.shaders[s], (ShaderStateGroup)g);
+            for (int m : group)
+            {
+                if (GetShaderStateGroupSource(process.shaders[m], (ShaderStateGroup)g) != source)
+                    differs[g] = true;
+            }
+        }
+        for (int m : group)
+        {
+            ShaderDef& shader = process.shaders[m];
+            for (int g = 0; g < STATE_GROUP_COUNT; ++g)
+            {
+                if (!differs[g])
+                    continue;
+                shader.statePreamble += GetShaderStateGroupSource(shader, (ShaderStateGroup)g);
+                for (auto dyn : GetStateGroupDynamicStates((ShaderStateGroup)g))
+                {
+                    if (!IsDynamicState(shader, dyn))
+                        shader.collapsedStates.push_back(dyn);
+                }
+            }
+            shader.pipelineOwner = s;
+        }
+        collapsed += (int)group.size() - 1;
+    }
+    printf("%s: %d of %d pipelines collapsed into shared dynamic state pipelines\n", process.name.c_str(), collapsed, (int)process.shaders.size());
+}
+std::string GetShaderObjectKey(ShaderDef& shader, bool frag)
+{
+    return (frag ? "F" + shader.frag.name + GetSpecKey(shader, shader.frag.specs) : "V" + shader.vert.name + GetSpecKey(shader, shader.vert.specs)) +
+        GetLayoutSignature(shader);
+}
+void BuildShaderObjects(ShaderProcess& process)
+{
+    for (int s = 0; s < process.shaders.size(); ++s)
+    {
+        ShaderDef& shader = process.shaders[s];
+        for (int stage = 0; stage < 2; ++stage)
+        {
+            if (stage == 1 && shader.noFragment)
+            {
+                shader.shaderObjects[stage] = -1;
+                continue;
+            }
+            std::string key = GetShaderObjectKey(shader, stage == 1);
+            int o = 0;
+            for (; o < process.shaderObjects.size(); ++o)
+            {
+                if (process.shaderObjects[o].key == key)
+                    break;
+            }
+            if (o == process.shaderObjects.size())
+            {
+                ShaderObjectPart part = {};
+                part.frag = stage == 1;
+                part.key = key;
+                part.shader = s;
+                process.shaderObjects.push_back(part);
+            }
+            shader.shaderObjects[stage] = o;
+        }
+        //The emitted calls identify a state group, draws only re-emit a group when its id changes
+        for (int g = 0; g < STATE_GROUP_COUNT; ++g)
+        {
+            std::string source = GetShaderStateGroupSource(shader, (ShaderStateGroup)g);
+            std::vector<std::string>& groups = process.stateGroups[g];
+            int id = 0;
+            for (; id < groups.size(); ++id)
+            {
+                if (groups[id] == source)
+                    break;
+            }
+            if (id == groups.size())
+                groups.push_back(source);
+            shader.stateGroups[g] = id;
+        }
+    }
+    printf("%s: %d pipelines replaced by %d shader objects\n", process.name.c_str(), (int)process.shaders.size(), (int)process.shaderObjects.size());
+}
+std::string GetShaderObjectSource(ShaderProcess& process, int index)
+{
+    ShaderObjectPart& part = process.shaderObjects[index];
+    ShaderDef& shader = process.shaders[part.shader];
+    std::string code = GetModuleArray(process, shader, part.frag);
+    bool descSets = shader.frag.texs.size() + shader.frag.ubos.size() + shader.vert.texs.size() + shader.vert.ubos.size() > 0;
+
+    std::string out = "void " + process.name + "_CreateShaderObject" + std::to_string(index) + "(VkRenderTarget* target, VKPipelineData& pipeline, VkShaderEXT& shader) {\n";
+    out += "    VkShaderCreateInfoEXT shaderInfo = { VK_STRUCTURE_TYPE_SHADER_CREATE_INFO_EXT };\n";
+    out += std::string("    shaderInfo.stage = ") + (part.frag ? "VK_SHADER_STAGE_FRAGMENT_BIT" : "VK_SHADER_STAGE_VERTEX_BIT") + ";\n";
+    out += std::string("    shaderInfo.nextStage = ") + (part.frag ? "0" : "VK_SHADER_STAGE_FRAGMENT_BIT") + ";\n";
+    out += "    shaderInfo.codeType = VK_SHADER_CODE_TYPE_SPIRV_EXT;\n";
+    out += "    shaderInfo.codeSize = sizeof(" + code + ");\n";
+    out += "    shaderInfo.pCode = " + code + ";\n";
+    out += "    shaderInfo.pName = \"main\";\n";
+    out += part.frag ? GetSpecStageSource(process, shader, shader.frag.specs, "Frag", "shaderInfo") :
+        GetSpecStageSource(process, shader, shader.vert.specs, "Vert", "shaderInfo");
+    if (shader.pushUniform && descSets)
+    {
+        out += "    VkDescriptorSetLayout setLayouts[] = { pipeline.descriptorSetLayout, pipeline.pushUniformLayout };\n";
+        out += "    shaderInfo.setLayoutCount = 2;\n";
+        out += "    shaderInfo.pSetLayouts = setLayouts;\n";
+    }
+    else if (shader.pushUniform)
+    {
+        out += "    shaderInfo.setLayoutCount = 1;\n";
+        out += "    shaderInfo.pSetLayouts = &pipeline.pushUniformLayout;\n";
+    }
+    else if (descSets)
+    {
+        out += "    shaderInfo.setLayoutCount = 1;\n";
+        out += "    shaderInfo.pSetLayouts = &pipeline.descriptorSetLayout;\n";
+    }
+    //Push constant ranges have to match the pipeline layout used to push and bind
+    bool pushRanges = !shader.pushUniform;
+    if (pushRanges && !shader.vert.push.empty() && !shader.frag.push.empty() && shader.vert.push.compare(shader.frag.push) != 0)
+    {
+        out += "    VkPushConstantRange pushConstantRange[2] = {};\n";
+        out += "    pushConstantRange[0].stageFlags = " + shader.vert.pushStages + ";\n";
+        out += "    pushConstantRange[0].size = sizeof(" + shader.vert.push + ");\n";
+        out += "    pushConstantRange[1].stageFlags = " + shader.frag.pushStages + ";\n";
+        out += "    pushConstantRange[1].size = sizeof(" + shader.frag.push + ");\n";
+        out += "    pushConstantRange[1].offset = sizeof(" + shader.vert.push + ");\n";
+        out += "    shaderInfo.pushConstantRangeCount = 2;\n";
+        out += "    shaderInfo.pPushConstantRanges = pushConstantRange;\n";
+    }
+    else if (pushRanges && (!shader.vert.push.empty() || !shader.frag.push.empty()))
+    {
+        std::string stages = shader.vert.push.empty() ? shader.frag.pushStages :
+            shader.frag.push.empty() ? shader.vert.pushStages : shader.vert.pushStages + "|" + shader.frag.pushStages;
+        out += "    VkPushConstantRange pushConstantRange = {};\n";
+        out += "    pushConstantRange.stageFlags = " + stages + ";\n";
+        out += "    pushConstantRange.size = sizeof(" + (shader.vert.push.empty() ? shader.frag.push : shader.vert.push) + ");\n";
+        out += "    shaderInfo.pushConstantRangeCount = 1;\n";
+        out += "    shaderInfo.pPushConstantRanges = &pushConstantRange;\n";
+    }
+    out += R"(
+    if (vkCreateShadersEXT(target->device, 1, &shaderInfo, nullptr, &shader) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create shader object!");
+    }
+}
+)";
+    return out;
+}
+//Emitted lines moved one level deeper, for sources placed in a switch case
+std::string IndentSource(const std::string& source, const std::string& indent)
+{
+    std::string out;
+    size_t start = 0;
+    while (start < source.size())
+    {
+        size_t end = source.find('\n', start);
+        end = end == std::string::npos ? source.size() : end + 1;
+        out += indent + source.substr(start, end - start);
+        start = end;
+    }
+    return out;
+}
+//Combinations of a variant group share their shader objects, state groups that differ between them are picked by variant
+std::string GetShaderObjectBindSource(ShaderProcess& process, ShaderDef& shader)
+{
+    std::vector<ShaderDef*> combinations = { &shader };
+    std::string out, table;
+    if (shader.variantGroup != -1)
+    {
+        VariantGroup& group = process.variantGroups[shader.variantGroup];
+        table = process.name + "_" + group.name + "_VariantStateGroups";
+        out += "static const int " + table + "[" + std::to_string(group.count) + "][" + std::to_string(STATE_GROUP_COUNT) + "] = {\n";
+        combinations.clear();
+        for (int c = 0; c < group.count; ++c)
+        {
+            combinations.push_back(&process.shaders[group.first + c]);
+            out += "    { ";
+            for (int g = 0; g < STATE_GROUP_COUNT; ++g)
+                out += std::to_string(combinations.back()->stateGroups[g]) + ", ";
+            out += "},\n";
+        }
+        out += "};\n";
+    }
+    out += "static void " + process.name + "_Bind" + GetVariantStem(process, shader) + "Shaders(" + process.name + "_Pipeline_Collection& pipeline, VkCommandBuffer command" +
+        GetVariantParam(shader) + ") {\n";
+    out += R"(    VKShaderObjectState& cache = *pipeline.shaderState;
+    if (cache.command != command)
+        BeginShaderObjectState(command, cache);
+    if (cache.owner != &pipeline)
+        ResetShaderObjectGroups(cache, &pipeline);
+)";
+    std::string vert = "pipeline.shaderObjects[" + std::to_string(shader.shaderObjects[0]) + "]";
+    std::string frag = shader.noFragment ? std::string("VK_NULL_HANDLE") : "pipeline.shaderObjects[" + std::to_string(shader.shaderObjects[1]) + "]";
+    out += "    if (cache.vert != " + vert + " || cache.frag != " + frag + ")\n";
+    out += "    {\n";
+    out += "        VkShaderStageFlagBits stages[2] = { VK_SHADER_STAGE_VERTEX_BIT, VK_SHADER_STAGE_FRAGMENT_BIT };\n";
+    out += "        VkShaderEXT shaders[2] = { " + vert + ", " + frag + " };\n";
+    out += "        vkCmdBindShadersEXT(command, 2, stages, shaders);\n";
+    out += "        cache.vert = shaders[0];\n";
+    out += "        cache.frag = shaders[1];\n";
+    out += "    }\n";
+    for (int g = 0; g < STATE_GROUP_COUNT; ++g)
+    {
+        std::string field = std::string("cache.") + ShaderStateGroupFields[g];
+        std::vector<int> ids;
+        for (ShaderDef* combination : combinations)
+        {
+            if (std::find(ids.begin(), ids.end(), combination->stateGroups[g]) == ids.end())
+                ids.push_back(combination->stateGroups[g]);
+        }
+        std::string id = ids.size() == 1 ? std::to_string(ids[0]) : table + "[variant][" + std::to_string(g) + "]";
+        out += "    if (" + field + " != " + id + ")\n";
+        out += "    {\n";
+        out += "        " + field + " = " + id + ";\n";
+        if (ids.size() == 1)
+            out += process.stateGroups[g][ids[0]];
+        else
+        {
+            out += "        switch (" + field + ")\n";
+            out += "        {\n";
+            for (int i : ids)
+            {
+                out += "        case " + std::to_string(i) + ":\n";
+                out += "        {\n";
+                out += IndentSource(process.stateGroups[g][i], "    ");
+                out += "            break;\n";
+                out += "        }\n";
+            }
+            out += "        }\n";
+        }
+        out += "    }\n";
+    }
+    out += "}\n";
+    return out;
+}
+std::string GetPipelineLayoutSetupSource(ShaderProcess& process, const std::string& indent)
+{
+    std::string out;
+    for (auto& p : process.shaders)
+    {
+        bool descSets = p.frag.texs.size() + p.frag.ubos.size() + p.vert.texs.size() + p.vert.ubos.size() > 0;
+        if (descSets)
+            out += indent + process.name + "_Create" + GetGroupName(process, p) + "DescriptorSetLayout(target, col.pipelines[PIPELINE_" + process.name + "_" + p.name + "]);\n";
+        out += indent + process.name + "_Create" + GetGroupName(process, p) + "PipelineLayout(target, col.pipelines[PIPELINE_" + process.name + "_" + p.name + "]);\n";
+    }
+    return out;
+}
+std::string GetDescFormat(std::vector<StagesDef<TextureDef>>& texs, std::vector<StagesDef<UniformDef>>& ubos)
+{
+    //Storage buffers take U slots too, the pools carry every buffer type for each
+    return std::string(texs.size(), 'T') + std::string(ubos.size(), 'U');
+}
+//Descriptor set layout for the shader's textures and buffers, registered with the render target's set format
+std::string GetDescriptorSetLayoutSource(ShaderProcess& process, ShaderDef& shader,
+    std::vector<StagesDef<TextureDef>>& texs, std::vector<StagesDef<UniformDef>>& ubos)
+{
+    std::string out;
+    std::string dstype = GetDescFormat(texs, ubos);
+    out += "\n\nvoid " + process.name + "_Create" + GetGroupName(process, shader) + "DescriptorSetLayout(VkRenderTarget * target, VKPipelineData& pipeline) {\n" +
+        "    VkDescriptorSetLayoutBinding bindings[" +
+        std::to_string(texs.size() + ubos.size())
+        + "] = {};\n";
+    for (int i = 0; i < texs.size(); ++i)
+    {
+        std::string indexStr = "[" + std::to_string(i) + "]";
+        out += "    {\n";
+        out += "        bindings" + indexStr + ".binding = " + std::to_string(texs[i].def.binding) + ";\n";
+        out += "        bindings" + indexStr + ".descriptorCount = 1;\n";
+        out += "        bindings" + indexStr + ".descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;\n";
+        out += "        bindings" + indexStr + ".pImmutableSamplers = nullptr;\n";
+        out += "        bindings" + indexStr + ".stageFlags = " + texs[i].stages + ";\n";
+        out += "    }\n";
+    }
+    for (int i = 0; i < ubos.size(); ++i)
+    {
+        std::string indexStr = "[" + std::to_string(texs.size() + i) + "]";
+        out += "    {\n";
+        out += "        bindings" + indexStr + ".binding = " + std::to_string(ubos[i].def.binding) + ";\n";
+        out += "        bindings" + indexStr + ".descriptorCount = 1;\n";
+        out += "        bindings" + indexStr + ".descriptorType = " + GetUniformDescriptorType(process, ubos[i].def) + ";\n";
+        out += "        bindings" + indexStr + ".pImmutableSamplers = nullptr;\n";
+        out += "        bindings" + indexStr + ".stageFlags = " + ubos[i].stages + ";\n";
+        out += "    }\n";
+    }
+    out += R"(
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = )" + std::to_string(texs.size() + ubos.size()) + R"(;
+    layoutInfo.pBindings = bindings;
+
+    pipeline.subIndex = target->getDescSetSubIndex(VkDS_)" + dstype + R"(, bindings, )" + std::to_string(texs.size() + ubos.size()) + R"();
+)";
+    if (process.descriptorBuffer)
+        out += "    if (target->descriptorBuffer)\n        layoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_DESCRIPTOR_BUFFER_BIT_EXT;\n";
+    out += "    if (vkCreateDescriptorSetLayout(target->device, &layoutInfo, nullptr, &pipeline.descriptorSetLayout) != VK_SUCCESS) {}\n";
+    if (process.descriptorBuffer)
+    {
+        out += "    if (target->descriptorBuffer)\n    {\n";
+        out += "        vkGetDescriptorSetLayoutSizeEXT(target->device, pipeline.descriptorSetLayout, &pipeline.descriptorSize);\n";
+        out += "        for (uint32_t i = 0; i < " + std::to_string(texs.size() + ubos.size()) + "; ++i)\n";
+        out += "            vkGetDescriptorSetLayoutBindingOffsetEXT(target->device, pipeline.descriptorSetLayout, bindings[i].binding, &pipeline.descriptorOffsets[i]);\n";
+        out += "    }\n";
+    }
+    out += "}\n";
+    return out;
+}
+//Descriptor buffer half of _Update<Shader>DescriptorSets: vkGetDescriptorEXT writes each descriptor straight into the
+//frame's ring at the offset the layout gave its binding, no set is allocated or updated
+std::string GetDescriptorBufferWriteSource(std::vector<StagesDef<TextureDef>>& texs, std::vector<StagesDef<UniformDef>>& ubos,
+    const std::string& pipeline)
+{
+    std::string out = "    if (target->descriptorBuffer)\n    {\n";
+    out += "        const VkPhysicalDeviceDescriptorBufferPropertiesEXT& sizes = target->descriptorBufferProperties;\n";
+    out += "        VK::DescriptorSlice slice = target->AllocDescriptors(" + pipeline + ".descriptorSize);\n";
+    out += "        VkDescriptorGetInfoEXT getInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_GET_INFO_EXT };\n";
+    if (!texs.empty())
+        out += "        VkDescriptorImageInfo imageInfo = {};\n        imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;\n";
+    if (!ubos.empty())
+        out += "        VkDescriptorAddressInfoEXT addressInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_ADDRESS_INFO_EXT };\n";
+    for (int i = 0; i < texs.size(); ++i)
+    {
+        out += "        imageInfo.imageView = texture_" + texs[i].def.name + "->imageView;\n";
+        out += "        imageInfo.sampler = texture_" + texs[i].def.name + "->sampler;\n";
+        out += "        getInfo.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;\n";
+        out += "        getInfo.data.pCombinedImageSampler = &imageInfo;\n";
+        out += "        vkGetDescriptorEXT(target->device, &getInfo, sizes.combinedImageSamplerDescriptorSize, slice.mapped + " + pipeline +
+            ".descriptorOffsets[" + std::to_string(i) + "]);\n";
+    }
+    for (int i = 0; i < ubos.size(); ++i)
+    {
+        const std::string& name = ubos[i].def.name;
+        if (ubos[i].def.storage)
+        {
+            //Address ranges can't be VK_WHOLE_SIZE, bind the whole buffer by its size
+            out += "        addressInfo.address = target->GetBufferAddress(ssbo_" + name + ".buffer);\n";
+            out += "        addressInfo.range = ssbo_" + name + ".size;\n";
+            out += "        getInfo.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;\n";
+            out += "        getInfo.data.pStorageBuffer = &addressInfo;\n";
+        }
+        else
+        {
+            out += "        addressInfo.address = target->GetBufferAddress(ubo_" + name + ".buffer);\n";
+            out += "        addressInfo.range = sizeof(" + name + ");\n";
+            out += "        getInfo.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;\n";
+            out += "        getInfo.data.pUniformBuffer = &addressInfo;\n";
+        }
+        out += "        vkGetDescriptorEXT(target->device, &getInfo, sizes." + std::string(ubos[i].def.storage ? "storageBufferDescriptorSize" : "uniformBufferDescriptorSize") +
+            ", slice.mapped + " + pipeline + ".descriptorOffsets[" + std::to_string(texs.size() + i) + "]);\n";
+    }
+    out += "        output.clear();\n";
+    out += "        output.push_back({ VK_NULL_HANDLE, slice.offset });\n";
+    out += "        return;\n";
+    out += "    }\n";
+    return out;
+}
+//_Update<Shader>DescriptorSets, pipeline is the collection member holding the layout
+std::string GetDescriptorSetUpdateSource(ShaderProcess& process, ShaderDef& shader,
+    std::vector<StagesDef<TextureDef>>& texs, std::vector<StagesDef<UniformDef>>& ubos, const std::string& pipeline)
+{
+    std::string out;
+    std::string dstype = GetDescFormat(texs, ubos);
+    out += GetDescSetFunctionName(process, shader, ubos, texs);
+    out += " {\n";
+    if (process.descriptorBuffer)
+        out += GetDescriptorBufferWriteSource(texs, ubos, pipeline);
+
+    out += "    VkDescriptorSet descriptorSet = target->getDescSet(VkDS_" + dstype + ", " + pipeline + ".subIndex, &" + pipeline +
+        ".descriptorSetLayout);\n";
+    out += "    VkWriteDescriptorSet descriptorWrites[" + std::to_string(texs.size() + ubos.size()) + "] = {};\n\n";
+    for (int i = 0; i < texs.size(); ++i)
+    {
+        std::string indexStr = "[" + std::to_string(i) + "]";
+        out += "    VkDescriptorImageInfo imageInfo_" + texs[i].def.name + " = {};\n";
+        out += "    imageInfo_" + texs[i].def.name + ".imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;\n";
+        out += "    imageInfo_" + texs[i].def.name + ".imageView = texture_" + texs[i].def.name + "->imageView;\n";
+        out += "    imageInfo_" + texs[i].def.name + ".sampler = texture_" + texs[i].def.name + "->sampler;\n";
+        out += "    \n";
+        out += "    descriptorWrites" + indexStr + ".sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;\n";
+        out += "    descriptorWrites" + indexStr + ".dstSet = descriptorSet;\n";
+        out += "    descriptorWrites" + indexStr + ".dstBinding = " + std::to_string(texs[i].def.binding) + ";\n";
+        out += "    descriptorWrites" + indexStr + ".dstArrayElement = 0;\n";
+        out += "    descriptorWrites" + indexStr + ".descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;\n";
+        out += "    descriptorWrites" + indexStr + ".descriptorCount = 1;\n";
+        out += "    descriptorWrites" + indexStr + ".pImageInfo = &imageInfo_" + texs[i].def.name + ";\n";
+    }
+    for (int i = 0; i < ubos.size(); ++i)
+    {
+        std::string indexStr = "[" + std::to_string(texs.size() + i) + "]";
+        out += "    VkDescriptorBufferInfo bufferInfo_" + ubos[i].def.name + " = {};\n";
+        if (ubos[i].def.storage)
+        {
+            //Runtime arrays make the size a property of the buffer, not the struct
+            out += "    bufferInfo_" + ubos[i].def.name + ".buffer = ssbo_" + ubos[i].def.name + ".buffer;\n";
+            out += "    bufferInfo_" + ubos[i].def.name + ".offset = 0;\n";
+            out += "    bufferInfo_" + ubos[i].def.name + ".range = VK_WHOLE_SIZE;\n";
+        }
+        else
+        {
+            out += "    bufferInfo_" + ubos[i].def.name + ".buffer = " +
+                (process.dynamicUniforms ? std::string("target->GetUniformRing()") : "ubo_" + ubos[i].def.name + ".buffer") + ";\n";
+            out += "    bufferInfo_" + ubos[i].def.name + ".offset = 0;\n";
+            out += "    bufferInfo_" + ubos[i].def.name + ".range = sizeof(" + ubos[i].def.name + ");\n";
+        }
+        out += "    \n";
+        out += "    descriptorWrites" + indexStr + ".sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;\n";
+        out += "    descriptorWrites" + indexStr + ".dstSet = descriptorSet;\n";
+        out += "    descriptorWrites" + indexStr + ".dstBinding = " + std::to_string(ubos[i].def.binding) + ";\n";
+        out += "    descriptorWrites" + indexStr + ".dstArrayElement = 0;\n";
+        out += "    descriptorWrites" + indexStr + ".descriptorType = " + GetUniformDescriptorType(process, ubos[i].def) + ";\n";
+        out += "    descriptorWrites" + indexStr + ".descriptorCount = 1;\n";
+        out += "    descriptorWrites" + indexStr + ".pBufferInfo = &bufferInfo_" + ubos[i].def.name + ";\n";
+    }
+    out += "    vkUpdateDescriptorSets(target->device, " + std::to_string(texs.size() + ubos.size()) + ", descriptorWrites, 0, nullptr);\n";
+    out += "    output.clear();\n";
+    out += process.descriptorBuffer ? "    output.push_back({ descriptorSet, 0 });\n" : "    output.push_back(descriptorSet);\n";
+    out += "}\n";
+    return out;
+}
+//State a variant group reads from its table, as the created variable, member and type
+const char* VariantStateFields[][3] = {
+    { "colorBlendAttachment", "blendEnable", "VkBool32" },
+    { "colorBlendAttachment", "colorWriteMask", "VkColorComponentFlags" },
+    { "colorBlendAttachment", "srcColorBlendFactor", "VkBlendFactor" },
+    { "colorBlendAttachment", "dstColorBlendFactor", "VkBlendFactor" },
+    { "colorBlendAttachment", "colorBlendOp", "VkBlendOp" },
+    { "colorBlendAttachment", "srcAlphaBlendFactor", "VkBlendFactor" },
+    { "colorBlendAttachment", "dstAlphaBlendFactor", "VkBlendFactor" },
+    { "colorBlendAttachment", "alphaBlendOp", "VkBlendOp" },
+    { "depthStencil", "depthTestEnable", "VkBool32" },
+    { "depthStencil", "depthWriteEnable", "VkBool32" },
+    { "depthStencil", "depthCompareOp", "VkCompareOp" },
+    { "rasterizer", "cullMode", "VkCullModeFlags" },
+    { "rasterizer", "frontFace", "VkFrontFace" },
+    { "inputAssembly", "topology", "VkPrimitiveTopology" },
+};
+const int VARIANT_STATE_FIELD_COUNT = sizeof(VariantStateFields) / sizeof(VariantStateFields[0]);
+std::vector<std::string> GetVariantStateValues(ShaderDef& shader)
+{
+    return {
+        shader.blend.blendEnable,
+        shader.blend.colorWriteMask,
+        shader.blend.srcColorBlendFactor,
+        shader.blend.dstColorBlendFactor,
+        shader.blend.colorBlendOp,
+        shader.blend.srcAlphaBlendFactor,
+        shader.blend.dstAlphaBlendFactor,
+        shader.blend.alphaBlendOp,
+        shader.depth.empty() ? "VK_FALSE" : "VK_TRUE",
+        !shader.depth.empty() && shader.depthWrite ? "VK_TRUE" : "VK_FALSE",
+        shader.depth.empty() ? "VK_COMPARE_OP_NEVER" : shader.depth,
+        shader.cullMode,
+        shader.frontFace,
+        shader.topo,
+    };
+}
+void SetVariantStateValues(ShaderDef& shader, const std::vector<std::string>& values)
+{
+    shader.blend.blendEnable = values[0];
+    shader.blend.colorWriteMask = values[1];
+    shader.blend.srcColorBlendFactor = values[2];
+    shader.blend.dstColorBlendFactor = values[3];
+    shader.blend.colorBlendOp = values[4];
+    shader.blend.srcAlphaBlendFactor = values[5];
+    shader.blend.dstAlphaBlendFactor = values[6];
+    shader.blend.alphaBlendOp = values[7];
+    shader.depth = values[8] == "VK_TRUE" ? values[10] : "";
+    shader.depthWrite = values[9] == "VK_TRUE";
+    shader.cullMode = values[11];
+    shader.frontFace = values[12];
+    shader.topo = values[13];
+}
+//Monolithic pipeline of an entry. overrides is inserted once every state struct exists, shared variant functions
+//use it to read the state that differs between combinations from their table
+std::string GetPipelineCreateSource(ShaderProcess& process, ShaderDef& shader, const std::string& signature, const std::string& overrides)
+{
+    std::string vert = GetModuleArray(process, shader, false);
+    std::string frag = GetModuleArray(process, shader, true);
+
+    std::string out = signature + " {\n" +
+        "    VkShaderModule vertShaderModule = createShaderModule(target->device, " + vert + ", sizeof(" + vert + "));" +
+        "    VkShaderModule fragShaderModule = createShaderModule(target->device, " + frag + ", sizeof(" + frag + "));";
+    out += vert_frag_1;
+    out += GetSpecStageSource(process, shader, shader.vert.specs, "Vert", "shaderStages[0]");
+    out += GetSpecStageSource(process, shader, shader.frag.specs, "Frag", "shaderStages[1]");
+    out += GetVertexInputSource(shader);
+
+    //Create Desc Layout
+    std::vector<StagesDef<TextureDef>> texs = BuildStages(shader.vert.texs, shader.frag.texs);
+    std::vector<StagesDef<UniformDef>> ubos = BuildStages(shader.vert.ubos, shader.frag.ubos);
+    out += GetDynamicStateSource(shader);
+    out += shader_multisample;
+    out += GetRasterizerSource(shader);
+    out += GetColorBlendSource(shader);
+    out += GetPipelineLayoutSource(shader, texs, ubos);
+    out += R"(
+    VkGraphicsPipelineCreateInfo pipelineInfo = {};)";
+    out += GetDepthStencilSource(shader);
+    out += GetRenderingSource(process, false);
+    out += GetDescriptorBufferFlagSource(process, "pipelineInfo");
+    out += overrides;
+    if (shader.noFragment)
+    {
+        //The vertex stage comes first in shaderStages, dropping the count leaves rasterization without a fragment shader
+        std::string end = shader_end;
+        std::string stageCount = "stageCount = 2";
+        end.replace(end.find(stageCount), stageCount.size(), "stageCount = 1");
+        out += end;
+    }
+    else
+        out += shader_end;
+    return out;
+}
+std::string GetCreatePipelineSignature(ShaderProcess& process, ShaderDef& shader)
+{
+    if (shader.variantShared)
+    {
+        return "void " + process.name + "_Create" + process.variantGroups[shader.variantGroup].name +
+            "VariantPipeline(VkRenderTarget* target, VKPipelineData& pipeline, uint32_t variant)";
+    }
+    return "void " + process.name + "_Create" + shader.name + "Pipeline(VkRenderTarget* target, VKPipelineData& pipeline)";
+}
+std::string GetCreatePipelineCall(ShaderProcess& process, ShaderDef& shader, const std::string& target, const std::string& pipeline)
+{
+    if (shader.variantShared)
+    {
+        return process.name + "_Create" + process.variantGroups[shader.variantGroup].name + "VariantPipeline(" + target + ", " + pipeline + ", " +
+            std::to_string(shader.variantIndex) + ");\n";
+    }
+    return process.name + "_Create" + shader.name + "Pipeline(" + target + ", " + pipeline + ");\n";
+}
+//Entries collapsed into another entry's pipeline copy its handle instead of creating one
+bool OwnsPipeline(ShaderProcess& process, int index)
+{
+    int owner = process.shaders[index].pipelineOwner;
+    return owner == -1 || owner == index;
+}
+bool GroupCreatesSharedVariant(ShaderProcess& process, VariantGroup& group)
+{
+    for (int c = 0; c < group.count; ++c)
+    {
+        if (process.shaders[group.first + c].variantShared && OwnsPipeline(process, group.first + c))
+            return true;
+    }
+    return false;
+}
+//Works out which state differs between a group's combinations. Combinations whose pipelines match the first one's
+//apart from that state are created by one function that indexes a state table
+void MarkSharedVariants(ShaderProcess& process)
+{
+    for (int g = 0; g < process.variantGroups.size(); ++g)
+    {
+        VariantGroup& group = process.variantGroups[g];
+        ShaderDef& first = process.shaders[group.first];
+        std::vector<std::string> firstValues = GetVariantStateValues(first);
+        for (int c = 0; c < group.count; ++c)
+        {
+            std::vector<std::string> values = GetVariantStateValues(process.shaders[group.first + c]);
+            for (int f = 0; f < VARIANT_STATE_FIELD_COUNT; ++f)
+            {
+                if (values[f] != firstValues[f] && std::find(group.fields.begin(), group.fields.end(), f) == group.fields.end())
+                    group.fields.push_back(f);
+            }
+        }
+        std::sort(group.fields.begin(), group.fields.end());
+        if (group.fields.empty())
+            continue;
+        std::string reference = GetPipelineCreateSource(process, first, "", "");
+        int shared = 0;
+        for (int c = 0; c < group.count; ++c)
+        {
+            ShaderDef copy = process.shaders[group.first + c];
+            copy.name = first.name;
+            SetVariantStateValues(copy, firstValues);
+            process.shaders[group.first + c].variantShared = GetPipelineCreateSource(process, copy, "", "") == reference;
+            shared += process.shaders[group.first + c].variantShared ? 1 : 0;
+        }
+        printf("%s: %d of %d %s variants share one create function\n", process.name.c_str(), shared, group.count, group.name.c_str());
+    }
+}
+std::string GetVariantTableSource(ShaderProcess& process, VariantGroup& group)
+{
+    std::string type = process.name + "_" + group.name + "_VariantState";
+    std::string out = "//" + group.name + " state that differs between variants, in PIPELINE_" + process.name + "_" + group.name + "_VARIANT order\n";
+    out += "struct " + type + " {\n";
+    for (int f : group.fields)
+        out += "    " + std::string(VariantStateFields[f][2]) + " " + VariantStateFields[f][1] + ";\n";
+    out += "};\n";
+    out += "static const " + type + " " + process.name + "_" + group.name + "_VariantStates[" + std::to_string(group.count) + "] = {\n";
+    for (int c = 0; c < group.count; ++c)
+    {
+        std::vector<std::string> values = GetVariantStateValues(process.shaders[group.first + c]);
+        std::string row;
+        for (int f : group.fields)
+            row += (row.empty() ? "" : ", ") + values[f];
+        out += "    { " + row + " },\n";
+    }
+    out += "};\n";
+    return out;
+}
+std::string GetVariantOverrideSource(ShaderProcess& process, VariantGroup& group)
+{
+    std::string out = "    const " + process.name + "_" + group.name + "_VariantState& state = " + process.name + "_" + group.name + "_VariantStates[variant];\n";
+    for (int f : group.fields)
+        out += "    " + std::string(VariantStateFields[f][0]) + "." + VariantStateFields[f][1] + " = state." + VariantStateFields[f][1] + ";\n";
+    return out;
+}
+//Combinations past the first are created on their first draw, unless another entry shares their pipeline
+bool IsLazyVariant(ShaderProcess& process, int index)
+{
+    ShaderDef& shader = process.shaders[index];
+    if (shader.variantGroup == -1 || !process.variantGroups[shader.variantGroup].lazy || shader.variantIndex == 0)
+        return false;
+    for (int s = 0; s < process.shaders.size(); ++s)
+    {
+        if (s != index && process.shaders[s].pipelineOwner == index)
+            return false;
+    }
+    return OwnsPipeline(process, index);
+}
+bool HasLazyVariants(ShaderProcess& process)
+{
+    for (int s = 0; s < process.shaders.size(); ++s)
+    {
+        if (IsLazyVariant(process, s))
+            return true;
+    }
+    return false;
+}
+bool HasInstanceRate(ShaderDef& shader, std::vector<std::pair<int, int>>& bindings)
+{
+    for (auto bdi : bindings)
+    {
+        if (shader.vert.inputs[bdi.second].rate.compare("VK_VERTEX_INPUT_RATE_INSTANCE") == 0)
+            return true;
+    }
+    return false;
+}
+//Vertex and index binds that only happen when they differ from the last ones on the command buffer
+std::string GetSharedBindSource(size_t bindingCount, bool drawIndexed)
+{
+    std::string count = std::to_string(bindingCount);
+    std::string out = R"(
+    //Meshes in the same shared buffers only differ in vertexOffset and firstIndex
+    VKBufferBindState& bound = *pipeline.bindState;
+    if (bound.command != command)
+    {
+        bound = {};
+        bound.command = command;
+    }
+)";
+    if (bindingCount > 0)
+    {
+        out += "    if (bound.vertexCount != " + count + " || memcmp(bound.vertexBuffers, vertexBuffers, sizeof(vertexBuffers)) != 0 ||\n";
+        out += "        memcmp(bound.offsets, offsets, sizeof(offsets)) != 0)\n    {\n";
+        out += "        vkCmdBindVertexBuffers(command, 0, " + count + ", vertexBuffers, offsets);\n";
+        out += "        memcpy(bound.vertexBuffers, vertexBuffers, sizeof(vertexBuffers));\n";
+        out += "        memcpy(bound.offsets, offsets, sizeof(offsets));\n";
+        out += "        bound.vertexCount = " + count + ";\n    }\n";
+    }
+    if (drawIndexed)
+    {
+        out += "    if (bound.indexBuffer != indexBuffer || bound.indexType != indexType)\n    {\n";
+        out += "        vkCmdBindIndexBuffer(command, indexBuffer, 0, indexType);\n";
+        out += "        bound.indexBuffer = indexBuffer;\n";
+        out += "        bound.indexType = indexType;\n    }\n";
+    }
+    return out + "\n";
+}
+//Lazy combinations of the shader's group, or the shader itself, created on the first draw that finds no pipeline
+std::string GetLazyCreateSource(ShaderProcess& process, ShaderDef& shader, const std::string& pipeline, const std::string& indent)
+{
+    std::vector<int> lazy;
+    bool shared = true;
+    int first = (int)(&shader - &process.shaders[0]);
+    int count = shader.variantGroup == -1 ? 1 : process.variantGroups[shader.variantGroup].count;
+    for (int c = first; c < first + count; ++c)
+    {
+        if (!IsLazyVariant(process, c))
+            continue;
+        lazy.push_back(c);
+        shared &= process.shaders[c].variantShared;
+    }
+    if (lazy.empty())
+        return "";
+    std::string out = indent + "    if (" + pipeline + ".graphicsPipeline == VK_NULL_HANDLE)\n";
+    if (shader.variantGroup == -1)
+        return out + indent + "        " + GetCreatePipelineCall(process, shader, "pipeline.target", pipeline);
+    if (shared)
+    {
+        return out + indent + "        " + process.name + "_Create" + process.variantGroups[shader.variantGroup].name + "VariantPipeline(pipeline.target, " +
+            pipeline + ", variant);\n";
+    }
+    out += indent + "    {\n" + indent + "        switch (variant)\n" + indent + "        {\n";
+    for (int c : lazy)
+    {
+        out += indent + "        case " + std::to_string(process.shaders[c].variantIndex) + ":\n";
+        out += indent + "            " + GetCreatePipelineCall(process, process.shaders[c], "pipeline.target", pipeline);
+        out += indent + "            break;\n";
+    }
+    return out + indent + "        }\n" + indent + "    }\n";
+}
+//State a collapsed pipeline leaves dynamic, combinations with the same state share a case
+std::string GetStatePreambleSource(ShaderProcess& process, ShaderDef& shader)
+{
+    if (shader.variantGroup == -1)
+        return shader.statePreamble;
+    VariantGroup& group = process.variantGroups[shader.variantGroup];
+    std::vector<std::string> preambles;
+    std::vector<std::string> labels;
+    for (int c = 0; c < group.count; ++c)
+    {
+        std::string& preamble = process.shaders[group.first + c].statePreamble;
+        size_t p = std::find(preambles.begin(), preambles.end(), preamble) - preambles.begin();
+        if (p == preambles.size())
+        {
+            preambles.push_back(preamble);
+            labels.push_back("");
+        }
+        labels[p] += "        case " + std::to_string(c) + ":\n";
+    }
+    if (preambles.size() == 1)
+        return preambles[0];
+    std::string out = "        switch (variant)\n        {\n";
+    for (size_t p = 0; p < preambles.size(); ++p)
+    {
+        if (preambles[p].empty())
+            continue;
+        out += labels[p] + "        {\n" + IndentSource(preambles[p], "    ") + "            break;\n        }\n";
+    }
+    return out + "        }\n";
+}
+std::string GetDispatchFunctionName(ShaderProcess& process, ShaderDef& shader, bool indirect)
+{
+    std::string out = "void " + process.name + "_Dispatch" + shader.name + (indirect ? "Indirect" : "") + "(" + process.name +
+        "_Pipeline_Collection& pipeline, VkCommandBuffer command";
+    if (shader.comp.texs.size() + shader.comp.ubos.size() > 0)
+        out += ", std::vector<" + GetDescriptorSetType(process) + ">& sets";
+    for (auto& ubo : GetDynamicUniforms(process, shader))
+        out += ", uint32_t uboOffset_" + ubo.name;
+    if (indirect)
+        out += ", VkBuffer indirectBuffer, VkDeviceSize indirectOffset";
+    else
+        out += ", uint32_t groupsX, uint32_t groupsY, uint32_t groupsZ";
+    return out + GetPushParam(shader) + ")";
+}
+//Compute pipeline creation plus the direct and indirect dispatch functions
+std::string GetComputeSource(ShaderProcess& process, ShaderDef& shader)
+{
+    std::string comp = GetShaderArray(process.name, shader.comp.name);
+    std::string pipeline = "pipeline.computes[COMPUTE_" + process.name + "_" + shader.name + "]";
+    std::vector<StagesDef<TextureDef>> texs = GetTextureStages(shader);
+    std::vector<StagesDef<UniformDef>> ubos = GetBufferStages(shader);
+
+    std::string out = GetSpecializationSource(process, shader, shader.comp.specs, "Comp");
+    out += "void " + process.name + "_Create" + shader.name + "ComputePipeline(VkRenderTarget* target, VKPipelineData& pipeline) {\n" +
+        "    VkShaderModule compShaderModule = createShaderModule(target->device, " + comp + ", sizeof(" + comp + "));";
+    out += GetPipelineLayoutSource(shader, texs, ubos);
+    out += R"(
+    VkComputePipelineCreateInfo pipelineInfo = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = compShaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = pipeline.pipelineLayout;
+)";
+    out += GetDescriptorBufferFlagSource(process, "pipelineInfo");
+    out += GetSpecStageSource(process, shader, shader.comp.specs, "Comp", "pipelineInfo.stage");
+    out += R"(
+    if (vkCreateComputePipelines(target->device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline.graphicsPipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create compute pipeline!");
+    }
+
+    vkDestroyShaderModule(target->device, compShaderModule, nullptr);
+}
+)";
+    if (texs.size() + ubos.size() > 0)
+    {
+        out += GetDescriptorSetLayoutSource(process, shader, texs, ubos);
+        out += GetDescriptorSetUpdateSource(process, shader, texs, ubos, pipeline);
+    }
+
+    std::vector<UniformDef> dynamicUbos = GetDynamicUniforms(process, shader);
+    for (int indirect = 0; indirect < 2; ++indirect)
+    {
+        out += GetDispatchFunctionName(process, shader, indirect == 1) + "\n{\n";
+        out += "    vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_COMPUTE, " + pipeline + ".graphicsPipeline);\n";
+        if (texs.size() + ubos.size() > 0)
+        {
+            if (!dynamicUbos.empty())
+            {
+                out += "    uint32_t dynamicOffsets[] = { ";
+                for (auto& ubo : dynamicUbos)
+                    out += "uboOffset_" + ubo.name + ", ";
+                out += "};\n";
+            }
+            if (process.descriptorBuffer)
+                out += GetDescriptorBufferBindSource("VK_PIPELINE_BIND_POINT_COMPUTE", pipeline);
+            else
+                out += "    vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_COMPUTE, " + pipeline + ".pipelineLayout, 0, static_cast<uint32_t>(sets.size()), sets.data(), " +
+                    (dynamicUbos.empty() ? std::string("0, nullptr") : std::to_string(dynamicUbos.size()) + ", dynamicOffsets") + ");\n";
         }
-        else if (shader.frag.push.empty() == false)
+        if (!shader.comp.push.empty())
         {
-            out += R"(
-    VkPushConstantRange pushConstantRange;
-    pushConstantRange.stageFlags = )" + shader.frag.pushStages + R"(;
-    pushConstantRange.size = sizeof()" + shader.frag.push + R"();
-    pushConstantRange.offset = 0;
-
-    // Push constant ranges are part of the pipeline layout
-    pipelineLayoutInfo.pushConstantRangeCount = 1;
-    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;)";
+            out += "    vkCmdPushConstants(command, " + pipeline + ".pipelineLayout, " + shader.comp.pushStages + ", 0, sizeof(" +
+                shader.comp.push + "), push);\n";
         }
-        out += R"(
-    if (vkCreatePipelineLayout(target->device, &pipelineLayoutInfo, nullptr, &pipeline.pipelineLayout) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create pipeline layout!");
+        if (indirect)
+            out += "    vkCmdDispatchIndirect(command, indirectBuffer, indirectOffset);\n";
+        else
+            out += "    vkCmdDispatch(command, groupsX, groupsY, groupsZ);\n";
+        out += "}\n";
+    }
+    return out;
+}
+void OutputShaderImpl(ShaderProcess& process, std::string baseFolder)
+{
+    std::string out = R"(//THIS FILE WAS AUTO-GENERATED BY VKSHADERTOHEADER
+#include ")" + process.name + R"(_shaderdef.h"
+#include "VkRenderTarget.h"
+#include <stdexcept>
+)";
+    if (process.pipelineLibrary)
+        out += "#include <thread>\n";
+    bool vertexStructs = false;
+    for (auto& shader : process.shaders)
+        vertexStructs |= HasVertexStruct(process, shader);
+    if (vertexStructs)
+        out += "#include <string.h>\n#include \"VkVertexPacking.h\"\n";
+    if (HasDepthOnly(process))
+        out += "#include \"VkBufferTools.h\"\n";
+    if (process.sharedBuffers && !vertexStructs)
+        out += "#include <string.h>\n";
+    if (HasDeltaPush(process))
+        out += "#include <stddef.h>\n#include \"VkPushRecorder.h\"\n";
+    else if (HasSpecialization(process))
+        out += "#include <stddef.h>\n";
+    for (auto& p : process.includes)
+    {
+        out += "#include \"" + p + "\"\n";
     }
 
-    VkGraphicsPipelineCreateInfo pipelineInfo = {};)";
-        if (shader.depth.empty() == false)
-        {
+    out += createShaderModule;
+    if (process.shaderObject)
+        out += shader_object_state;
+    if (HasDeltaPush(process))
+        out += GetPushMembersSource(process);
 
-            out += R"(
-    VkPipelineDepthStencilStateCreateInfo depthStencil{};
-    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depthStencil.depthTestEnable = VK_TRUE;
-    depthStencil.depthWriteEnable = )" + std::string(shader.depthWrite ? "VK_TRUE" : "VK_FALSE") + R"(;
-    depthStencil.depthBoundsTestEnable = VK_FALSE;
-    depthStencil.minDepthBounds = 0.0f; // Optional
-    depthStencil.maxDepthBounds = 1.0f; // Optional
-    depthStencil.depthCompareOp = )" + shader.depth + R"(;
-    pipelineInfo.pDepthStencilState = &depthStencil;
-)";
+    for (auto& shader : process.shaders)
+    {
+        if (EmitsGroupFunctions(shader))
+        {
+            out += GetSpecializationSource(process, shader, shader.vert.specs, "Vert");
+            out += GetSpecializationSource(process, shader, shader.frag.specs, "Frag");
         }
-        else
+        //CREATE SHADER
+        if (!shader.variantShared)
         {
-            out += R"(
-    VkPipelineDepthStencilStateCreateInfo depthStencil{};
-    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depthStencil.depthTestEnable = VK_FALSE;
-    depthStencil.depthWriteEnable = VK_FALSE;
-    depthStencil.depthBoundsTestEnable = VK_FALSE;
-    depthStencil.minDepthBounds = 0.0f; // Optional
-    depthStencil.maxDepthBounds = 1.0f; // Optional
-    depthStencil.depthCompareOp = VK_COMPARE_OP_NEVER;
-    pipelineInfo.pDepthStencilState = &depthStencil;
-)";
+            if (OwnsPipeline(process, (int)(&shader - &process.shaders[0])))
+                out += GetPipelineCreateSource(process, shader, GetCreatePipelineSignature(process, shader), "");
         }
-        if (shader.stencil.active)
+        else if (shader.variantIndex == 0 && GroupCreatesSharedVariant(process, process.variantGroups[shader.variantGroup]))
         {
-            out += "    depthStencil.stencilTestEnable = VK_TRUE;\n";
-            out += "    depthStencil.front.compareMask = " + shader.stencil.compareMask + ";\n";
-            out += "    depthStencil.front.writeMask = " + shader.stencil.writeMask + ";\n";
-            out += "    depthStencil.front.reference = " + shader.stencil.reference + ";\n";
-            out += "    depthStencil.front.compareOp = " + shader.stencil.compareOp + ";\n";
-            out += "    depthStencil.front.failOp = " + shader.stencil.failOp + ";\n";
-            out += "    depthStencil.front.depthFailOp = " + shader.stencil.depthFailOp + ";\n";
-            out += "    depthStencil.front.passOp = " + shader.stencil.passOp + ";\n";
-            out += "    depthStencil.back = depthStencil.front;\n";
+            VariantGroup& group = process.variantGroups[shader.variantGroup];
+            out += GetVariantTableSource(process, group);
+            out += GetPipelineCreateSource(process, shader, GetCreatePipelineSignature(process, shader), GetVariantOverrideSource(process, group));
         }
-        out += shader_end;
 
+        //Everything else is the same for a variant group's combinations apart from the entry, which is indexed by variant
+        if (!EmitsGroupFunctions(shader))
+            continue;
+        std::vector<StagesDef<TextureDef>> texs = BuildStages(shader.vert.texs, shader.frag.texs);
+        std::vector<StagesDef<UniformDef>> ubos = BuildStages(shader.vert.ubos, shader.frag.ubos);
+        if (process.pipelineLibrary || process.shaderObject)
+        {
+        out += "void " + process.name + "_Create" + GetGroupName(process, shader) + "PipelineLayout(VkRenderTarget* target, VKPipelineData& pipeline) {";
+            out += GetPipelineLayoutSource(shader, texs, ubos);
+            out += "}\n";
+        }
+        if (process.pipelineLibrary)
+            out += GetPipelineLinkSource(process, shader);
+        if (process.shaderObject)
+            out += GetShaderObjectBindSource(process, shader);
 
 
-        if (texs.size() + ubos.size() > 0)
-        {
-            out += "\n\nvoid " + process.name + "_Create" + shader.name + "DescriptorSetLayout(VkRenderTarget * target, VKPipelineData& pipeline) {\n" +
-                "    VkDescriptorSetLayoutBinding bindings[" +
-                std::to_string(texs.size() + ubos.size())
-                + "] = {};\n";
-            for (int i = 0; i < texs.size(); ++i)
-            {
-                std::string indexStr = "[" + std::to_string(i) + "]";
-                out += "    {\n";
-                out += "        bindings" + indexStr + ".binding = " + std::to_string(texs[i].def.binding) + ";\n";
-                out += "        bindings" + indexStr + ".descriptorCount = 1;\n";
-                out += "        bindings" + indexStr + ".descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;\n";
-                out += "        bindings" + indexStr + ".pImmutableSamplers = nullptr;\n";
-                out += "        bindings" + indexStr + ".stageFlags = " + texs[i].stages + ";\n";
-                out += "    }\n";
-            }
-            for (int i = 0; i < ubos.size(); ++i)
-            {
-                std::string indexStr = "[" + std::to_string(texs.size() + i) + "]";
-                out += "    {\n";
-                out += "        bindings" + indexStr + ".binding = " + std::to_string(ubos[i].def.binding) + ";\n";
-                out += "        bindings" + indexStr + ".descriptorCount = 1;\n";
-                out += "        bindings" + indexStr + ".descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;\n";
-                out += "        bindings" + indexStr + ".pImmutableSamplers = nullptr;\n";
-                out += "        bindings" + indexStr + ".stageFlags = " + ubos[i].stages + ";\n";
-                out += "    }\n";
-            }
-            out += R"(
-    VkDescriptorSetLayoutCreateInfo layoutInfo = {};
-    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    layoutInfo.bindingCount = )" + std::to_string(texs.size() + ubos.size()) + R"(;
-    layoutInfo.pBindings = bindings;
 
-    pipeline.subIndex = target->getDescSetSubIndex(VkDS_)" + dstype + R"(, bindings, )" + std::to_string(texs.size() + ubos.size()) + R"();
-    if (vkCreateDescriptorSetLayout(target->device, &layoutInfo, nullptr, &pipeline.descriptorSetLayout) != VK_SUCCESS) {}
-}
-)";
-        }
+        if (texs.size() + ubos.size() > 0)
+            out += GetDescriptorSetLayoutSource(process, shader, texs, ubos);
 
         //Update Desc Set
 /*
@@ -952,54 +3243,162 @@ void PipelineImageDraw::UpdateDescriptorSets(VkRenderTarget* target, VK::Texture
 }
 */
         if (texs.size() + ubos.size() > 0)
-        {
-            std::string pipeline = "pipeline.pipelines[PIPELINE_" + process.name + "_" + shader.name + "]";
-            out += GetDescSetFunctionName(process, shader, ubos, texs);
-            out += " {\n";
+            out += GetDescriptorSetUpdateSource(process, shader, texs, ubos, "pipeline.pipelines[PIPELINE_" + process.name + "_" + shader.name + "]");
+    }
+    for (auto& shader : process.computes)
+        out += GetComputeSource(process, shader);
+    for (int l = 0; l < process.libraries.size(); ++l)
+    {
+        out += GetPipelineLibrarySource(process, l);
+    }
+    for (int o = 0; o < process.shaderObjects.size(); ++o)
+    {
+        out += GetShaderObjectSource(process, o);
+    }
+    if (HasPushUniforms(process))
+    {
+        out += "static void " + process.name + R"(_CreatePushUniformSets(VkRenderTarget* target, VKPipelineData& pipeline, std::vector<VkDescriptorSet>& sets, VkShaderStageFlags stages, VkDeviceSize range)
+{
+    VkDescriptorSetLayoutBinding binding = {};
+    binding.binding = 0;
+    binding.descriptorCount = 1;
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    binding.stageFlags = stages;
 
-            out += "    VkDescriptorSet descriptorSet = target->getDescSet(VkDS_" + dstype + ", " + pipeline + ".subIndex, &" + pipeline +
-                ".descriptorSetLayout);\n";
-            out += "    VkWriteDescriptorSet descriptorWrites[" + std::to_string(texs.size() + ubos.size()) + "] = {};\n\n";
-            for (int i = 0; i < texs.size(); ++i)
-            {
-                std::string indexStr = "[" + std::to_string(i) + "]";
-                out += "    VkDescriptorImageInfo imageInfo_" + texs[i].def.name + " = {};\n";
-                out += "    imageInfo_" + texs[i].def.name + ".imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;\n";
-                out += "    imageInfo_" + texs[i].def.name + ".imageView = texture_" + texs[i].def.name + "->imageView;\n";
-                out += "    imageInfo_" + texs[i].def.name + ".sampler = texture_" + texs[i].def.name + "->sampler;\n";
-                out += "    \n";
-                out += "    descriptorWrites" + indexStr + ".sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;\n";
-                out += "    descriptorWrites" + indexStr + ".dstSet = descriptorSet;\n";
-                out += "    descriptorWrites" + indexStr + ".dstBinding = " + std::to_string(texs[i].def.binding) + ";\n";
-                out += "    descriptorWrites" + indexStr + ".dstArrayElement = 0;\n";
-                out += "    descriptorWrites" + indexStr + ".descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;\n";
-                out += "    descriptorWrites" + indexStr + ".descriptorCount = 1;\n";
-                out += "    descriptorWrites" + indexStr + ".pImageInfo = &imageInfo_" + texs[i].def.name + ";\n";
-            }
-            for (int i = 0; i < ubos.size(); ++i)
-            {
-                std::string indexStr = "[" + std::to_string(texs.size() + i) + "]";
-                out += "    VkDescriptorBufferInfo bufferInfo_" + ubos[i].def.name + " = {};\n";
-                out += "    bufferInfo_" + ubos[i].def.name + ".buffer = ubo_" + ubos[i].def.name + ".buffer;\n";
-                out += "    bufferInfo_" + ubos[i].def.name + ".offset = 0;\n";
-                out += "    bufferInfo_" + ubos[i].def.name + ".range = sizeof(" + ubos[i].def.name + ");\n";
-                out += "    \n";
-                out += "    descriptorWrites" + indexStr + ".sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;\n";
-                out += "    descriptorWrites" + indexStr + ".dstSet = descriptorSet;\n";
-                out += "    descriptorWrites" + indexStr + ".dstBinding = " + std::to_string(ubos[i].def.binding) + ";\n";
-                out += "    descriptorWrites" + indexStr + ".dstArrayElement = 0;\n";
-                out += "    descriptorWrites" + indexStr + ".descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;\n";
-                out += "    descriptorWrites" + indexStr + ".descriptorCount = 1;\n";
-                out += "    descriptorWrites" + indexStr + ".pBufferInfo = &bufferInfo_" + ubos[i].def.name + ";\n";
-            }
-            out += "    vkUpdateDescriptorSets(target->device, " + std::to_string(texs.size() + ubos.size()) + ", descriptorWrites, 0, nullptr);\n";
-            out += "    output.clear();\n";
-            out += "    output.push_back(descriptorSet);\n";
-            out += "}\n";
+    VkDescriptorSetLayoutCreateInfo layoutInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+    layoutInfo.bindingCount = 1;
+    layoutInfo.pBindings = &binding;
+    if (vkCreateDescriptorSetLayout(target->device, &layoutInfo, nullptr, &pipeline.pushUniformLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create push uniform layout!");
+    }
+    //The descriptors never change, each frame's set points at that frame's ring and draws only pass an offset
+    sets.resize(COMMAND_BUFFER_COUNT);
+    for (uint32_t frame = 0; frame < COMMAND_BUFFER_COUNT; ++frame)
+    {
+        VkDescriptorSetAllocateInfo allocInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+        allocInfo.descriptorPool = target->descPools[VkDS_U];
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &pipeline.pushUniformLayout;
+        if (vkAllocateDescriptorSets(target->device, &allocInfo, &sets[frame]) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate push uniform set!");
         }
+        VkDescriptorBufferInfo bufferInfo = {};
+        bufferInfo.buffer = target->GetUniformRing(frame);
+        bufferInfo.range = range;
+
+        VkWriteDescriptorSet write = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+        write.dstSet = sets[frame];
+        write.dstBinding = 0;
+        write.descriptorCount = 1;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        write.pBufferInfo = &bufferInfo;
+        vkUpdateDescriptorSets(target->device, 1, &write, 0, nullptr);
+    }
+}
+)";
     }
     out += "void " + process.name + "_PopulatePipeline(VkRenderTarget* target, " + process.name + "_Pipeline_Collection& col)\n"
         "{\n";
+    bool pushLimitChecked = false;
+    if (process.pipelineLibrary)
+    {
+        out += "    if (col.optimizeThread.joinable())\n";
+        out += "        throw std::runtime_error(\"optimized pipelines are still pending, call " + process.name + "_SwapOptimizedPipelines before populating again!\");\n";
+    }
+    out += "    col.target = target;\n";
+    if (HasDeltaPush(process))
+        out += "    col.pushRecorder = &target->pushRecorder;\n";
+    if (process.sharedBuffers)
+        out += "    col.bindState = &target->bindState;\n";
+    if (process.bufferDeviceAddress)
+    {
+        out += "    if (!target->bufferDeviceAddress)\n";
+        out += "        throw std::runtime_error(\"" + process.name + " reads buffer device addresses, set bufferDeviceAddress on the render target before InitVulkan!\");\n";
+    }
+    for (auto& p : process.shaders)
+    {
+        if (p.pushUniform)
+        {
+            out += "    " + process.name + "_CreatePushUniformSets(target, col.pipelines[PIPELINE_" + process.name + "_" + p.name + "], col.pushUniformSets[PIPELINE_" +
+                process.name + "_" + p.name + "], " + GetPushStages(p) + ", sizeof(" + GetPushType(p) + "));\n";
+        }
+        else if (GetPushSize(process, p) > 128)
+        {
+            //Within the configured limit but over the guaranteed one
+            if (!pushLimitChecked)
+            {
+                out += "    VkPhysicalDeviceProperties properties;\n";
+                out += "    vkGetPhysicalDeviceProperties(target->physicalDevice, &properties);\n";
+                pushLimitChecked = true;
+            }
+            out += "    if (sizeof(" + GetPushType(p) + ") > properties.limits.maxPushConstantsSize)\n";
+            out += "        throw std::runtime_error(\"push constants of " + p.name + " are over maxPushConstantsSize, lower \\\"pushConstantLimit\\\"!\");\n";
+        }
+    }
+    for (auto& p : process.computes)
+    {
+        //Compute pipelines are the same on every graphics path
+        std::string data = "col.computes[COMPUTE_" + process.name + "_" + p.name + "]";
+        if (p.comp.texs.size() + p.comp.ubos.size() > 0)
+            out += "    " + process.name + "_Create" + p.name + "DescriptorSetLayout(target, " + data + ");\n";
+        out += "    " + process.name + "_Create" + p.name + "ComputePipeline(target, " + data + ");\n";
+    }
+    if (HasDepthOnly(process))
+    {
+        out += "    if (col.depthOnlyDefaults == VK_NULL_HANDLE)\n    {\n";
+        out += "        //Stride 0 source for the attributes depth only draws don't bind, large enough for a mat4\n";
+        out += "        float zeros[16] = {};\n";
+        out += "        VK::Buffer defaults;\n";
+        out += "        //Acquired by the next submission, which may already draw with it\n";
+        out += "        target->WaitUpload(VkBufferTools::CreateVertexBuffer(target, sizeof(zeros), zeros, defaults));\n";
+        out += "        col.depthOnlyDefaults = defaults.buffer;\n";
+        out += "        col.depthOnlyOffset = defaults.offset;\n";
+        out += "    }\n";
+    }
+    if (process.shaderObject)
+    {
+        out += "    if (target->shaderObject)\n    {\n";
+        out += GetPipelineLayoutSetupSource(process, "        ");
+        for (int o = 0; o < process.shaderObjects.size(); ++o)
+        {
+            out += "        " + process.name + "_CreateShaderObject" + std::to_string(o) + "(target, col.pipelines[PIPELINE_" + process.name + "_" +
+                process.shaders[process.shaderObjects[o].shader].name + "], col.shaderObjects[" + std::to_string(o) + "]);\n";
+        }
+        out += "        col.useShaderObjects = true;\n";
+        out += "        col.shaderState = &target->shaderState;\n";
+        out += "        return;\n";
+        out += "    }\n";
+    }
+    if (process.dynamicVertexInput)
+    {
+        out += "    if (!target->vertexInputDynamicState)\n";
+        out += "        throw std::runtime_error(\"VK_EXT_vertex_input_dynamic_state is not supported!\");\n";
+    }
+    if (process.pipelineLibrary)
+    {
+        out += "    if (target->graphicsPipelineLibrary)\n    {\n";
+        out += GetPipelineLayoutSetupSource(process, "        ");
+        for (int l = 0; l < process.libraries.size(); ++l)
+        {
+            out += "        " + process.name + "_CreatePipelineLibrary" + std::to_string(l) + "(target, col.pipelines[PIPELINE_" + process.name + "_" +
+                process.shaders[process.libraries[l].shader].name + "], col.libraries[" + std::to_string(l) + "]);\n";
+        }
+        for (auto& p : process.shaders)
+        {
+            out += "        " + GetPipelineLinkCall(process, p, false, "col.pipelines[PIPELINE_" + process.name + "_" + p.name + "].graphicsPipeline");
+        }
+        out += "        //Optimized link runs in the background, " + process.name + "_SwapOptimizedPipelines picks the results up\n";
+        out += "        col.optimizedReady = false;\n";
+        out += "        col.optimizeThread = std::thread([target, &col]() {\n";
+        for (auto& p : process.shaders)
+        {
+            out += "            " + GetPipelineLinkCall(process, p, true, "col.optimized[PIPELINE_" + process.name + "_" + p.name + "]");
+        }
+        out += "            col.optimizedReady = true;\n";
+        out += "        });\n";
+        out += "        return;\n";
+        out += "    }\n";
+    }
     for (auto& p : process.shaders)
     {
         //void vktest_PopulatePipeline(VkRenderTarget* target, vktest_Pipeline_Collection& col)
@@ -1009,42 +3408,85 @@ void PipelineImageDraw::UpdateDescriptorSets(VkRenderTarget* target, VK::Texture
         //}
         bool descSets = p.frag.texs.size() + p.frag.ubos.size() + p.vert.texs.size() + p.vert.ubos.size() > 0;
         if (descSets)
-            out += "    " + process.name + "_Create" + p.name + "DescriptorSetLayout(target, col.pipelines[PIPELINE_" + process.name + "_" + p.name + "]);\n";
-        out += "    " + process.name + "_Create" + p.name + "Pipeline(target, col.pipelines[PIPELINE_" + process.name + "_" + p.name + "]);\n";
+            out += "    " + process.name + "_Create" + GetGroupName(process, p) + "DescriptorSetLayout(target, col.pipelines[PIPELINE_" + process.name + "_" + p.name + "]);\n";
+        if (!OwnsPipeline(process, (int)(&p - &process.shaders[0])))
+        {
+            std::string owner = "col.pipelines[PIPELINE_" + process.name + "_" + process.shaders[p.pipelineOwner].name + "]";
+            out += "    col.pipelines[PIPELINE_" + process.name + "_" + p.name + "].pipelineLayout = " + owner + ".pipelineLayout;\n";
+            out += "    col.pipelines[PIPELINE_" + process.name + "_" + p.name + "].graphicsPipeline = " + owner + ".graphicsPipeline;\n";
+            continue;
+        }
+        if (IsLazyVariant(process, (int)(&p - &process.shaders[0])))
+            continue;
+        out += "    " + GetCreatePipelineCall(process, p, "target", "col.pipelines[PIPELINE_" + process.name + "_" + p.name + "]");
     }
     out += "}\n";
+    if (process.pipelineLibrary)
+    {
+        out += "bool " + process.name + "_SwapOptimizedPipelines(" + process.name + "_Pipeline_Collection& col)\n";
+        out += R"({
+    if (!col.optimizedReady)
+        return false;
+    if (col.optimizeThread.joinable())
+        col.optimizeThread.join();
+    for (int i = 0; i < PIPELINE_)" + process.name + R"(_MAX; ++i)
+    {
+        //The fast linked pipeline may still be referenced by frames in flight
+        col.target->PushSingleFramePipeline(col.pipelines[i].graphicsPipeline);
+        col.pipelines[i].graphicsPipeline = col.optimized[i];
+        col.optimized[i] = VK_NULL_HANDLE;
+    }
+    col.optimizedReady = false;
+    return true;
+}
+)";
+    }
 
     for (auto& shader : process.shaders)
     {
         bool descSets = shader.frag.texs.size() + shader.frag.ubos.size() + shader.vert.texs.size() + shader.vert.ubos.size() > 0;
         auto bindingDescIndexes = GetVertBindings(shader);
-        bool instanced = false;
-        for (auto bdi : bindingDescIndexes)
-        {
-            if (shader.vert.inputs[bdi.second].rate.compare("VK_VERTEX_INPUT_RATE_INSTANCE") == 0)
-            {
-                instanced = true;
-                break;
-            }
-        }
-        std::string pipeline = "pipeline.pipelines[PIPELINE_" + process.name + +"_" + shader.name + "]";
+        bool instanced = HasInstanceRate(shader, bindingDescIndexes);
+        //A variant group's combinations are drawn by one function indexing the entries from the group's first
+        if (!EmitsGroupFunctions(shader))
+            continue;
+        std::string entry = "PIPELINE_" + process.name + "_" + shader.name + (shader.variantGroup == -1 ? "" : " + variant");
+        std::string pipeline = "pipeline.pipelines[" + entry + "]";
+        std::string lazyCreate = GetLazyCreateSource(process, shader, pipeline, process.shaderObject ? "    " : "");
+        bool lazy = !lazyCreate.empty();
+        std::string statePreamble = GetStatePreambleSource(process, shader);
         //Draw Command
         for (int var = 0; var < 2; var++)
         {
             out += "\n\n";
             out += GetDrawFunctionName(process, shader, bindingDescIndexes, var == 1, instanced);
+            out += "\n{\n";
+            if (process.shaderObject)
+            {
+                out += "    if (pipeline.useShaderObjects)\n";
+                out += "        " + process.name + "_Bind" + GetVariantStem(process, shader) + "Shaders(pipeline, command" +
+                    (shader.variantGroup == -1 ? "" : ", variant") + ");\n";
+                out += lazy ? "    else\n    {\n" : "    else\n    ";
+            }
+            std::string indent = lazy && process.shaderObject ? "    " : "";
+            out += lazyCreate;
+            out += indent + "    pipeline.target->BindGraphicsPipeline(command, " + pipeline + ".graphicsPipeline);\n";
+            if (lazy && process.shaderObject)
+                out += "    }\n";
+            if (!statePreamble.empty())
+            {
+                //Shader objects already set every piece of state
+                out += process.shaderObject ? "    if (!pipeline.useShaderObjects)\n" : "    //State the pipeline leaves dynamic\n";
+                out += "    {\n" + statePreamble + "    }\n";
+            }
             out += R"(
-{
-    vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, )" + pipeline +
-                R"(.graphicsPipeline);
-
     VkBuffer vertexBuffers[] = { )";
             for (int bi = 0; bi < bindingDescIndexes.size(); ++bi)
             for (auto& inp : bindingDescIndexes)
             {
                 if (bi == inp.first)
                 {
-                    out += shader.vert.inputs[inp.second].name + ", ";
+                    out += IsDepthOnlyDefaults(shader, bi) ? "pipeline.depthOnlyDefaults, " : shader.vert.inputs[inp.second].name + ", ";
                     break;
                 }
             }
@@ -1055,92 +3497,94 @@ void PipelineImageDraw::UpdateDescriptorSets(VkRenderTarget* target, VK::Texture
             {
                 if (bi == inp.first)
                 {
-                    out += "offset_" + shader.vert.inputs[inp.second].name + ", ";
+                    out += IsDepthOnlyDefaults(shader, bi) ? "pipeline.depthOnlyOffset, " : "offset_" + shader.vert.inputs[inp.second].name + ", ";
                     break;
                 }
             }
             out += R"( };
 )";
-            if (!shader.vert.push.empty() && !shader.frag.push.empty())
+            if (shader.pushUniform)
+            {
+                out += "    //Over the push constant limit, the block is read from a slice of the frame's uniform ring\n";
+                out += "    VK::UniformSlice pushSlice = pipeline.target->AllocUniform(push, sizeof(" + GetPushType(shader) + "));\n";
+                out += "    vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, " + pipeline + ".pipelineLayout, " + std::to_string(shader.pushSet) +
+                    ", 1,\n        &pipeline.pushUniformSets[" + entry + "][pipeline.target->currentFrame], 1, &pushSlice.offset);\n";
+            }
+            else if (!shader.vert.push.empty() && !shader.frag.push.empty())
             {
                 if (shader.vert.push.compare(shader.frag.push) == 0)
                 {
-                    out += R"(    vkCmdPushConstants(
-        command,
-        )" + pipeline + R"(.pipelineLayout,
-        )" + shader.vert.pushStages + "|" + shader.frag.pushStages + R"(,
-        0,
-        sizeof()" + shader.vert.push + ")" + R"(,
-        push);
-)";
+                    out += GetPushCallSource(process, pipeline, shader.vert.pushStages + "|" + shader.frag.pushStages, "0", shader.vert.push, "push");
                 }
                 else
                 {
-                    out += R"(    vkCmdPushConstants(
-        command,
-        )" + pipeline + R"(.pipelineLayout,
-        )" + shader.vert.pushStages + R"(,
-        0,
-        sizeof()" + shader.vert.push + ")" + R"(,
-        push);
-)";
-                    out += R"(    vkCmdPushConstants(
-        command,
-        )" + pipeline + R"(.pipelineLayout,
-        )" + shader.frag.pushStages + R"(,
-        offsetof()" + shader.vert.push +"_"+shader.frag.push + R"(, frag),
-        sizeof()" + shader.frag.push + ")" + R"(,
-        &push->frag);
-)";
+                    out += GetPushCallSource(process, pipeline, shader.vert.pushStages, "0", shader.vert.push, "push");
+                    out += GetPushCallSource(process, pipeline, shader.frag.pushStages, "offsetof(" + shader.vert.push + "_" + shader.frag.push + ", frag)",
+                        shader.frag.push, "&push->frag");
                 }
             }
             else if (!shader.vert.push.empty())
             {
-                out += R"(    vkCmdPushConstants(
-        command,
-        )" + pipeline + R"(.pipelineLayout,
-        )" + shader.vert.pushStages + R"(,
-        0,
-        sizeof()" + shader.vert.push + ")" + R"(,
-        push);
-)";
+                out += GetPushCallSource(process, pipeline, shader.vert.pushStages, "0", shader.vert.push, "push");
             }
             else if (!shader.frag.push.empty())
             {
-                out += R"(    vkCmdPushConstants(
-        command,
-        )" + pipeline + R"(.pipelineLayout,
-        )" + shader.frag.pushStages + R"(,
-        0,
-        sizeof()" + shader.frag.push + ")" + R"(,
-        push);
-)";
+                out += GetPushCallSource(process, pipeline, shader.frag.pushStages, "0", shader.frag.push, "push");
             }
-            out += R"(
+            if (process.sharedBuffers)
+                out += GetSharedBindSource(bindingDescIndexes.size(), var == 1);
+            else
+            {
+                out += R"(
     vkCmdBindVertexBuffers(command, 0, )" + std::to_string(bindingDescIndexes.size()) + R"(, vertexBuffers, offsets);
 
 )";
-            if (var == 1)
-                out += "    vkCmdBindIndexBuffer(command, indexBuffer, 0, indexType);\n\n";
-            if (descSets)
+                if (var == 1)
+                    out += "    vkCmdBindIndexBuffer(command, indexBuffer, 0, indexType);\n\n";
+            }
+            auto dynamicUbos = GetDynamicUniforms(process, shader);
+            if (descSets && !dynamicUbos.empty())
+            {
+                out += "    uint32_t dynamicOffsets[] = { ";
+                for (auto& ubo : dynamicUbos)
+                    out += "uboOffset_" + ubo.name + ", ";
+                out += "};\n";
+                out += R"(    vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, 
+        )" + pipeline + R"(.pipelineLayout, 0, )" +
+                    std::string("static_cast<uint32_t>(sets.size()), sets.data()") +
+                    ", " + std::to_string(dynamicUbos.size()) + ", dynamicOffsets);\n\n";
+            }
+            else if (descSets && process.descriptorBuffer)
+                out += GetDescriptorBufferBindSource("VK_PIPELINE_BIND_POINT_GRAPHICS", pipeline) + "\n";
+            else if (descSets)
                 out += R"(    vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, 
         )" + pipeline + R"(.pipelineLayout, 0, )" +
                     std::string("static_cast<uint32_t>(sets.size()), sets.data()") +
                     ", 0, nullptr);\n\n";
+            std::string vertexOffset = process.sharedBuffers ? "vertexOffset" : "0";
             if (instanced)
             {
                 out += std::string(var == 0 ? "    vkCmdDraw(command, vertexCount, instanceCount, 0, 0); " :
-                    "    vkCmdDrawIndexed(command, indexCount, instanceCount, indexOffset, 0, 0);")
+                    "    vkCmdDrawIndexed(command, indexCount, instanceCount, indexOffset, " + vertexOffset + ", 0);")
                     + "\n}";
             }
             else
             {
                 out += std::string(var == 0 ? "    vkCmdDraw(command, vertexCount, 1, 0, 0); " :
-                    "    vkCmdDrawIndexed(command, indexCount, 1, indexOffset, 0, 0);")
+                    "    vkCmdDrawIndexed(command, indexCount, 1, indexOffset, " + vertexOffset + ", 0);")
                     + "\n}";
             }
         }
     }
+    for (auto& shader : process.shaders)
+    {
+        if (!EmitsGroupFunctions(shader))
+            continue;
+        if (HasVertexStruct(process, shader))
+            out += "\n" + GetPackVerticesSource(process, shader);
+        if (!shader.batch.empty())
+            out += "\n" + GetBatchSource(process, shader);
+    }
     //OutputDebugStringA(out.c_str());
     FILE* f = 0;
     std::string filename = baseFolder + process.name + "_shaderdef.cpp";
@@ -1165,9 +3609,132 @@ void HandleUBOOffset(std::string& output, int& currentOffset, int newOffset, int
         currentOffset = 0;
 }
 
-void AddStructToOutput(std::pair<const std::string, ShaderStruct>& s, std::string& output)
+//Components and C type of a non-struct member, matrices count their column padding
+int ExplicitComponents(const ShaderStructPart& part, std::string& ctype)
+{
+    ctype = "float";
+    int columnStride = part.matrixStride / 4;
+    switch (part.type)
+    {
+    case Binding::INT: ctype = "int"; return 1;
+    case Binding::IVEC2: ctype = "int"; return 2;
+    case Binding::IVEC3: ctype = "int"; return 3;
+    case Binding::IVEC4: ctype = "int"; return 4;
+    case Binding::UINT: ctype = "uint32_t"; return 1;
+    case Binding::UVEC2: ctype = "uint32_t"; return 2;
+    case Binding::UVEC3: ctype = "uint32_t"; return 3;
+    case Binding::UVEC4: ctype = "uint32_t"; return 4;
+    case Binding::ADDRESS: ctype = "VkDeviceAddress"; return 2;
+    case Binding::FLOAT: return 1;
+    case Binding::VEC2: return 2;
+    case Binding::VEC3: return 3;
+    case Binding::VEC4: return 4;
+    case Binding::MAT2: return 2 * (columnStride ? columnStride : 2);
+    case Binding::MAT3: return 3 * (columnStride ? columnStride : 4);
+    case Binding::MAT4: return 4 * (columnStride ? columnStride : 4);
+    default: return 0;
+    }
+}
+int ExplicitAlignment(ShaderProcess& process, const ShaderStructPart& part)
+{
+    if (part.type == Binding::STRUCT)
+    {
+        int align = 4;
+        for (auto& member : process.structs[part.structName].parts)
+            align = std::max(align, ExplicitAlignment(process, member));
+        return align;
+    }
+    std::string ctype;
+    int components = ExplicitComponents(part, ctype);
+    if (part.type == Binding::MAT2 || part.type == Binding::MAT3 || part.type == Binding::MAT4)
+        return part.matrixStride ? part.matrixStride : 16;
+    return components == 1 ? 4 : components == 2 ? 8 : 16;
+}
+int ExplicitSize(ShaderProcess& process, const ShaderStructPart& part);
+//std430 struct size: end of the last member rounded up to the struct's alignment
+int ExplicitStructSize(ShaderProcess& process, const std::string& name)
+{
+    ShaderStructPart whole = {};
+    whole.type = Binding::STRUCT;
+    whole.structName = name;
+    int end = 0;
+    for (auto& member : process.structs[name].parts)
+    {
+        if (member.count > 0)
+            end = std::max(end, member.offset + ExplicitSize(process, member));
+    }
+    int align = ExplicitAlignment(process, whole);
+    return (end + align - 1) / align * align;
+}
+int ExplicitSize(ShaderProcess& process, const ShaderStructPart& part)
+{
+    if (part.count > 1 && part.arrayStride)
+        return part.count * part.arrayStride;
+    if (part.type == Binding::STRUCT)
+        return ExplicitStructSize(process, part.structName) * part.count;
+    std::string ctype;
+    return ExplicitComponents(part, ctype) * 4 * part.count;
+}
+//Storage buffer structs follow the reflected offsets and strides, checked with static_asserts. A trailing
+//runtime array is left out of the struct, its offset and stride are emitted next to it instead.
+void AddExplicitStructToOutput(ShaderProcess& process, ShaderStruct& s, std::string& output)
+{
+    output += "struct " + s.name + " {\n";
+    std::string checks, runtime;
+    int cursor = 0, dummyCount = 0;
+    for (auto& p : s.parts)
+    {
+        int offset = p.offset < 0 ? cursor : p.offset;
+        if (p.count == 0)
+        {
+            ShaderStructPart element = p;
+            element.count = 1;
+            int stride = p.arrayStride ? p.arrayStride : ExplicitSize(process, element);
+            std::string prefix = s.name + "_" + p.name;
+            runtime += "//" + p.name + "[] follows the fixed members, size buffers with " + s.name + "_Size(count)\n";
+            runtime += "static const uint32_t " + prefix + "_Offset = " + std::to_string(offset) + ";\n";
+            runtime += "static const uint32_t " + prefix + "_Stride = " + std::to_string(stride) + ";\n";
+            runtime += "inline VkDeviceSize " + s.name + "_Size(uint32_t count) { return " + prefix + "_Offset + (VkDeviceSize)count * " + prefix + "_Stride; }\n";
+            if (p.type == Binding::STRUCT)
+                runtime += "static_assert(sizeof(" + p.structName + ") == " + prefix + "_Stride, \"" + p.structName + " does not match the std430 stride\");\n";
+            continue;
+        }
+        if (offset > cursor)
+            output += "    uint8_t dummy" + std::to_string(dummyCount++) + "[" + std::to_string(offset - cursor) + "];\n";
+        std::string arr = p.count > 1 ? "[" + std::to_string(p.count) + "]" : "";
+        if (p.type == Binding::STRUCT)
+            output += "    " + p.structName + " " + p.name + arr + ";\n";
+        else if (p.type == Binding::ADDRESS)
+            output += "    VkDeviceAddress " + p.name + arr + ";" + (p.pointee.empty() ? "" : " //" + p.pointee) + "\n";
+        else
+        {
+            std::string ctype;
+            int components = ExplicitComponents(p, ctype);
+            //Array elements padded by their stride, e.g. vec3 arrays, get the padding as extra lanes
+            if (p.count > 1 && p.arrayStride > components * 4)
+                components = p.arrayStride / 4;
+            output += "    " + ctype + " " + p.name + arr + "[" + std::to_string(components) + "];\n";
+        }
+        checks += "static_assert(offsetof(" + s.name + ", " + p.name + ") == " + std::to_string(offset) + ", \"" + s.name + "::" + p.name + " is not at its std430 offset\");\n";
+        cursor = offset + ExplicitSize(process, p);
+    }
+    if (runtime.empty())
+    {
+        int size = ExplicitStructSize(process, s.name);
+        if (size > cursor)
+            output += "    uint8_t dummy" + std::to_string(dummyCount++) + "[" + std::to_string(size - cursor) + "];\n";
+    }
+    output += "};\n" + checks + runtime;
+}
+
+void AddStructToOutput(ShaderProcess& process, std::pair<const std::string, ShaderStruct>& s, std::string& output)
 {
-    output += "struct " + s.second.name + " {\n";
+    if (s.second.explicitLayout)
+    {
+        AddExplicitStructToOutput(process, s.second, output);
+        return;
+    }
+    output += std::string("struct ") + (process.uniformWriters ? "alignas(16) " : "") + s.second.name + " {\n";
     int currOffset = 0, dummyCount = 0;
     for (auto& p : s.second.parts)
     {
@@ -1204,6 +3771,8 @@ void AddStructToOutput(std::pair<const std::string, ShaderStruct>& s, std::strin
             HandleUBOOffset(output, currOffset, 3 * p.count, dummyCount); output += "    uint32_t " + p.name + arr + "[3];"; break;
         case Binding::UVEC4:
             HandleUBOOffset(output, currOffset, 4, dummyCount); output += "    uint32_t " + p.name + arr + "[4];"; break;
+        case Binding::ADDRESS:
+            HandleUBOOffset(output, currOffset, 2 * p.count, dummyCount); output += "    VkDeviceAddress " + p.name + arr + ";"; break;
         case Binding::STRUCT:
         {
             HandleUBOOffset(output, currOffset, 4, dummyCount); output += "    " + p.structName + " " + p.name + arr + ";"; break;
@@ -1216,6 +3785,38 @@ void AddStructToOutput(std::pair<const std::string, ShaderStruct>& s, std::strin
     output += "};\n";
 }
 
+//Write<Struct> for every uniform and push block, for filling mapped (usually write-combined) buffer memory
+std::string GetUniformWriterSource(ShaderProcess& process)
+{
+    std::string out;
+    std::unordered_map<std::string, bool> added;
+    for (auto& shader : process.shaders)
+    {
+        std::vector<std::string> names = { shader.vert.push, shader.frag.push };
+        for (auto& ubo : shader.vert.ubos)
+        {
+            if (!ubo.storage)
+                names.push_back(ubo.structName);
+        }
+        for (auto& ubo : shader.frag.ubos)
+        {
+            if (!ubo.storage)
+                names.push_back(ubo.structName);
+        }
+        for (auto& name : names)
+        {
+            auto s = process.structs.find(name);
+            //Blocks holding device addresses keep their reflected layout instead of whole 16 byte blocks
+            if (name.empty() || added[name] || s == process.structs.end() || s->second.parts.empty() || s->second.explicitLayout)
+                continue;
+            added[name] = true;
+            out += "static_assert(sizeof(" + name + ") % 16 == 0, \"" + name + " must be whole 16 byte blocks\");\n";
+            out += "inline void Write" + name + "(void* mapped, const " + name + "& value) { VkUniformWrite::Stream(mapped, &value, sizeof(value)); }\n";
+        }
+    }
+    return out;
+}
+
 void HandleStructs(ShaderProcess& process, std::string& output)
 {
     std::unordered_map<std::string, int> addedStructs;
@@ -1243,7 +3844,7 @@ void HandleStructs(ShaderProcess& process, std::string& output)
         }
 
         addedStructs[s.first] = 1;
-        AddStructToOutput(s, output);
+        AddStructToOutput(process, s, output);
     }
 
     int lastSize = 0;
@@ -1272,16 +3873,82 @@ void HandleStructs(ShaderProcess& process, std::string& output)
                 continue;
 
             addedStructs[s.first] = 1;
-            AddStructToOutput(s, output);
+            AddStructToOutput(process, s, output);
             toAdd.erase(toAdd.begin() + i);
         }
     }
-    //Fallback to just adding the structs we couldn't figure out
-    for (auto& str : toAdd)
+    //Fallback to just adding the structs we couldn't figure out
+    for (auto& str : toAdd)
+    {
+        auto& s = *process.structs.find(str);
+        AddStructToOutput(process, s, output);
+    }
+}
+
+//Axis enums per declaring entry and an index macro per group, PIPELINE_<name>_<Group>_VARIANT(<axis option>, ...)
+std::string GetVariantEnumSource(ShaderProcess& process)
+{
+    std::string out;
+    std::vector<std::string> declared;
+    for (auto& group : process.variantGroups)
+    {
+        if (std::find(declared.begin(), declared.end(), group.owner) == declared.end())
+        {
+            declared.push_back(group.owner);
+            for (int a = 0; a < group.axes.size(); ++a)
+            {
+                std::string axis = process.name + "_" + group.owner + "_" + group.axes[a];
+                out += "enum " + axis + " {";
+                for (int o = 0; o < group.options[a].size(); ++o)
+                    out += std::string(o ? ", " : " ") + axis + "_" + group.options[a][o];
+                out += " };\n";
+            }
+        }
+        std::string params, index;
+        for (int a = 0; a < group.axes.size(); ++a)
+        {
+            params += (a ? ", " : "") + group.axes[a];
+            if (a == 0)
+                index = "(" + group.axes[a] + ")";
+            else
+                index = (a == 1 ? index : "(" + index + ")") + " * " + std::to_string(group.options[a].size()) + " + (" + group.axes[a] + ")";
+        }
+        out += "#define PIPELINE_" + process.name + "_" + group.name + "_VARIANT(" + params + ") ((" + process.name + "_Pipeline_Entry)(PIPELINE_" +
+            process.name + "_" + process.shaders[group.first].name + " + " + index + "))\n";
+    }
+    return out;
+}
+std::vector<unsigned char> ReadSpirvFile(const std::string& path)
+{
+    std::vector<unsigned char> code;
+    FILE* f = 0;
+    fopen_s(&f, path.c_str(), "rb");
+    if (!f)
+    {
+        printf("Could not open %s\n", path.c_str());
+        return code;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t fLen = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    code.resize(fLen);
+    fread(code.data(), fLen, 1, f);
+    fclose(f);
+    return code;
+}
+std::string GetSpirvArraySource(const std::string& array, const std::vector<unsigned char>& code)
+{
+    std::string out = "const unsigned char " + array + "[] = {\n";
+    for (int i = 0; i < code.size(); ++i)
     {
-        auto& s = *process.structs.find(str);
-        AddStructToOutput(s, output);
+        char tmp[10];
+        sprintf_s(tmp, "0x%x,", code[i]);
+        out += tmp;
+        if ((i & 0xF) == 0xF)
+            out += '\n';
     }
+    out += "\n};\n";
+    return out;
 }
 
 void OutputShaderHeader(ShaderProcess& process, std::string baseFolder)
@@ -1292,11 +3959,24 @@ void OutputShaderHeader(ShaderProcess& process, std::string baseFolder)
 
     output += "//THIS FILE WAS AUTO-GENERATED BY VKSHADERTOHEADER\n";
     output += "#pragma once\n";
+    if (process.pipelineLibrary)
+        output += "#include <atomic>\n#include <thread>\n";
+    bool offsets = false;
+    for (auto& p : process.shaders)
+        offsets |= HasVertexStruct(process, p) || !p.batch.empty();
+    for (auto& s : process.structs)
+        offsets |= s.second.explicitLayout;
+    if (offsets)
+        output += "#include <stddef.h>\n";
+    if (process.uniformWriters)
+        output += "#include \"VkUniformWrite.h\"\n";
     output += R"(#include <vector>
 #include "VkStructs.h"
 class VkRenderTarget;
 namespace VK { struct Texture; struct Buffer; })";
     output += "\n";
+    if (HasDeltaPush(process))
+        output += "class VkPushRecorder;\n";
 
     output += "enum " + process.name + "_Pipeline_Entry {\n";
     for (auto& p : process.shaders)
@@ -1305,9 +3985,64 @@ namespace VK { struct Texture; struct Buffer; })";
     }
     output += "    PIPELINE_" + process.name + "_MAX\n";
     output += "};\n";
+    if (!process.computes.empty())
+    {
+        output += "enum " + process.name + "_Compute_Entry {\n";
+        for (auto& p : process.computes)
+            output += "    COMPUTE_" + process.name + "_" + p.name + ",\n";
+        output += "    COMPUTE_" + process.name + "_MAX\n";
+        output += "};\n";
+    }
+    output += GetVariantEnumSource(process);
     output += "struct " + process.name + "_Pipeline_Collection {\n"
-        "    VKPipelineData pipelines[PIPELINE_" + process.name + "_MAX];\n"
-        "};\n";
+        "    VKPipelineData pipelines[PIPELINE_" + process.name + "_MAX];\n";
+    if (!process.computes.empty())
+        output += "    VKPipelineData computes[COMPUTE_" + process.name + "_MAX];\n";
+    if (process.pipelineLibrary)
+    {
+        output += "    VkPipeline libraries[" + std::to_string(process.libraries.size()) + "] = {};\n";
+        output += "    VkPipeline optimized[PIPELINE_" + process.name + "_MAX] = {};\n";
+        output += "    std::atomic<bool> optimizedReady{ false };\n";
+        output += "    std::thread optimizeThread;\n";
+        output += "    //The optimized link writes into the collection, so it has to finish first\n";
+        output += "    ~" + process.name + "_Pipeline_Collection() {\n";
+        output += "        if (optimizeThread.joinable())\n";
+        output += "            optimizeThread.join();\n";
+        output += "    }\n";
+    }
+    if (process.shaderObject)
+    {
+        output += "    VkShaderEXT shaderObjects[" + std::to_string(process.shaderObjects.size()) + "] = {};\n";
+        output += "    bool useShaderObjects = false;\n";
+        output += "    VKShaderObjectState* shaderState = nullptr;\n";
+    }
+    if (HasDepthOnly(process))
+    {
+        output += "    VkBuffer depthOnlyDefaults = VK_NULL_HANDLE;\n";
+        output += "    //Where the zeros start, when the render target sub-allocates vertex buffers\n";
+        output += "    VkDeviceSize depthOnlyOffset = 0;\n";
+    }
+    if (process.sharedBuffers)
+        output += "    VKBufferBindState* bindState = nullptr;\n";
+    if (HasPushUniforms(process))
+        output += "    //Promoted push blocks: ring slices are allocated from target, one set per frame in flight\n";
+    else if (HasLazyVariants(process) || process.descriptorBuffer || process.pipelineLibrary)
+    {
+        if (HasLazyVariants(process))
+            output += "    //Lazy variants are created from target on their first draw\n";
+        if (process.descriptorBuffer)
+            output += "    //Draws bind from target's descriptor buffer when it has one\n";
+        if (process.pipelineLibrary)
+            output += "    //Swapped out fast linked pipelines are destroyed through target once no frame uses them\n";
+    }
+    else
+        output += "    //Draws bind their pipelines through target, which tracks the shader object state they replace\n";
+    output += "    VkRenderTarget* target = nullptr;\n";
+    if (HasPushUniforms(process))
+        output += "    std::vector<VkDescriptorSet> pushUniformSets[PIPELINE_" + process.name + "_MAX];\n";
+    if (HasDeltaPush(process))
+        output += "    VkPushRecorder* pushRecorder = nullptr;\n";
+    output += "};\n";
 
     HandleStructs(process, output);
     for (auto& p : process.shaders)
@@ -1323,19 +4058,21 @@ namespace VK { struct Texture; struct Buffer; })";
             }
         }
     }
+    if (process.uniformWriters)
+        output += GetUniformWriterSource(process);
+
+    for (auto& p : process.shaders)
+    {
+        if (HasVertexStruct(process, p) && EmitsGroupFunctions(p))
+            output += GetVertexStructs(process, p) + GetPackVerticesName(process, p) + ";\n";
+    }
 
     for (auto& p : process.shaders)
     {
+        if (!EmitsGroupFunctions(p))
+            continue;
         auto bindingIndexes = GetVertBindings(p);
-        bool instanced = false;
-        for (auto bdi : bindingIndexes)
-        {
-            if (p.vert.inputs[bdi.second].rate.compare("VK_VERTEX_INPUT_RATE_INSTANCE") == 0)
-            {
-                instanced = true;
-                break;
-            }
-        }
+        bool instanced = HasInstanceRate(p, bindingIndexes);
         for (int var = 0; var < 2; ++var)
             output += GetDrawFunctionName(process, p, bindingIndexes, var == 0, instanced) + ";\n";
         std::vector<StagesDef<TextureDef>> texs = BuildStages(p.vert.texs, p.frag.texs);
@@ -1343,84 +4080,318 @@ namespace VK { struct Texture; struct Buffer; })";
         if (texs.size() + ubos.size() > 0)
             output += GetDescSetFunctionName(process, p, ubos, texs) + ";\n";
     }
+    for (auto& p : process.computes)
+    {
+        output += "static const uint32_t " + process.name + "_" + p.name + "_LocalSize[3] = { " + std::to_string(p.comp.localSize[0]) + ", " +
+            std::to_string(p.comp.localSize[1]) + ", " + std::to_string(p.comp.localSize[2]) + " };\n";
+        std::vector<StagesDef<TextureDef>> texs = GetTextureStages(p);
+        std::vector<StagesDef<UniformDef>> ubos = GetBufferStages(p);
+        if (texs.size() + ubos.size() > 0)
+            output += GetDescSetFunctionName(process, p, ubos, texs) + ";\n";
+        output += GetDispatchFunctionName(process, p, false) + ";\n";
+        output += GetDispatchFunctionName(process, p, true) + ";\n";
+    }
     output += "void " + process.name + "_PopulatePipeline(VkRenderTarget* target, " + process.name + "_Pipeline_Collection& col);\n";
+    if (process.pipelineLibrary)
+        output += "bool " + process.name + "_SwapOptimizedPipelines(" + process.name + "_Pipeline_Collection& col);\n";
+    for (auto& p : process.shaders)
+    {
+        if (!p.batch.empty() && EmitsGroupFunctions(p))
+            output += GetBatchStruct(process, p);
+    }
 
     for (auto& p : process.shaders)
     {
-        std::string name;
-        name = p.frag.name;
-        if (!dumped[name])
+        for (auto* name : { &p.frag.name, &p.vert.name })
         {
-            dumped[name] = true;
-            FILE* f = 0;
-            auto err = fopen_s(&f, (baseFolder + "/" + name + ".spv").c_str(), "rb");
-            fseek(f, 0, SEEK_END);
-            size_t fLen = ftell(f);
-            fseek(f, 0, SEEK_SET);
-            std::vector<unsigned char> fileBuf;
-            fileBuf.resize(fLen);
-            fread(fileBuf.data(), fLen, 1, f);
-            fclose(f);
-            for (size_t charPos = name.find_first_of("./\\"); charPos != std::string::npos; charPos = name.find_first_of("./\\"))
-            {
-                name[charPos] = '_';
-            }
-            for (size_t charPos = name.find("__"); charPos != std::string::npos; charPos = name.find_first_of("__"))
-            {
-                name.erase(name.begin() + charPos);
-            }
-            output += "const unsigned char " + process.name + "_" + name + "[] = {\n";
-            for (int i = 0; i < fileBuf.size(); ++i)
-            {
-                char tmp[16];
-                sprintf_s(tmp, "0x%x,", fileBuf[i]);
-                output += tmp;
-                if ((i & 0xF) == 0xF)
-                    output += '\n';
-            }
-            output += "\n};\n";
+            if (dumped[*name])
+                continue;
+            dumped[*name] = true;
+            output += GetSpirvArraySource(GetShaderArray(process.name, *name), ReadSpirvFile(baseFolder + "/" + *name + ".spv"));
+        }
+    }
+    for (auto& p : process.computes)
+    {
+        if (dumped[p.comp.name])
+            continue;
+        dumped[p.comp.name] = true;
+        output += GetSpirvArraySource(GetShaderArray(process.name, p.comp.name), ReadSpirvFile(baseFolder + "/" + p.comp.name + ".spv"));
+    }
+    for (auto& module : process.pushUniformSpirv)
+        output += GetSpirvArraySource(module.first, module.second);
+    FILE* f = 0;
+    std::string filename = baseFolder + process.name + "_shaderdef.h";
+    fopen_s(&f, filename.c_str(), "wb");
+    fwrite(output.c_str(), 1, output.size(), f);
+    fclose(f);
+}
+
+//Fixed function state of a shader entry, also applied on top of a copy for each "variants" option
+template<class Node>
+void ReadShaderState(const Node& ynode, ShaderDef& def)
+{
+    if (ynode.has_child("stencil"))
+    {
+        def.stencil.active = true;
+        const auto& sten = ynode["stencil"];
+        if (sten.has_child("compareMask"))
+            sten["compareMask"] >> def.stencil.compareMask;
+        else
+            def.stencil.compareMask = "0xffffffff";
+        if (sten.has_child("writeMask"))
+            sten["writeMask"] >> def.stencil.writeMask;
+        else
+            def.stencil.writeMask = "0xffffffff";
+        if (sten.has_child("reference"))
+            sten["reference"] >> def.stencil.reference;
+        else
+            def.stencil.reference = "1";
+        if (sten.has_child("compareOp"))
+            sten["compareOp"] >> def.stencil.compareOp;
+        else
+            def.stencil.compareOp = "VK_COMPARE_OP_LESS_OR_EQUAL";
+        if (sten.has_child("failOp"))
+            sten["failOp"] >> def.stencil.failOp;
+        else
+            def.stencil.failOp = "VK_STENCIL_OP_KEEP";
+        if (sten.has_child("depthFailOp"))
+            sten["depthFailOp"] >> def.stencil.depthFailOp;
+        else
+            def.stencil.depthFailOp = "VK_STENCIL_OP_KEEP";
+        if (sten.has_child("passOp"))
+            sten["passOp"] >> def.stencil.passOp;
+        else
+            def.stencil.passOp = "VK_STENCIL_OP_REPLACE";
+    }
+    if (ynode.has_child("blend"))
+    {
+        const auto& blend = ynode["blend"];
+        if (blend.has_child("blendEnable")) blend["blendEnable"] >> def.blend.blendEnable;
+        if (blend.has_child("colorWriteMask")) blend["colorWriteMask"] >> def.blend.colorWriteMask;
+        if (blend.has_child("srcColorBlendFactor")) blend["srcColorBlendFactor"] >> def.blend.srcColorBlendFactor;
+        if (blend.has_child("dstColorBlendFactor")) blend["dstColorBlendFactor"] >> def.blend.dstColorBlendFactor;
+        if (blend.has_child("colorBlendOp")) blend["colorBlendOp"] >> def.blend.colorBlendOp;
+        if (blend.has_child("srcAlphaBlendFactor")) blend["srcAlphaBlendFactor"] >> def.blend.srcAlphaBlendFactor;
+        if (blend.has_child("dstAlphaBlendFactor")) blend["dstAlphaBlendFactor"] >> def.blend.dstAlphaBlendFactor;
+        if (blend.has_child("alphaBlendOp")) blend["alphaBlendOp"] >> def.blend.alphaBlendOp;
+    }
+    if (ynode.has_child("topo"))
+    {
+        ynode["topo"] >> def.topo;
+        if (_strcmpi(def.topo.c_str(), "tri") == 0)
+            def.topo = "VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST";
+        else if (_strcmpi(def.topo.c_str(), "triStrip") == 0)
+            def.topo = "VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP";
+        else if (_strcmpi(def.topo.c_str(), "triFan") == 0)
+            def.topo = "VK_PRIMITIVE_TOPOLOGY_TRIANGLE_FAN";
+    }
+    if (ynode.has_child("depth"))
+    {
+        ynode["depth"] >> def.depth;
+        def.depthWrite = true;
+        if (ynode.has_child("depthWrite"))
+        {
+            std::string dpWr;
+            ynode["depthWrite"] >> dpWr;
+            def.depthWrite = ParseBool(dpWr);
         }
 
-        name = p.vert.name;
-        if (!dumped[name])
+        if (_strcmpi(def.depth.data(), "less") == 0)
         {
-            dumped[name] = true;
-            FILE* f = 0;
-            auto err = fopen_s(&f, (baseFolder + "/" + name + ".spv").c_str(), "rb");
-            fseek(f, 0, SEEK_END);
-            size_t fLen = ftell(f);
-            fseek(f, 0, SEEK_SET);
-            std::vector<unsigned char> fileBuf;
-            fileBuf.resize(fLen);
-            fread(fileBuf.data(), fLen, 1, f);
-            fclose(f);
-            for (size_t charPos = name.find_first_of("./\\"); charPos != std::string::npos; charPos = name.find_first_of("./\\"))
+            def.depth = "VK_COMPARE_OP_LESS";
+        }
+        else if (_strcmpi(def.depth.data(), "lessEq") == 0) //VK_COMPARE_OP_LESS_OR_EQUAL
+        {
+            def.depth = "VK_COMPARE_OP_LESS_OR_EQUAL";
+        }
+        else if (_strcmpi(def.depth.data(), "never") == 0 || 
+            _strcmpi(def.depth.data(), "none") == 0 || 
+            _strcmpi(def.depth.data(), "VK_COMPARE_OP_NEVER") == 0)
+        {
+            def.depth = "";
+        }
+    }
+    else if (ynode.has_child("depthWrite"))
+    {
+        std::string dpWr;
+        ynode["depthWrite"] >> dpWr;
+        def.depthWrite = ParseBool(dpWr);
+    }
+    //cullMode = "VK_CULL_MODE_NONE", frontFace = "VK_FRONT_FACE_COUNTER_CLOCKWISE";
+    if (ynode.has_child("cullMode"))
+        ynode["cullMode"] >> def.cullMode;
+    if (ynode.has_child("frontFace"))
+        ynode["frontFace"] >> def.frontFace;
+    if (ynode.has_child("depthBias"))
+    {
+        const auto& db = ynode["depthBias"];
+        def.depthBias.enabled = true;
+        if (db.has_child("depthBiasConstantFactor"))
+            db["depthBiasConstantFactor"] >> def.depthBias.depthBiasConstantFactor;
+        if (db.has_child("depthBiasClamp"))
+            db["depthBiasClamp"] >> def.depthBias.depthBiasClamp;
+        else
+            def.depthBias.depthBiasClamp = "-1.0";
+        if (db.has_child("depthBiasSlopeFactor"))
+            db["depthBiasSlopeFactor"] >> def.depthBias.depthBiasSlopeFactor;
+    }
+}
+//Named variant from "specialization": { "<Variant>": { "<constant>": "<value>" } }, built as <Shader>_<Variant>
+ShaderDef MakeSpecializationVariant(ShaderDef& shader, const std::string& variant, const std::vector<std::pair<std::string, std::string>>& values)
+{
+    ShaderDef spec = shader;
+    spec.name += "_" + variant;
+    for (auto& value : values)
+    {
+        bool found = false;
+        for (auto* specs : { &shader.vert.specs, &shader.frag.specs, &shader.comp.specs })
+        {
+            for (auto& constant : *specs)
             {
-                name[charPos] = '_';
+                if (constant.name != value.first)
+                    continue;
+                if (GetSpecConstantType(constant.type).empty())
+                    printf("Specialization constant %s has unsupported type %s\n", constant.name.c_str(), constant.type.c_str());
+                else
+                    found = true;
             }
-            for (size_t charPos = name.find("__"); charPos != std::string::npos; charPos = name.find_first_of("__"))
+        }
+        if (!found)
+        {
+            printf("Variant %s sets %s, which is not a specialization constant of its shaders\n", spec.name.c_str(), value.first.c_str());
+            continue;
+        }
+        spec.specValues.push_back(value);
+        for (int i = 0; i < 3; ++i)
+        {
+            for (auto& constant : shader.comp.specs)
             {
-                name.erase(name.begin() + charPos);
+                if (constant.id == shader.comp.localSizeSpec[i] && constant.name == value.first)
+                    spec.comp.localSize[i] = std::stoi(value.second);
             }
-            output += "const unsigned char " + process.name + "_" + name + "[] = {\n";
-            for (int i = 0; i < fileBuf.size(); ++i)
+        }
+    }
+    return spec;
+}
+template<class Node>
+std::vector<ShaderDef> ReadSpecializationVariants(const Node& yshader, ShaderDef& def)
+{
+    std::vector<ShaderDef> variants = { def };
+    if (!yshader.has_child("specialization"))
+        return variants;
+    for (const auto& yvariant : yshader["specialization"])
+    {
+        std::vector<std::pair<std::string, std::string>> values;
+        for (const auto& yvalue : yvariant)
+        {
+            std::string value;
+            yvalue >> value;
+            values.push_back({ std::string(yvalue.key().str, yvalue.key().len), value });
+        }
+        variants.push_back(MakeSpecializationVariant(def, std::string(yvariant.key().str, yvariant.key().len), values));
+    }
+    return variants;
+}
+//Product of the "variants" axes, { "<Axis>": { "<Option>": { <entry state> } } }, each combination named
+//<Shader>_<Option>_<Option>... with its options' state applied on top of the entry's
+template<class Node>
+std::vector<ShaderDef> ExpandStateVariants(const Node& yshader, ShaderDef& def, VariantGroup& group)
+{
+    group.name = def.name;
+    if (!yshader.has_child("variants"))
+        return { def };
+    for (const auto& yaxis : yshader["variants"])
+    {
+        if (yaxis.num_children() == 0)
+        {
+            printf("Variant axis %s of %s has no options\n", std::string(yaxis.key().str, yaxis.key().len).c_str(), def.name.c_str());
+            continue;
+        }
+        group.axes.push_back(std::string(yaxis.key().str, yaxis.key().len));
+        group.options.push_back({});
+        for (const auto& yoption : yaxis)
+            group.options.back().push_back(std::string(yoption.key().str, yoption.key().len));
+    }
+    group.count = 1;
+    for (auto& options : group.options)
+        group.count *= (int)options.size();
+
+    std::vector<ShaderDef> combinations;
+    for (int c = 0; c < group.count; ++c)
+    {
+        std::vector<int> option(group.axes.size());
+        for (int a = (int)group.axes.size() - 1, rest = c; a >= 0; --a)
+        {
+            option[a] = rest % (int)group.options[a].size();
+            rest /= (int)group.options[a].size();
+        }
+        ShaderDef combination = def;
+        int a = 0;
+        for (const auto& yaxis : yshader["variants"])
+        {
+            if (yaxis.num_children() == 0)
+                continue;
+            int o = 0;
+            for (const auto& yoption : yaxis)
             {
-                char tmp[10];
-                sprintf_s(tmp, "0x%x,", fileBuf[i]);
-                output += tmp;
-                if ((i & 0xF) == 0xF)
-                    output += '\n';
+                if (o++ == option[a])
+                    ReadShaderState(yoption, combination);
             }
-            output += "\n};\n";
+            combination.name += "_" + group.options[a][option[a]];
+            ++a;
         }
+        combinations.push_back(combination);
     }
-    FILE* f = 0;
-    std::string filename = baseFolder + process.name + "_shaderdef.h";
-    fopen_s(&f, filename.c_str(), "wb");
-    fwrite(output.c_str(), 1, output.size(), f);
-    fclose(f);
+    return combinations;
+}
+void AddVariantGroup(ShaderProcess& process, VariantGroup& group, std::vector<ShaderDef>& combinations)
+{
+    if (!group.axes.empty())
+    {
+        group.first = (int)process.shaders.size();
+        group.count = (int)combinations.size();
+        for (int c = 0; c < combinations.size(); ++c)
+        {
+            combinations[c].variantGroup = (int)process.variantGroups.size();
+            combinations[c].variantIndex = c;
+        }
+        process.variantGroups.push_back(group);
+    }
+    for (auto& combination : combinations)
+        process.shaders.push_back(combination);
 }
+//Position only copy of an entry for depth prepasses and shadows. The vertex shader still declares the other
+//inputs, so they read a stride 0 binding instead of the full vertex
+ShaderDef MakeDepthOnlyVariant(ShaderDef& shader, bool keepFragment)
+{
+    ShaderDef depth = shader;
+    depth.name += "_DepthOnly";
+    depth.depthOnly = true;
+    depth.noFragment = !keepFragment;
+    depth.blend.blendEnable = "VK_FALSE";
+    depth.blend.colorWriteMask = "0";
+    depth.vert.generatedLayout = false;
+    depth.vert.split.clear();
+    depth.batch.clear();
 
+    BindingDef* position = nullptr;
+    for (BindingDef* input : GetInputsByLocation(depth))
+    {
+        if (shader.vert.split.empty() ? position == nullptr : input->name == shader.vert.split)
+            position = input;
+    }
+    for (auto& input : depth.vert.inputs)
+    {
+        input.binding = &input == position ? 0 : 1;
+        input.rate = "VK_VERTEX_INPUT_RATE_VERTEX";
+        if (&input != position)
+        {
+            input.offset = "0";
+            input.stride = "0";
+        }
+    }
+    return depth;
+}
 void Shader2Header(std::string baseFolder)
 {
     //std::string baseFolder = "shaders\\";
@@ -1464,11 +4435,93 @@ void Shader2Header(std::string baseFolder)
     {
         process.name = "Shader2Header";
     }
+    if (doc.has_child(doc.root_id(), "pipelineLibrary"))
+    {
+        std::string opt;
+        doc["pipelineLibrary"] >> opt;
+        process.pipelineLibrary = ParseBool(opt);
+    }
+    if (doc.has_child(doc.root_id(), "shaderObject"))
+    {
+        std::string opt;
+        doc["shaderObject"] >> opt;
+        process.shaderObject = ParseBool(opt);
+    }
+    if (doc.has_child(doc.root_id(), "collapseDynamicState"))
+    {
+        std::string opt;
+        doc["collapseDynamicState"] >> opt;
+        process.collapseDynamicState = ParseBool(opt);
+    }
+    if (doc.has_child(doc.root_id(), "dynamicVertexInput"))
+    {
+        std::string opt;
+        doc["dynamicVertexInput"] >> opt;
+        process.dynamicVertexInput = ParseBool(opt);
+    }
+    if (doc.has_child(doc.root_id(), "dynamicRendering"))
+    {
+        std::string opt;
+        doc["dynamicRendering"] >> opt;
+        process.dynamicRendering = ParseBool(opt);
+    }
+    if (doc.has_child(doc.root_id(), "vertexStructs"))
+    {
+        std::string opt;
+        doc["vertexStructs"] >> opt;
+        process.vertexStructs = ParseBool(opt);
+    }
+    if (doc.has_child(doc.root_id(), "dynamicUniforms"))
+    {
+        std::string opt;
+        doc["dynamicUniforms"] >> opt;
+        process.dynamicUniforms = ParseBool(opt);
+    }
+    if (doc.has_child(doc.root_id(), "pushConstantLimit"))
+        doc["pushConstantLimit"] >> process.pushConstantLimit;
+    if (doc.has_child(doc.root_id(), "uniformWriters"))
+    {
+        std::string opt;
+        doc["uniformWriters"] >> opt;
+        process.uniformWriters = ParseBool(opt);
+    }
+    if (doc.has_child(doc.root_id(), "deltaPushConstants"))
+    {
+        std::string opt;
+        doc["deltaPushConstants"] >> opt;
+        process.deltaPushConstants = ParseBool(opt);
+    }
+    if (doc.has_child(doc.root_id(), "descriptorBuffer"))
+    {
+        std::string opt;
+        doc["descriptorBuffer"] >> opt;
+        process.descriptorBuffer = ParseBool(opt);
+    }
+    if (doc.has_child(doc.root_id(), "bufferDeviceAddress"))
+    {
+        std::string opt;
+        doc["bufferDeviceAddress"] >> opt;
+        process.bufferDeviceAddress = ParseBool(opt);
+    }
+    if (doc.has_child(doc.root_id(), "sharedBuffers"))
+    {
+        std::string opt;
+        doc["sharedBuffers"] >> opt;
+        process.sharedBuffers = ParseBool(opt);
+    }
 
     for (const auto& yshader : doc["shaders"])
     {
         ShaderDef def = {};
         yshader["name"] >> def.name;
+        if (yshader.has_child("comp"))
+        {
+            yshader["comp"]["name"] >> def.comp.name;
+            ReadCompJson(baseFolder + def.comp.name, process, def);
+            for (auto& variant : ReadSpecializationVariants(yshader, def))
+                process.computes.push_back(variant);
+            continue;
+        }
         if (yshader.has_child("dynamic"))
         {
             for (const auto& d : yshader["dynamic"])
@@ -1478,108 +4531,8 @@ void Shader2Header(std::string baseFolder)
                 def.dynamicStates.push_back(dyn);
             }
         }
-        if (yshader.has_child("stencil"))
-        {
-            def.stencil.active = true;
-            const auto& sten = yshader["stencil"];
-            if (sten.has_child("compareMask"))
-                sten["compareMask"] >> def.stencil.compareMask;
-            else
-                def.stencil.compareMask = "0xffffffff";
-            if (sten.has_child("writeMask"))
-                sten["writeMask"] >> def.stencil.writeMask;
-            else
-                def.stencil.writeMask = "0xffffffff";
-            if (sten.has_child("reference"))
-                sten["reference"] >> def.stencil.reference;
-            else
-                def.stencil.reference = "1";
-            if (sten.has_child("compareOp"))
-                sten["compareOp"] >> def.stencil.compareOp;
-            else
-                def.stencil.compareOp = "VK_COMPARE_OP_LESS_OR_EQUAL";
-            if (sten.has_child("failOp"))
-                sten["failOp"] >> def.stencil.failOp;
-            else
-                def.stencil.failOp = "VK_STENCIL_OP_KEEP";
-            if (sten.has_child("depthFailOp"))
-                sten["depthFailOp"] >> def.stencil.depthFailOp;
-            else
-                def.stencil.depthFailOp = "VK_STENCIL_OP_KEEP";
-            if (sten.has_child("passOp"))
-                sten["passOp"] >> def.stencil.passOp;
-            else
-                def.stencil.passOp = "VK_STENCIL_OP_REPLACE";
-        }
-        if (yshader.has_child("blend"))
-        {
-            const auto& blend = yshader["blend"];
-            if (blend.has_child("blendEnable")) blend["blendEnable"] >> def.blend.blendEnable;
-            if (blend.has_child("colorWriteMask")) blend["colorWriteMask"] >> def.blend.colorWriteMask;
-            if (blend.has_child("srcColorBlendFactor")) blend["srcColorBlendFactor"] >> def.blend.srcColorBlendFactor;
-            if (blend.has_child("dstColorBlendFactor")) blend["dstColorBlendFactor"] >> def.blend.dstColorBlendFactor;
-            if (blend.has_child("colorBlendOp")) blend["colorBlendOp"] >> def.blend.colorBlendOp;
-            if (blend.has_child("srcAlphaBlendFactor")) blend["srcAlphaBlendFactor"] >> def.blend.srcAlphaBlendFactor;
-            if (blend.has_child("dstAlphaBlendFactor")) blend["dstAlphaBlendFactor"] >> def.blend.dstAlphaBlendFactor;
-            if (blend.has_child("alphaBlendOp")) blend["alphaBlendOp"] >> def.blend.alphaBlendOp;
-        }
-        if (yshader.has_child("topo"))
-        {
-            yshader["topo"] >> def.topo;
-            if (_strcmpi(def.topo.c_str(), "tri") == 0)
-                def.topo = "VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST";
-            else if (_strcmpi(def.topo.c_str(), "triStrip") == 0)
-                def.topo = "VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP";
-            else if (_strcmpi(def.topo.c_str(), "triFan") == 0)
-                def.topo = "VK_PRIMITIVE_TOPOLOGY_TRIANGLE_FAN";
-        }
-        else
-            def.topo = "VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST";
-        if (yshader.has_child("depth"))
-        {
-            yshader["depth"] >> def.depth;
-            def.depthWrite = true;
-            if (yshader.has_child("depthWrite"))
-            {
-                std::string dpWr;
-                yshader["depthWrite"] >> dpWr;
-                if (_strcmpi(dpWr.data(), "VK_FALSE") == 0 || _strcmpi(dpWr.data(), "false") == 0 || _strcmpi(dpWr.data(), "0") == 0)
-                    def.depthWrite = false;
-            }
-
-            if (_strcmpi(def.depth.data(), "less") == 0)
-            {
-                def.depth = "VK_COMPARE_OP_LESS";
-            }
-            else if (_strcmpi(def.depth.data(), "lessEq") == 0) //VK_COMPARE_OP_LESS_OR_EQUAL
-            {
-                def.depth = "VK_COMPARE_OP_LESS_OR_EQUAL";
-            }
-            else if (_strcmpi(def.depth.data(), "never") == 0 || 
-                _strcmpi(def.depth.data(), "none") == 0 || 
-                _strcmpi(def.depth.data(), "VK_COMPARE_OP_NEVER") == 0)
-            {
-                def.depth = "";
-            }
-        }
-        //cullMode = "VK_CULL_MODE_NONE", frontFace = "VK_FRONT_FACE_COUNTER_CLOCKWISE";
-        if (yshader.has_child("cullMode"))
-            yshader["cullMode"] >> def.cullMode;
-        if (yshader.has_child("frontFace"))
-            yshader["frontFace"] >> def.frontFace;
-        if (yshader.has_child("depthBias"))
-        {
-            const auto& db = yshader["depthBias"];
-            def.depthBias.enabled = true;
-            if (db.has_child("depthBiasConstantFactor"))
-                db["depthBiasConstantFactor"] >> def.depthBias.depthBiasConstantFactor;
-            if (db.has_child("depthBiasClamp"))
-                db["depthBiasClamp"] >> def.depthBias.depthBiasClamp;
-            else
-                def.depthBias.depthBiasClamp = "-1.0";
-            if (db.has_child("depthBiasSlopeFactor"))
-                db["depthBiasSlopeFactor"] >> def.depthBias.depthBiasSlopeFactor;
-        }
+        def.topo = "VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST";
+        ReadShaderState(yshader, def);
         if (yshader.has_child("vert"))
         {
             std::string vertFile;
@@ -1587,12 +4540,24 @@ void Shader2Header(std::string baseFolder)
             def.vert.name = vertFile;
             ReadVertJson(baseFolder + vertFile, process, def);
             auto inputs = yshader["vert"]["inputs"];
+            bool explicitLayout = false;
+            std::vector<std::string> listed;
             for (const auto& yvert : inputs.cchildren())
             {
+                listed.push_back(std::string(yvert.key().str, yvert.key().len));
+                //Entries that only ask for packing keep the generated interleaved layout
+                explicitLayout |= yvert.has_child("offset") || yvert.has_child("stride") || yvert.has_child("binding") ||
+                    yvert.has_child("rate") || yvert.has_child("format");
                 for (auto& input : def.vert.inputs)
                 {
                     if (input.name == yvert.key())
                     {
+                        if (yvert.has_child("packed"))
+                        {
+                            yvert["packed"] >> input.packed;
+                            if (!ApplyPacking(input))
+                                input.packed.clear();
+                        }
                         if (yvert.has_child("offset"))
                             yvert["offset"] >> input.offset;
                         else
@@ -1600,7 +4565,7 @@ void Shader2Header(std::string baseFolder)
                         if (yvert.has_child("stride"))
                             yvert["stride"] >> input.stride;
                         else
-                            input.stride = BindingToStride(input.type);
+                            input.stride = input.packed.empty() ? BindingToStride(input.type) : std::to_string(InputSize(input));
                         if (yvert.has_child("binding"))
                             yvert["binding"] >> input.binding;
                         else
@@ -1626,29 +4591,86 @@ void Shader2Header(std::string baseFolder)
                     }
                 }
             }
-            if (inputs.num_children() == 0)
+            if (yshader.has_child("batch"))
             {
-                int valueCount = 0;
-                std::vector<int> sizeOf;
-                sizeOf.resize(def.vert.inputs.size());
+                //Inputs named after a member of the batch struct and not given a layout become per instance
+                yshader["batch"] >> def.batch;
+                auto found = process.structs.find(def.batch);
+                int batched = 0;
+                if (found == process.structs.end())
+                    printf("Batch struct %s not found for %s\n", def.batch.c_str(), def.name.c_str());
                 for (auto& input : def.vert.inputs)
                 {
-                    if (sizeOf.size() <= input.loc)
-                        sizeOf.resize(input.loc + 1);
-                    sizeOf[input.loc] = BindingToStrideI(input.type) / 4;
-                    valueCount += sizeOf[input.loc];
+                    if (found == process.structs.end() || std::find(listed.begin(), listed.end(), input.name) != listed.end())
+                        continue;
+                    for (auto& part : found->second.parts)
+                    {
+                        if (part.name != input.name)
+                            continue;
+                        if (part.type != input.type || part.count != 1)
+                            printf("Batch member %s::%s does not match the %s input\n", def.batch.c_str(), part.name.c_str(), vertFile.c_str());
+                        else
+                        {
+                            input.batched = true;
+                            ++batched;
+                        }
+                    }
+                }
+                if (batched == 0)
+                {
+                    printf("No inputs of %s match the batch struct %s\n", vertFile.c_str(), def.batch.c_str());
+                    def.batch.clear();
                 }
-                for (auto& input : def.vert.inputs)
+            }
+            if (!explicitLayout)
+            {
+                def.vert.generatedLayout = true;
+                if (yshader["vert"].has_child("split"))
                 {
-                    int offset = 0;
-                    for (int oi = 0; oi < input.loc; ++oi)
+                    yshader["vert"]["split"] >> def.vert.split;
+                    bool found = false;
+                    for (auto& input : def.vert.inputs)
+                        found |= input.name == def.vert.split;
+                    if (!found)
                     {
-                        offset += sizeOf[oi];
+                        printf("Split input %s not found in %s\n", def.vert.split.c_str(), vertFile.c_str());
+                        def.vert.split.clear();
                     }
-                    input.stride = "sizeof(float) * " + std::to_string(valueCount);
-                    input.offset = "sizeof(float) * " + std::to_string(offset);
+                }
+                int strides[2] = {};
+                for (BindingDef* input : GetInputsByLocation(def))
+                {
+                    if (input->batched)
+                        continue;
+                    input->binding = def.vert.split.empty() || input->name == def.vert.split ? 0 : 1;
+                    input->byteOffset = strides[input->binding];
+                    strides[input->binding] += InputSize(*input);
+                }
+                for (auto& input : def.vert.inputs)
+                {
+                    if (input.batched)
+                        continue;
+                    input.stride = "sizeof(float) * " + std::to_string(strides[input.binding] / 4);
+                    input.offset = "sizeof(float) * " + std::to_string(input.byteOffset / 4);
                     input.rate = "VK_VERTEX_INPUT_RATE_VERTEX";
-                    input.binding = 0;
+                }
+            }
+            if (!def.batch.empty())
+            {
+                int binding = 0;
+                for (auto& input : def.vert.inputs)
+                {
+                    if (!input.batched)
+                        binding = std::max(binding, input.binding + 1);
+                }
+                for (auto& input : def.vert.inputs)
+                {
+                    if (!input.batched)
+                        continue;
+                    input.binding = binding;
+                    input.offset = "offsetof(" + def.batch + ", " + input.name + ")";
+                    input.stride = "sizeof(" + def.batch + ")";
+                    input.rate = "VK_VERTEX_INPUT_RATE_INSTANCE";
                 }
             }
             std::string fragFile;
@@ -1656,8 +4678,84 @@ void Shader2Header(std::string baseFolder)
             def.frag.name = fragFile;
             ReadFragJson(baseFolder + fragFile, process, def);
         }
-        process.shaders.push_back(def);
+        bool depthOnly = false, keepFragment = false;
+        if (yshader.has_child("depthOnly"))
+        {
+            std::string opt;
+            yshader["depthOnly"] >> opt;
+            depthOnly = ParseBool(opt);
+            if (yshader.has_child("depthOnlyFragment"))
+            {
+                yshader["depthOnlyFragment"] >> opt;
+                keepFragment = ParseBool(opt);
+            }
+        }
+        bool lazy = false;
+        if (yshader.has_child("lazyVariants"))
+        {
+            std::string opt;
+            yshader["lazyVariants"] >> opt;
+            lazy = ParseBool(opt);
+        }
+        for (auto& variant : ReadSpecializationVariants(yshader, def))
+        {
+            VariantGroup group = {};
+            group.owner = def.name;
+            group.lazy = lazy;
+            std::vector<ShaderDef> combinations = ExpandStateVariants(yshader, variant, group);
+            AddVariantGroup(process, group, combinations);
+            if (depthOnly)
+            {
+                std::vector<ShaderDef> depth;
+                for (auto& combination : combinations)
+                    depth.push_back(MakeDepthOnlyVariant(combination, keepFragment));
+                group.name += "_DepthOnly";
+                AddVariantGroup(process, group, depth);
+            }
+        }
+    }
+    for (auto& c : process.computes)
+    {
+        for (auto& s : process.shaders)
+        {
+            if (s.name == c.name)
+                printf("Compute %s shares its name with a graphics entry, their descriptor functions collide\n", c.name.c_str());
+        }
+    }
+    PlanPushConstants(process, baseFolder);
+    if (process.descriptorBuffer && (process.dynamicUniforms || HasPushUniforms(process)))
+    {
+        //Descriptor buffers have no dynamic offsets, and every pipeline linked from shared library parts has to agree on using them
+        printf("%s: descriptorBuffer can't be used with dynamic uniforms or push blocks over the limit, descriptor sets are used\n", process.name.c_str());
+        process.descriptorBuffer = false;
+    }
+    for (auto& s : process.shaders)
+    {
+        if (process.sharedBuffers && GetVertBindings(s).size() > 8)
+        {
+            printf("%s: %s has more than the 8 vertex bindings VKBufferBindState tracks, sharedBuffers is turned off\n", process.name.c_str(), s.name.c_str());
+            process.sharedBuffers = false;
+        }
+    }
+    if (!process.bufferDeviceAddress)
+    {
+        for (auto& s : process.structs)
+        {
+            auto address = std::find_if(s.second.parts.begin(), s.second.parts.end(), [](const ShaderStructPart& p) { return p.type == Binding::ADDRESS; });
+            if (address == s.second.parts.end())
+                continue;
+            printf("%s: %s::%s is a buffer_reference, set \"bufferDeviceAddress\" to check the render target enables buffer device addresses\n",
+                process.name.c_str(), s.first.c_str(), address->name.c_str());
+            break;
+        }
     }
+    if (process.collapseDynamicState || process.dynamicVertexInput)
+        CollapsePipelines(process);
+    if (process.pipelineLibrary)
+        BuildPipelineLibraries(process);
+    if (process.shaderObject)
+        BuildShaderObjects(process);
+    MarkSharedVariants(process);
     OutputShaderImpl(process, baseFolder);
     OutputShaderHeader(process, baseFolder);
 }
@@ -3,10 +3,45 @@
 #include <vulkan/vulkan_core.h>
 struct VKPipelineData
 {
-    VkDescriptorSetLayout descriptorSetLayout;
-    VkPipelineLayout pipelineLayout;
-    VkPipeline graphicsPipeline;
-    uint32_t subIndex;
+    VkDescriptorSetLayout descriptorSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+    //Compute pipelines too. Lazy variants stay VK_NULL_HANDLE until their first draw
+    VkPipeline graphicsPipeline = VK_NULL_HANDLE;
+    uint32_t subIndex = 0;
+    //Set layout of a push block promoted to a dynamic uniform
+    VkDescriptorSetLayout pushUniformLayout = VK_NULL_HANDLE;
+    //Descriptor buffer layout: size of one set and where each binding starts, in binding declaration order
+    VkDeviceSize descriptorSize = 0;
+    VkDeviceSize descriptorOffsets[8] = {};
+};
+//Descriptors from a "descriptorBuffer" collection's _Update<Shader>DescriptorSets: a set from the render target's pools,
+//or where they were written in the frame's descriptor buffer when it is on
+struct VKDescriptorSet
+{
+    VkDescriptorSet set;
+    VkDeviceSize offset;
+    bool operator!=(const VKDescriptorSet& other) const
+    {
+        return set != other.set || offset != other.offset;
+    }
+};
+//Last state a shader object draw set on a command buffer, the group ids are per collection
+struct VKShaderObjectState
+{
+    VkCommandBuffer command;
+    const void* owner;
+    VkShaderEXT vert, frag;
+    int vertexInput, topology, rasterizer, depth, depthBias, stencil, blend;
+};
+//Vertex and index buffers a "sharedBuffers" draw last bound on a command buffer
+struct VKBufferBindState
+{
+    VkCommandBuffer command;
+    VkBuffer vertexBuffers[8];
+    VkDeviceSize offsets[8];
+    uint32_t vertexCount;
+    VkBuffer indexBuffer;
+    VkIndexType indexType;
 };
 struct VkUniform
 {
@@ -3,7 +3,7 @@
 #include "vulkan/vulkan.h"
 #include "vk_mem_alloc.h"
 
-void VK::CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t width, uint32_t height, uint8_t* rgba, 
+VK::UploadToken VK::CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t width, uint32_t height, uint8_t* rgba, 
     VK::SamplerSettings settings, VkFormat format)
 {
     texture.width = width;
@@ -33,19 +33,10 @@ void VK::CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t wi
         // Not supported.
     }
 
-    VkBufferCreateInfo stagingBufInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
-    stagingBufInfo.size = imageSize;
-    stagingBufInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    //Texels are converted straight into the staging ring
+    VK::StagingSlice staging = target->AllocStaging(nullptr, imageSize);
 
-    VmaAllocationCreateInfo stagingBufAllocCreateInfo = {};
-    stagingBufAllocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
-    stagingBufAllocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-
-    VK::Buffer staging = target->vmaPools_.transfer.alloc(nullptr, imageSize);
-    void* mapped;
-    VkResult mr = vmaMapMemory(target->allocator, staging.allocation, &mapped);
-
-    unsigned char* const pImageData = (unsigned char*)mapped;
+    unsigned char* const pImageData = staging.mapped;
     switch (format)
     {
     default:
@@ -87,7 +78,6 @@ void VK::CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t wi
         break;
     }
     }
-    vmaUnmapMemory(target->allocator, staging.allocation);
     texture.format = format;
 
     VkImageCreateInfo imageInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
@@ -112,7 +102,7 @@ void VK::CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t wi
 
     // Transition image layouts, copy image.
 
-    target->BeginUploadCommands();
+    VkCommandBuffer cmd = target->BeginUploadCommands(true);
 
     VkImageMemoryBarrier imgMemBarrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
     imgMemBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
@@ -129,7 +119,7 @@ void VK::CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t wi
     imgMemBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
 
     vkCmdPipelineBarrier(
-        target->GetUploadCmd(),
+        cmd,
         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
         VK_PIPELINE_STAGE_TRANSFER_BIT,
         0,
@@ -138,30 +128,29 @@ void VK::CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t wi
         1, &imgMemBarrier);
 
     VkBufferImageCopy region = {};
+    region.bufferOffset = staging.offset;
     region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     region.imageSubresource.layerCount = 1;
     region.imageExtent.width = width;
     region.imageExtent.height = height;
     region.imageExtent.depth = 1;
 
-    vkCmdCopyBufferToImage(target->GetUploadCmd(), staging.buffer, texture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-
-    imgMemBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    imgMemBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    imgMemBarrier.image = texture.image;
-    imgMemBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    imgMemBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-    vkCmdPipelineBarrier(
-        target->GetUploadCmd(),
-        VK_PIPELINE_STAGE_TRANSFER_BIT,
-        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-        0,
-        0, nullptr,
-        0, nullptr,
-        1, &imgMemBarrier);
+    vkCmdCopyBufferToImage(cmd, staging.buffer, texture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    //Made shader readable together with the rest of the batch
+    VkImageMemoryBarrier2 readBarrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
+    readBarrier.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+    readBarrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    readBarrier.dstStageMask = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
+    readBarrier.dstAccessMask = VK_ACCESS_2_SHADER_READ_BIT;
+    readBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    readBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    readBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    readBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    readBarrier.image = texture.image;
+    readBarrier.subresourceRange = imgMemBarrier.subresourceRange;
+    target->AddUploadImageBarrier(readBarrier, true);
 
-    target->PushSingleFrameBuffer(staging);
     // Create ImageView
 
     VkImageViewUsageCreateInfo tivci = {};
@@ -180,6 +169,7 @@ void VK::CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t wi
     vkCreateImageView(target->device, &textureImageViewInfo, nullptr, &texture.imageView);
 
     CreateTextureSampler(target, texture, settings);
+    return target->GetUploadToken(true);
 }
 void VK::CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t width, uint32_t height, uint32_t usage, 
     VK::SamplerSettings settings, VkFormat format)
@@ -207,7 +197,7 @@ void VK::CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t wi
     imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
     imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
     imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | usage;
-    if (format == VK_FORMAT_D24_UNORM_S8_UINT)
+    if (VK::IsDepthFormat(format))
         imageInfo.usage |= VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
     imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
@@ -223,7 +213,7 @@ void VK::CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t wi
     textureImageViewInfo.image = texture.image;
     textureImageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
     textureImageViewInfo.format = format;
-    if (format == VK_FORMAT_D24_UNORM_S8_UINT)
+    if (VK::IsDepthFormat(format))
     {
         textureImageViewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
     }
@@ -361,7 +351,7 @@ void generateMipmaps(VkRenderTarget* target, VkImage image, VkFormat imageFormat
         1, &barrier);
 }
 
-void VK::CreateTextureMips(VkRenderTarget* target, VK::Texture& texture, uint32_t mips, uint32_t width, uint32_t height, 
+VK::UploadToken VK::CreateTextureMips(VkRenderTarget* target, VK::Texture& texture, uint32_t mips, uint32_t width, uint32_t height, 
     uint8_t* rgba, VK::SamplerSettings settings, VkFormat format)
 {
     VkFormatProperties formatProperties;
@@ -370,8 +360,7 @@ void VK::CreateTextureMips(VkRenderTarget* target, VK::Texture& texture, uint32_
     if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_2_BLIT_DST_BIT)
         || mips <= 1
         ) {
-        VK::CreateTexture(target, texture, width, height, rgba, settings, format);
-        return;
+        return VK::CreateTexture(target, texture, width, height, rgba, settings, format);
         //throw std::runtime_error("texture image format does not support linear blitting!");
     }
     texture.width = width;
@@ -385,19 +374,10 @@ void VK::CreateTextureMips(VkRenderTarget* target, VK::Texture& texture, uint32_
     case VK_FORMAT_R8G8B8_UNORM:imageSize = width * height * 4; break;
     }
 
-    VkBufferCreateInfo stagingBufInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
-    stagingBufInfo.size = imageSize;
-    stagingBufInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-
-    VmaAllocationCreateInfo stagingBufAllocCreateInfo = {};
-    stagingBufAllocCreateInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
-    stagingBufAllocCreateInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
-
-    VK::Buffer staging = target->vmaPools_.transfer.alloc(nullptr, imageSize);
-    void* mapped;
-    VkResult mr = vmaMapMemory(target->allocator, staging.allocation, &mapped);
+    //Texels are converted straight into the staging ring
+    VK::StagingSlice staging = target->AllocStaging(nullptr, imageSize);
 
-    unsigned char* const pImageData = (unsigned char*)mapped;
+    unsigned char* const pImageData = staging.mapped;
     switch (format)
     {
     case VK_FORMAT_R8G8B8A8_UNORM: memcpy(pImageData, rgba, imageSize); break;
@@ -438,7 +418,6 @@ void VK::CreateTextureMips(VkRenderTarget* target, VK::Texture& texture, uint32_
         break;
     }
     }
-    vmaUnmapMemory(target->allocator, staging.allocation);
     texture.format = format;
 
     VkImageCreateInfo imageInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
@@ -495,6 +474,7 @@ void VK::CreateTextureMips(VkRenderTarget* target, VK::Texture& texture, uint32_
     }
 
     VkBufferImageCopy region = {};
+    region.bufferOffset = staging.offset;
     region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     region.imageSubresource.layerCount = 1;
     region.imageExtent.width = width;
@@ -522,7 +502,6 @@ void VK::CreateTextureMips(VkRenderTarget* target, VK::Texture& texture, uint32_
         1, &imgMemBarrier);
 #endif
 
-    target->PushSingleFrameBuffer(staging);
     // Create ImageView
 
     VkImageViewCreateInfo textureImageViewInfo = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
@@ -537,4 +516,5 @@ void VK::CreateTextureMips(VkRenderTarget* target, VK::Texture& texture, uint32_
     vkCreateImageView(target->device, &textureImageViewInfo, nullptr, &texture.imageView);
 
     CreateTextureSampler(target, texture, settings, mips);
+    return target->GetUploadToken();
 }
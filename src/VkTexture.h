@@ -43,14 +43,16 @@ namespace VK
         }
     }
 
-    void CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t width, uint32_t height, uint8_t* rgba, 
+    //Copies on the transfer queue when the target's asyncTransfer is on, the texture is usable once the token completes
+    VK::UploadToken CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t width, uint32_t height, uint8_t* rgba, 
         VK::SamplerSettings settings = {}, VkFormat format = VkFormat::VK_FORMAT_R8G8B8A8_UNORM);
     void CreateTexture(VkRenderTarget* target, VK::Texture& texture, uint32_t width, uint32_t height, uint32_t usage, 
         VK::SamplerSettings settings, VkFormat format);
     void CreateTextureSampler(VkRenderTarget* target, VK::Texture& texture, VK::SamplerSettings settings, uint32_t mips = 0);
     void DestroyTexture(VkRenderTarget* target, VK::Texture& texture);
 
-    void CreateTextureMips(VkRenderTarget* target, VK::Texture& texture, uint32_t mips, uint32_t width, uint32_t height, uint8_t* rgba,
+    //Mip blits need the graphics queue, only the single level fallback goes through the transfer queue
+    VK::UploadToken CreateTextureMips(VkRenderTarget* target, VK::Texture& texture, uint32_t mips, uint32_t width, uint32_t height, uint8_t* rgba,
         VK::SamplerSettings settings, VkFormat format);
 }
 #endif
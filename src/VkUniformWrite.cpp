@@ -0,0 +1,106 @@
+#include "VkUniformWrite.h"
+#include <string.h>
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define VK_UNIFORM_SSE 1
+#define VK_UNIFORM_AVX 1
+#elif defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define VK_UNIFORM_SSE 1
+#endif
+
+void VkUniformWrite::Stream(void* dst, const void* src, size_t size)
+{
+#if defined(VK_UNIFORM_SSE)
+    if (((uintptr_t)dst & 15) == 0)
+    {
+        uint8_t* d = (uint8_t*)dst;
+        const uint8_t* s = (const uint8_t*)src;
+        size_t i = 0;
+#if defined(VK_UNIFORM_AVX)
+        if (((uintptr_t)dst & 31) == 0)
+        {
+            for (; i + 32 <= size; i += 32)
+                _mm256_stream_si256((__m256i*)(d + i), _mm256_loadu_si256((const __m256i*)(s + i)));
+        }
+#endif
+        for (; i + 16 <= size; i += 16)
+            _mm_stream_si128((__m128i*)(d + i), _mm_loadu_si128((const __m128i*)(s + i)));
+        if (i < size)
+            memcpy(d + i, s + i, size - i);
+        return;
+    }
+#endif
+    memcpy(dst, src, size);
+}
+
+void VkUniformWrite::Fence()
+{
+#if defined(VK_UNIFORM_SSE)
+    _mm_sfence();
+#endif
+}
+
+void VkUniformWrite::Copy(void* dst, const void* src, size_t size, bool writeCombined)
+{
+    if (writeCombined)
+        Stream(dst, src, size);
+    else
+        memcpy(dst, src, size);
+}
+
+void VkUniformWrite::Benchmark(void* mapped, size_t mappedSize, size_t alignment)
+{
+    struct Block
+    {
+        const char* name;
+        size_t size;
+    };
+    //view, projection and view projection matrices plus the eye position; a handful of vec4 material factors
+    const Block blocks[] = {
+        { "camera", 208 },
+        { "material", 64 },
+    };
+    const int iterations = 16;
+
+    std::vector<uint8_t> system;
+    if (!mapped)
+    {
+        //Larger than the last level cache so cached writes pay for the evictions, like a real frame would
+        mappedSize = 64 * 1024 * 1024;
+        system.resize(mappedSize + 32);
+        mapped = (void*)(((uintptr_t)system.data() + 31) & ~(uintptr_t)31);
+    }
+    alignas(32) uint8_t src[256];
+    for (size_t i = 0; i < sizeof(src); ++i)
+        src[i] = (uint8_t)i;
+
+    for (const Block& block : blocks)
+    {
+        size_t stride = (block.size + alignment - 1) & ~(alignment - 1);
+        size_t count = mappedSize / stride;
+        if (count == 0)
+            continue;
+        double seconds[2];
+        for (int streaming = 0; streaming < 2; ++streaming)
+        {
+            uint8_t* dst = (uint8_t*)mapped;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int it = 0; it < iterations; ++it)
+            {
+                for (size_t i = 0; i < count; ++i)
+                    Copy(dst + i * stride, src, block.size, streaming != 0);
+            }
+            Fence();
+            seconds[streaming] = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        }
+        double writes = (double)count * iterations;
+        printf("%-8s %4zu bytes cached %7.1f ns %8.1f MB/s streaming %7.1f ns %8.1f MB/s\n", block.name, block.size,
+            seconds[0] / writes * 1e9, writes * block.size / seconds[0] / 1e6,
+            seconds[1] / writes * 1e9, writes * block.size / seconds[1] / 1e6);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef VK_UNIFORM_WRITE_H
+#define VK_UNIFORM_WRITE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Copies into mapped buffer memory. Host visible device local memory is usually write-combined: uncached, so reads
+//are slow and partial lines cost extra bus transactions. Streaming (non-temporal) stores fill whole lines without
+//reading them and keep the copied data out of the CPU caches. Used by the generated Write<Struct> functions.
+class VkUniformWrite
+{
+public:
+    //Non-temporal copy, whole 16 byte blocks are streamed when dst is 16 byte aligned and the rest is copied normally
+    //Streaming stores are weakly ordered, call Fence() before the memory is flushed or submitted
+    static void Stream(void* dst, const void* src, size_t size);
+    //Orders earlier streaming stores, VkRenderTarget calls this before submitting each frame
+    static void Fence();
+    //Streams when writeCombined is set, memcpy otherwise
+    static void Copy(void* dst, const void* src, size_t size, bool writeCombined);
+
+    //Times cached against streaming writes of camera (208 byte) and material (64 byte) sized blocks packed like
+    //uniform ring slices. Writes go to mapped (for example a slice of the uniform ring) when given, else to system memory
+    static void Benchmark(void* mapped = nullptr, size_t mappedSize = 0, size_t alignment = 256);
+};
+
+#endif
@@ -0,0 +1,278 @@
+#include "VkVertexPacking.h"
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VK_PACKING_SSE 1
+#elif defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define VK_PACKING_SSE 1
+#endif
+//GCC and Clang only allow the conversion intrinsics with -mf16c, MSVC has no such macro but every AVX2 target has F16C
+#if defined(VK_PACKING_SSE) && (defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__)))
+#include <immintrin.h>
+#define VK_PACKING_F16C 1
+#endif
+
+namespace
+{
+    enum PackKind
+    {
+        PACK_HALF,
+        PACK_SNORM16,
+        PACK_UNORM16,
+        PACK_SNORM8,
+        PACK_UNORM8
+    };
+
+    uint16_t FloatToHalf(float value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        uint32_t sign = (bits >> 16) & 0x8000;
+        int32_t exponent = (int32_t)((bits >> 23) & 0xFF) - 127 + 15;
+        uint32_t mantissa = bits & 0x7FFFFF;
+        if (exponent >= 31)
+        {
+            //Overflow becomes infinity, NaN stays NaN
+            bool nan = (bits & 0x7F800000) == 0x7F800000 && mantissa != 0;
+            return (uint16_t)(sign | 0x7C00 | (nan ? 0x200 : 0));
+        }
+        if (exponent <= 0)
+        {
+            if (exponent < -10)
+                return (uint16_t)sign;
+            mantissa |= 0x800000;
+            uint32_t shift = 14 - exponent;
+            uint32_t half = mantissa >> shift;
+            uint32_t rest = mantissa & ((1u << shift) - 1);
+            uint32_t mid = 1u << (shift - 1);
+            if (rest > mid || (rest == mid && (half & 1)))
+                ++half;
+            return (uint16_t)(sign | half);
+        }
+        //Round to nearest even, a carry into the exponent is still the correctly rounded value
+        uint32_t half = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+        uint32_t rest = mantissa & 0x1FFF;
+        if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+            ++half;
+        return (uint16_t)half;
+    }
+
+    //NaN clamps to lo, matching _mm_max_ps
+    float Clamp(float value, float lo, float hi)
+    {
+        return value > lo ? (value < hi ? value : hi) : lo;
+    }
+
+    void PackLane(PackKind kind, float value, uint8_t* dst, uint32_t lane)
+    {
+        switch (kind)
+        {
+        case PACK_HALF:
+            ((uint16_t*)dst)[lane] = FloatToHalf(value);
+            break;
+        case PACK_SNORM16:
+            ((int16_t*)dst)[lane] = (int16_t)lrintf(Clamp(value, -1.0f, 1.0f) * 32767.0f);
+            break;
+        case PACK_UNORM16:
+            ((uint16_t*)dst)[lane] = (uint16_t)lrintf(Clamp(value, 0.0f, 1.0f) * 65535.0f);
+            break;
+        case PACK_SNORM8:
+            ((int8_t*)dst)[lane] = (int8_t)lrintf(Clamp(value, -1.0f, 1.0f) * 127.0f);
+            break;
+        case PACK_UNORM8:
+            dst[lane] = (uint8_t)lrintf(Clamp(value, 0.0f, 1.0f) * 255.0f);
+            break;
+        }
+    }
+
+#ifdef VK_PACKING_SSE
+    //Packs 32 bit lanes to 16 bit, unsigned values go through the signed saturating pack with a bias
+    __m128i Pack32To16(PackKind kind, __m128i lo, __m128i hi)
+    {
+        if (kind == PACK_UNORM16)
+        {
+            const __m128i bias = _mm_set1_epi32(32768);
+            __m128i packed = _mm_packs_epi32(_mm_sub_epi32(lo, bias), _mm_sub_epi32(hi, bias));
+            return _mm_xor_si128(packed, _mm_set1_epi16((short)0x8000));
+        }
+        return _mm_packs_epi32(lo, hi);
+    }
+
+    __m128i Pack16To8(PackKind kind, __m128i packed)
+    {
+        return kind == PACK_UNORM8 ? _mm_packus_epi16(packed, packed) : _mm_packs_epi16(packed, packed);
+    }
+
+    void GetScale(PackKind kind, float& lo, float& hi, float& scale)
+    {
+        switch (kind)
+        {
+        case PACK_SNORM16: lo = -1.0f; hi = 1.0f; scale = 32767.0f; break;
+        case PACK_UNORM16: lo = 0.0f; hi = 1.0f; scale = 65535.0f; break;
+        case PACK_SNORM8: lo = -1.0f; hi = 1.0f; scale = 127.0f; break;
+        default: lo = 0.0f; hi = 1.0f; scale = 255.0f; break;
+        }
+    }
+
+    //4 lanes into the low 8 (16 bit formats) or 4 (8 bit formats) bytes
+    __m128i PackSSE(PackKind kind, __m128 v)
+    {
+        if (kind == PACK_HALF)
+        {
+#ifdef VK_PACKING_F16C
+            return _mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT);
+#else
+            alignas(16) float lanes[4];
+            alignas(16) uint16_t halves[8] = {};
+            _mm_store_ps(lanes, v);
+            for (int i = 0; i < 4; ++i)
+                halves[i] = FloatToHalf(lanes[i]);
+            return _mm_load_si128((const __m128i*)halves);
+#endif
+        }
+        float lo, hi, scale;
+        GetScale(kind, lo, hi, scale);
+        v = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(lo)), _mm_set1_ps(hi));
+        __m128i lanes = _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(scale)));
+        __m128i packed = Pack32To16(kind, lanes, lanes);
+        return kind >= PACK_SNORM8 ? Pack16To8(kind, packed) : packed;
+    }
+
+#ifdef __AVX2__
+    //8 lanes (two vertices) into the low 16 or 8 bytes
+    __m128i PackAVX(PackKind kind, __m256 v)
+    {
+        if (kind == PACK_HALF)
+        {
+#ifdef VK_PACKING_F16C
+            return _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT);
+#else
+            return _mm_unpacklo_epi64(PackSSE(kind, _mm256_castps256_ps128(v)), PackSSE(kind, _mm256_extractf128_ps(v, 1)));
+#endif
+        }
+        float lo, hi, scale;
+        GetScale(kind, lo, hi, scale);
+        v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(lo)), _mm256_set1_ps(hi));
+        __m256i lanes = _mm256_cvtps_epi32(_mm256_mul_ps(v, _mm256_set1_ps(scale)));
+        __m128i packed = Pack32To16(kind, _mm256_castsi256_si128(lanes), _mm256_extracti128_si256(lanes, 1));
+        return kind >= PACK_SNORM8 ? Pack16To8(kind, packed) : packed;
+    }
+#endif
+
+    void StoreLanes(uint8_t* dst, __m128i packed, uint32_t laneBytes)
+    {
+        if (laneBytes == 2)
+            _mm_storel_epi64((__m128i*)dst, packed);
+        else
+        {
+            int32_t lanes = _mm_cvtsi128_si32(packed);
+            memcpy(dst, &lanes, sizeof(lanes));
+        }
+    }
+#endif
+
+    void PackVertices(PackKind kind, const float* src, uint32_t srcComponents, void* dst, uint32_t dstStride, uint32_t dstComponents, uint32_t count)
+    {
+        uint32_t laneBytes = kind <= PACK_UNORM16 ? 2 : 1;
+        uint8_t* out = (uint8_t*)dst;
+        uint32_t i = 0;
+#ifdef VK_PACKING_SSE
+        //vec3 and vec4 inputs fill all 4 lanes, a vec3 read takes the next vertex's x so the last one is left to the scalar loop
+        if (dstComponents == 4 && (srcComponents == 3 || srcComponents == 4))
+        {
+            uint32_t simdCount = srcComponents == 4 ? count : (count > 0 ? count - 1 : 0);
+#ifdef __AVX2__
+            if (srcComponents == 4)
+            {
+                for (; i + 2 <= simdCount; i += 2)
+                {
+                    __m128i packed = PackAVX(kind, _mm256_loadu_ps(src + i * 4));
+                    StoreLanes(out + i * dstStride, packed, laneBytes);
+                    StoreLanes(out + (i + 1) * dstStride, laneBytes == 2 ? _mm_srli_si128(packed, 8) : _mm_srli_si128(packed, 4), laneBytes);
+                }
+            }
+#endif
+            const __m128 mask = _mm_castsi128_ps(_mm_set_epi32(srcComponents == 4 ? -1 : 0, -1, -1, -1));
+            for (; i < simdCount; ++i)
+            {
+                __m128 v = _mm_and_ps(_mm_loadu_ps(src + i * srcComponents), mask);
+                StoreLanes(out + i * dstStride, PackSSE(kind, v), laneBytes);
+            }
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            for (uint32_t c = 0; c < dstComponents; ++c)
+                PackLane(kind, c < srcComponents ? src[i * srcComponents + c] : 0.0f, out + i * dstStride, c);
+        }
+    }
+}
+
+void VkVertexPacking::PackHalf(const float* src, uint32_t srcComponents, void* dst, uint32_t dstStride, uint32_t dstComponents, uint32_t count)
+{
+    PackVertices(PACK_HALF, src, srcComponents, dst, dstStride, dstComponents, count);
+}
+
+void VkVertexPacking::PackSnorm16(const float* src, uint32_t srcComponents, void* dst, uint32_t dstStride, uint32_t dstComponents, uint32_t count)
+{
+    PackVertices(PACK_SNORM16, src, srcComponents, dst, dstStride, dstComponents, count);
+}
+
+void VkVertexPacking::PackUnorm16(const float* src, uint32_t srcComponents, void* dst, uint32_t dstStride, uint32_t dstComponents, uint32_t count)
+{
+    PackVertices(PACK_UNORM16, src, srcComponents, dst, dstStride, dstComponents, count);
+}
+
+void VkVertexPacking::PackSnorm8(const float* src, uint32_t srcComponents, void* dst, uint32_t dstStride, uint32_t dstComponents, uint32_t count)
+{
+    PackVertices(PACK_SNORM8, src, srcComponents, dst, dstStride, dstComponents, count);
+}
+
+void VkVertexPacking::PackUnorm8(const float* src, uint32_t srcComponents, void* dst, uint32_t dstStride, uint32_t dstComponents, uint32_t count)
+{
+    PackVertices(PACK_UNORM8, src, srcComponents, dst, dstStride, dstComponents, count);
+}
+
+void VkVertexPacking::Benchmark(uint32_t vertexCount)
+{
+    struct Kernel
+    {
+        const char* name;
+        void (*pack)(const float*, uint32_t, void*, uint32_t, uint32_t, uint32_t);
+        uint32_t laneBytes;
+    };
+    const Kernel kernels[] = {
+        { "half", PackHalf, 2 },
+        { "snorm16", PackSnorm16, 2 },
+        { "unorm16", PackUnorm16, 2 },
+        { "snorm8", PackSnorm8, 1 },
+        { "unorm8", PackUnorm8, 1 },
+    };
+    const int iterations = 16;
+
+    std::vector<float> src(vertexCount * 4);
+    for (size_t i = 0; i < src.size(); ++i)
+        src[i] = (float)(i % 2001) / 1000.0f - 1.0f;
+    std::vector<uint8_t> dst(vertexCount * 8);
+
+    for (const Kernel& kernel : kernels)
+    {
+        uint32_t stride = kernel.laneBytes * 4;
+        kernel.pack(src.data(), 4, dst.data(), stride, 4, vertexCount);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int it = 0; it < iterations; ++it)
+            kernel.pack(src.data(), 4, dst.data(), stride, 4, vertexCount);
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+        double vertices = (double)vertexCount * iterations;
+        printf("%-8s %9.1f Mvertices/s %9.1f MB/s in %9.1f MB/s out\n", kernel.name,
+            vertices / seconds / 1e6, vertices * 16 / seconds / 1e6, vertices * stride / seconds / 1e6);
+    }
+}
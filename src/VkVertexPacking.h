@@ -0,0 +1,22 @@
+#ifndef VK_VERTEX_PACKING_H
+#define VK_VERTEX_PACKING_H
+
+#include <stdint.h>
+
+//Float to packed vertex attribute conversion, used by the generated <name>_Pack<Shader>Vertices functions.
+//count vertices of srcComponents tightly packed floats are written as dstComponents lanes every dstStride bytes,
+//lanes past srcComponents are zero filled and normalized formats clamp their input.
+class VkVertexPacking
+{
+public:
+    static void PackHalf(const float* src, uint32_t srcComponents, void* dst, uint32_t dstStride, uint32_t dstComponents, uint32_t count);
+    static void PackSnorm16(const float* src, uint32_t srcComponents, void* dst, uint32_t dstStride, uint32_t dstComponents, uint32_t count);
+    static void PackUnorm16(const float* src, uint32_t srcComponents, void* dst, uint32_t dstStride, uint32_t dstComponents, uint32_t count);
+    static void PackSnorm8(const float* src, uint32_t srcComponents, void* dst, uint32_t dstStride, uint32_t dstComponents, uint32_t count);
+    static void PackUnorm8(const float* src, uint32_t srcComponents, void* dst, uint32_t dstStride, uint32_t dstComponents, uint32_t count);
+
+    //Times each kernel over vertexCount vec4 vertices and prints the throughput
+    static void Benchmark(uint32_t vertexCount);
+};
+
+#endif